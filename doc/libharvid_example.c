@@ -65,7 +65,7 @@ void dothework(void *dc, void *vc, const char *file_name) {
 	 * the decoder-backend as well as to this user-code.
 	 * -> it is not possible to bypass the cache.
 	 */
-	bptr = vcache_get_buffer(vc, dc, vid, frame, ji.out_width, ji.out_height, decode_fmt, &cptr, &err);
+	bptr = vcache_get_buffer(vc, dc, vid, frame, ji.out_width, ji.out_height, decode_fmt, NULL, &cptr, &err);
 
 	if (!bptr)
 	{
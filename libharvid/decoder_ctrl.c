@@ -20,7 +20,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <assert.h>
 
 #include "decoder_ctrl.h"
@@ -28,6 +30,7 @@
 #include "ffdecoder.h"
 #include "ffcompat.h"
 #include "dlog.h"
+#include "waitq.h"
 
 #define DEFAULT_PIX_FMT (PIX_FMT_RGB24) // TODO global default
 
@@ -53,18 +56,56 @@ typedef struct JVOBJECT {
   int hitcount_decoder; // least-frequently used idea
   int hitcount_info;    // least-frequently used idea
   pthread_mutex_t lock; // lock to modify flags and refcnt
+  pthread_cond_t idle;  // signaled when USED, PENDING or INFO flags are cleared
   int flags;
   int infolock_refcnt;
+  int threads;          // codec threads allocated to this decoder
+  int threads_low;      // consecutive requests that asked for fewer threads
+  int lowres_set;       // output size has been assigned since the decoder was opened
+  int lowres_w;         // largest output size of a reduced resolution decoder,
+  int lowres_h;         // 0: full resolution
+  size_t mem;           // estimated memory of the open decoder
   void *decoder;        // opaque ffdecoder
+  int64_t pool_frame;   // sort-key in JVPool (frame at last release)
+  int isfree;           // object is on the free-list
+  struct JVOBJECT *nextfree;
   struct JVOBJECT *next;
   UT_hash_handle hhi;
   UT_hash_handle hhf;
 } /*__attribute__((__packed__)) */ JVOBJECT;
 
+/* all decoder objects of a file-id, ordered by the frame
+ * they are positioned at (JVOBJECT.pool_frame) */
+typedef struct JVPool {
+  unsigned short id;
+  pthread_mutex_t lock; // lock to modify dec[] and pool_frame of its members
+  JVOBJECT **dec;
+  int cnt;
+  int alloc;
+  int64_t us_frame;     // measured decode time per frame [usec], 0: unknown
+  int64_t us_seek;      // measured overhead of a seek [usec], 0: unknown
+  UT_hash_handle hh;
+} JVPool;
+
+/* VidMap keyframe index state */
+#define VMI_NONE 0    ///< keyframe index has not been built (or the scan failed)
+#define VMI_PENDING 1 ///< a background thread is scanning the file
+#define VMI_DONE 2    ///< index is available
+
+/* retry a failed scan after this many seconds */
+#define VMI_RETRY_SEC 60
+
 typedef struct VidMap {
   unsigned short id;
   char *fn;
   time_t lru;
+  void *kfidx;          // keyframe index, shared by all decoders of this file
+  int kfidx_state;
+  time_t kfidx_retry;   // earliest time to retry a failed scan
+  void *probe;          // stream parameters, shared by all decoders of this file
+  void *gops;           // compressed packet cache, shared by all decoders of this file
+  int admit_cnt;        // admitted decode requests that have not completed
+  int64_t admit_us;     // their estimated decode time [usec]
   UT_hash_handle hh;
   UT_hash_handle hr;
 } VidMap;
@@ -73,36 +114,87 @@ typedef struct JVD {
   JVOBJECT *jvo; // list of all decoder objects
   JVOBJECT *jvf; // hash-index of jvo
   JVOBJECT *jvi; // hash-index of jvo
+  JVOBJECT *jvfree; // unused decoder objects
+  JVPool *pools;    // id -> decoder objects of the file
+  int cnt_objects;  // number of allocated decoder objects
+  time_t gc_time;   // last garbage collection of idle decoder objects
   VidMap *vml;   // filename -> id map
   VidMap *vmr;   // filename <- id map
   unsigned short monotonic; // monotonic count for VidMap ID (wrap-around case is handled)
-  int max_objects; // config
+  int max_objects; // config - hard limit
+  int file_max;    // config - max. decoder objects per file, 0: unlimited
+  size_t mem_max;  // config - memory limit for open decoders, 0: unlimited
+  size_t mem_used; // estimated memory of open decoders
+  int target_objects; // decoders to keep, adapted to the load (dctrl_adapt)
+  time_t adapt_time;  // last adaption
+  int waits;          // requests that queued for a decoder since the last adaption
+  int64_t wait_us;    // their total wait time
+  int used_now;       // decoders currently in use
+  int used_peak;      // max. used_now since the last adaption
   int cache_size;  // config
+  char *index_cachedir; // config - keyframe index sidecar files
+  size_t gop_cache_size; // config - max. bytes of cached packets per file
+  int use_mmap;      // config - read local files through a memory-mapping
+  void *scale_pool;  // sliced colour-space conversion, shared by the decoders
+  int codec_threads; // config - default codec threads per decoder
+  int max_threads;   // config - limit for codec threads of all open decoders
+  int threads_used;  // codec threads allocated by open decoders
   int busycnt; // prevent cache purge/cleanup while decoders are active
+  int index_builds; // background keyframe index scans in progress
   int purge_in_progress;
-  pthread_mutex_t lock_jvo;  // lock to modify (append to) jvo list (TODO consolidate w/ lock_jdh)
-  pthread_rwlock_t lock_jdh; // lock for jvo index-hash
+  pthread_mutex_t lock_jvo;  // lock to modify (append to) jvo list and free-list (TODO consolidate w/ lock_jdh)
+  pthread_rwlock_t lock_jdh; // lock for jvo index-hash and pools
   pthread_rwlock_t lock_vml; // lock to modify monotonic (TODO consolidate w/ lock_jdh)
-  pthread_mutex_t lock_busy; // lock to modify busycnt;
+  pthread_mutex_t lock_busy; // lock to modify busycnt, threads_used, index_builds;
+  pthread_cond_t cond_busy;  // signaled when busycnt, purge_in_progress or index_builds drops
+  waitq wq;                  // requests waiting for a decoder object
+  int n_workers;             // decode worker threads, 0: decode in the calling thread
+  pthread_t *workers;
+  int workers_stop;
+  struct dctrl_job *jobs[DPRIO_LEVELS];      // queued jobs, FIFO per priority
+  struct dctrl_job *jobs_tail[DPRIO_LEVELS];
+  int jobs_queued[DPRIO_LEVELS];
+  int jobs_bypassed[DPRIO_LEVELS]; // jobs run from other levels while this one was waiting
+  unsigned long jobs_done;
+  unsigned long jobs_expired; // jobs that were not started before their deadline
+  pthread_mutex_t lock_jobs; // lock for the job queue
+  pthread_cond_t cond_jobs;  // signaled when a job is queued
+  int admit_max_ms;          // config - reject requests that would wait longer, 0: off
+  int admit_cnt;             // admitted decode requests that have not completed
+  int64_t admit_us;          // their estimated decode time [usec]
+  unsigned long admit_rejected;
+  pthread_mutex_t lock_admit; // lock for admit_* here and in VidMap
 } JVD;
 
 ///////////////////////////////////////////////////////////////////////////////
 // ffdecoder wrappers
 
-static inline int my_decode(void *vd, unsigned long frame, uint8_t *b, int w, int h) {
+static inline int my_decode(void *vd, unsigned long frame, uint8_t *b, int w, int h, DecoderHints *dh) {
   int rv;
   ff_resize(vd, w, h, b, NULL);
+  if (dh) {
+    ff_set_seekmode(vd, dh->seekmode);
+    ff_set_harvest(vd, dh->harvest_get, dh->harvest_done, dh->harvest_arg);
+  }
   rv = ff_render(vd, frame, b, w, h, 0, w, w);
+  if (dh) {
+    dh->frame = ff_get_frame(vd);
+    ff_set_seekmode(vd, SEEKMODE_EXACT);
+    ff_set_harvest(vd, NULL, NULL, NULL);
+  }
   ff_set_bufferptr(vd, NULL);
   return rv;
 }
 
-static inline int my_open_movie(void **vd, char *fn, int render_fmt) {
+static inline int my_open_movie(void **vd, char *fn, int render_fmt, int threads, void *probe, int use_mmap) {
   if (!fn) {
     dlog(DLOG_ERR, "DCTL: trying to open file w/o filename.\n");
     return -1;
   }
   ff_create(vd);
+  ff_set_threads(*vd, threads);
+  ff_set_probe(*vd, probe);
+  ff_set_mmap(*vd, use_mmap);
   assert (
          render_fmt == PIX_FMT_YUV420P
       || render_fmt == PIX_FMT_YUV440P
@@ -137,96 +229,355 @@ static inline void my_get_info_canonical(void *vd, VInfo *i, int w, int h) {
   ff_get_info_canonical(vd, i, w, h);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Codec thread budget
+//
+
+/* allocate codec threads for a decoder that currently holds 'have' threads.
+ * Every decoder gets at least one thread, additional threads are only
+ * handed out while the total stays below jvd->max_threads.
+ */
+static int threads_alloc(JVD *jvd, int want, int have) {
+  int n;
+  if (want < 1) want = jvd->codec_threads;
+  pthread_mutex_lock(&jvd->lock_busy);
+  n = jvd->max_threads - jvd->threads_used + have;
+  if (n > want) n = want;
+  if (n < 1) n = 1;
+  jvd->threads_used += n - have;
+  pthread_mutex_unlock(&jvd->lock_busy);
+  return n;
+}
+
+/* release the codec threads and the memory accounted to a decoder that is
+ * closed, a re-opened decoder is assigned its output size anew */
+static void threads_free(JVD *jvd, JVOBJECT *jvo) {
+  pthread_mutex_lock(&jvd->lock_busy);
+  jvd->threads_used -= jvo->threads;
+  jvd->mem_used -= jvo->mem;
+  pthread_mutex_unlock(&jvd->lock_busy);
+  jvo->threads = 0;
+  jvo->threads_low = 0;
+  jvo->lowres_set = 0;
+  jvo->lowres_w = jvo->lowres_h = 0;
+  jvo->mem = 0;
+}
+
+/* update the memory estimate of an open decoder */
+static void mem_update(JVD *jvd, JVOBJECT *jvo) {
+  const size_t mem = jvo->decoder ? ff_get_memsize(jvo->decoder) : 0;
+  pthread_mutex_lock(&jvd->lock_busy);
+  jvd->mem_used += mem - jvo->mem;
+  jvo->mem = mem;
+  pthread_mutex_unlock(&jvd->lock_busy);
+}
+
+static inline int mem_full(JVD *jvd) {
+  return jvd->mem_max > 0 && jvd->mem_used >= jvd->mem_max;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Video object management
 //
 
-static JVOBJECT *newjvo (JVOBJECT *jvo, pthread_mutex_t *appendlock) {
+static JVOBJECT *newjvo (JVD *jvd) {
   debugmsg(DEBUG_DCTL, "DCTL: newjvo() allocated new decoder object\n");
   JVOBJECT *n = calloc(1, sizeof(JVOBJECT));
   n->fmt = PIX_FMT_NONE;
   n->frame = -1;
+  n->pool_frame = -1;
   pthread_mutex_init(&n->lock, NULL);
-  JVOBJECT *cptr = jvo;
-  pthread_mutex_lock(appendlock);
-  while (cptr && cptr->next) cptr = cptr->next;
-  if (cptr) cptr->next = n;
-  pthread_mutex_unlock(appendlock);
+  pthread_cond_init(&n->idle, NULL);
+  pthread_mutex_lock(&jvd->lock_jvo);
+  if (jvd->jvo) {
+    /* the list-head is never freed, insert after it */
+    n->next = jvd->jvo->next;
+    jvd->jvo->next = n;
+  } else {
+    jvd->jvo = n;
+  }
+  jvd->cnt_objects++;
+  pthread_mutex_unlock(&jvd->lock_jvo);
   return(n);
 }
 
-/* return idle decoder-object for given file-id
- * prefer decoders with nearby (lower) frame-number
- *
- * this function is non-blocking (no locking):
- * there is no guarantee that the returned object's state
- * was not changed meanwhile.
- */
-static JVOBJECT *testjvd(JVOBJECT *jvo, unsigned short id, int fmt, int64_t frame) {
-  JVOBJECT *cptr;
-  JVOBJECT *dec_closed = NULL;
-  JVOBJECT *dec_open = NULL;
-  time_t lru_open = time(NULL) + 1;
-  time_t lru_closed = time(NULL) + 1;
-  int64_t framediff = -1;
-  int found = 0, avail = 0;
+/* the free-list holds decoder objects which are not
+ * associated with any file. lock_jvo must be held. */
+static void freelist_push(JVD *jvd, JVOBJECT *jvo) {
+  if (jvo->isfree) return;
+  jvo->isfree = 1;
+  jvo->nextfree = jvd->jvfree;
+  jvd->jvfree = jvo;
+}
 
-  for (cptr = jvo; cptr; cptr = cptr->next) {
-    if (!(cptr->flags&VOF_VALID) || cptr->id != id) {
-      continue;
+static JVOBJECT *freelist_pop(JVD *jvd) {
+  JVOBJECT *jvo = jvd->jvfree;
+  if (jvo) {
+    jvd->jvfree = jvo->nextfree;
+    jvo->nextfree = NULL;
+    jvo->isfree = 0;
+  }
+  return jvo;
+}
+
+/* index of the first pool member positioned after the given frame */
+static int pool_upper(JVPool *jp, int64_t frame) {
+  int lo = 0, hi = jp->cnt;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (jp->dec[mid]->pool_frame <= frame) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    if (fmt != PIX_FMT_NONE && cptr->fmt != fmt
-        && cptr->fmt != PIX_FMT_NONE
-        ) {
-      continue;
+  }
+  return lo;
+}
+
+static void pool_insert(JVPool *jp, JVOBJECT *jvo) {
+  int i;
+  if (jp->cnt >= jp->alloc) {
+    jp->alloc = jp->alloc ? jp->alloc * 2 : 4;
+    jp->dec = realloc(jp->dec, jp->alloc * sizeof(JVOBJECT*));
+  }
+  i = pool_upper(jp, jvo->pool_frame);
+  memmove(&jp->dec[i + 1], &jp->dec[i], (jp->cnt - i) * sizeof(JVOBJECT*));
+  jp->dec[i] = jvo;
+  jp->cnt++;
+}
+
+static int pool_remove(JVPool *jp, JVOBJECT *jvo) {
+  int i = pool_upper(jp, jvo->pool_frame);
+  while (--i >= 0 && jp->dec[i] != jvo) ;
+  if (i < 0) return -1;
+  memmove(&jp->dec[i], &jp->dec[i + 1], (jp->cnt - i - 1) * sizeof(JVOBJECT*));
+  jp->cnt--;
+  return 0;
+}
+
+/* add decoder object to the pool of its file-id, lock_jdh must be write-locked */
+static void pool_link(JVD *jvd, JVOBJECT *jvo) {
+  JVPool *jp;
+  HASH_FIND(hh, jvd->pools, &jvo->id, sizeof(unsigned short), jp);
+  if (!jp) {
+    jp = calloc(1, sizeof(JVPool));
+    jp->id = jvo->id;
+    pthread_mutex_init(&jp->lock, NULL);
+    HASH_ADD(hh, jvd->pools, id, sizeof(unsigned short), jp);
+  }
+  pthread_mutex_lock(&jp->lock);
+  jvo->pool_frame = jvo->frame;
+  pool_insert(jp, jvo);
+  pthread_mutex_unlock(&jp->lock);
+}
+
+/* remove decoder object from its pool, before the object's id is reset */
+static void pool_unlink(JVD *jvd, JVOBJECT *jvo) {
+  JVPool *jp;
+  pthread_rwlock_wrlock(&jvd->lock_jdh);
+  HASH_FIND(hh, jvd->pools, &jvo->id, sizeof(unsigned short), jp);
+  if (jp) {
+    pthread_mutex_lock(&jp->lock);
+    pool_remove(jp, jvo);
+    pthread_mutex_unlock(&jp->lock);
+    if (jp->cnt == 0) {
+      HASH_DEL(jvd->pools, jp);
+      pthread_mutex_destroy(&jp->lock);
+      free(jp->dec);
+      free(jp);
     }
-    found++;
+  }
+  pthread_rwlock_unlock(&jvd->lock_jdh);
+}
 
-    if (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) {
-      continue;
+/* re-sort a decoder object after it was used (frame changed) */
+static void pool_update(JVD *jvd, JVOBJECT *jvo) {
+  JVPool *jp;
+  if (jvo->pool_frame == jvo->frame) return;
+  pthread_rwlock_rdlock(&jvd->lock_jdh);
+  HASH_FIND(hh, jvd->pools, &jvo->id, sizeof(unsigned short), jp);
+  if (jp) {
+    pthread_mutex_lock(&jp->lock);
+    if (!pool_remove(jp, jvo)) {
+      jvo->pool_frame = jvo->frame;
+      pool_insert(jp, jvo);
     }
-    avail++;
+    pthread_mutex_unlock(&jp->lock);
+  }
+  pthread_rwlock_unlock(&jvd->lock_jdh);
+}
 
-    if (!(cptr->flags&VOF_OPEN)) {
-      if (cptr->lru < lru_closed) {
-        lru_closed = cptr->lru;
-        dec_closed = cptr;
-      }
-      continue;
+/* 0: busy or not usable, 1: idle and closed, 2: idle and open */
+static inline int jvo_avail(JVOBJECT *cptr, unsigned short id, int fmt) {
+  if (!(cptr->flags&VOF_VALID) || cptr->id != id) {
+    return 0;
+  }
+  if (fmt != PIX_FMT_NONE && cptr->fmt != fmt
+      && cptr->fmt != PIX_FMT_NONE
+      ) {
+    return 0;
+  }
+  if (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) {
+    return 0;
+  }
+  return (cptr->flags&VOF_OPEN) ? 2 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// decode cost model
+//
+// a decoder positioned at frame p either reads on to the requested
+// frame t, or seeks back to the keyframe kf before t and decodes
+// from there (see my_seek_frame() in ffdecoder.c). The time per frame
+// and the overhead of a seek are measured per file.
+
+/* estimates until the first measurement */
+#define COST_FRAME_US 5000
+#define COST_SEEK_US 20000
+#define COST_OPEN_US 100000
+#define COST_REOPEN_US 50000
+
+/* w/o keyframe index, the decoder reads on for up to this many frames */
+#define COST_CONT_FRAMES 32
+
+/* look up the keyframe before the given frame in the file's index, -1: unknown */
+static int64_t dctrl_keyframe(JVD *jvd, unsigned short id, int64_t frame) {
+  VidMap *vm;
+  int64_t kf = -1;
+  if (frame < 0) return -1;
+  pthread_rwlock_rdlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &id, sizeof(unsigned short), vm);
+  if (vm && vm->kfidx) {
+    kf = ff_index_keyframe_at(vm->kfidx, frame);
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+  return kf;
+}
+
+/* will a decoder at frame p seek to reach frame t */
+static inline int dctrl_seeks(int64_t p, int64_t t, int64_t kf) {
+  if (p < 0 || p >= t) return 1;
+  if (kf >= 0) return kf > p;
+  return t - p > COST_CONT_FRAMES;
+}
+
+/* number of frames to decode after a seek, kf: -1 if unknown */
+static inline int64_t dctrl_seek_frames(int64_t t, int64_t kf) {
+  return kf >= 0 ? t - kf + 1 : 1;
+}
+
+/* reduced resolution decoder, the codec is re-opened for output size w x h */
+static inline int jvo_reopens(JVOBJECT *jvo, int w, int h) {
+  return jvo->lowres_w > 0 && (w > jvo->lowres_w || h > jvo->lowres_h);
+}
+
+/* estimated time [usec] for decoder-object at frame p to deliver frame t
+ * at output size w x h, pool must be locked. */
+static int64_t dctrl_cost(JVPool *jp, JVOBJECT *jvo, int64_t t, int64_t kf, int open, int w, int h) {
+  const int64_t us_frame = jp->us_frame > 0 ? jp->us_frame : COST_FRAME_US;
+  const int64_t us_seek = jp->us_seek > 0 ? jp->us_seek : COST_SEEK_US;
+  int64_t p = open ? jvo->pool_frame : -1;
+  int64_t cost = open ? 0 : COST_OPEN_US;
+  if (open && jvo_reopens(jvo, w, h)) {
+    /* reduced resolution decoder, the codec is re-opened at full size */
+    cost += COST_REOPEN_US;
+    p = -1;
+  }
+  if (t < 0) {
+    return cost; // info lookup
+  }
+  if (dctrl_seeks(p, t, kf)) {
+    cost += us_seek + dctrl_seek_frames(t, kf) * us_frame;
+  } else {
+    cost += (t - p) * us_frame;
+  }
+  return cost;
+}
+
+/* update the file's cost estimate with the time a decode took */
+static void dctrl_cost_sample(JVD *jvd, unsigned short id, int seek, int64_t frames, int64_t us) {
+  JVPool *jp;
+  if (frames < 1 || us < 0) return;
+  pthread_rwlock_rdlock(&jvd->lock_jdh);
+  HASH_FIND(hh, jvd->pools, &id, sizeof(unsigned short), jp);
+  if (jp) {
+    pthread_mutex_lock(&jp->lock);
+    if (!seek) {
+      const int64_t s = us / frames;
+      jp->us_frame = jp->us_frame > 0 ? jp->us_frame + (s - jp->us_frame) / 8 : s;
+    } else if (jp->us_frame > 0) {
+      int64_t s = us - frames * jp->us_frame;
+      if (s < 0) s = 0;
+      jp->us_seek = jp->us_seek > 0 ? jp->us_seek + (s - jp->us_seek) / 8 : s;
     }
+    pthread_mutex_unlock(&jp->lock);
+  }
+  pthread_rwlock_unlock(&jvd->lock_jdh);
+}
 
-    if (frame < 0) { // LRU only
-      if (cptr->lru < lru_open) {
-        lru_open = cptr->lru;
-        dec_open = cptr;
+/* return idle decoder-object for given file-id: the one that
+ * is expected to deliver the frame fastest.
+ *
+ * Only decoders positioned between the keyframe and the frame
+ * read on without a seek. They are found by bisecting the pool,
+ * the closest one is the fastest. All others seek at the same
+ * cost: of those an open one is preferred and the least recently
+ * used one is picked, so that decoders remain parked where they
+ * were used last.
+ *
+ * this function is non-blocking (only the pool is locked):
+ * there is no guarantee that the returned object's state
+ * was not changed meanwhile.
+ */
+static JVOBJECT *testjvd(JVD *jvd, unsigned short id, int fmt, int64_t frame, int w, int h) {
+  JVPool *jp;
+  JVOBJECT *best = NULL;
+  int64_t best_cost = 0;
+  int k, total = 0;
+  const int64_t kf = dctrl_keyframe(jvd, id, frame);
+
+  pthread_rwlock_rdlock(&jvd->lock_jdh);
+  HASH_FIND(hh, jvd->pools, &id, sizeof(unsigned short), jp);
+  if (jp) {
+    pthread_mutex_lock(&jp->lock);
+    total = jp->cnt;
+    if (frame > 0) {
+      int64_t lo = kf >= 0 ? kf : frame - COST_CONT_FRAMES;
+      if (lo < 0) lo = 0;
+      for (k = pool_upper(jp, frame - 1) - 1; k >= 0 && jp->dec[k]->pool_frame >= lo; --k) {
+        JVOBJECT *jvo = jp->dec[k];
+        if (jvo_avail(jvo, id, fmt) == 2 && !jvo_reopens(jvo, w, h)) {
+          best = jvo;
+          break;
+        }
       }
-    } else { // check frame proximity
-      int64_t fd = frame - cptr->frame;
-      if (framediff < 0 || (fd >= 0 && fd == framediff)) {
-        if (cptr->lru < lru_open) {
-          lru_open = cptr->lru;
-          dec_open = cptr;
-          if (fd > 0)
-            framediff = fd;
+    }
+    if (!best) {
+      int best_rank = 0;
+      for (k = 0; k < jp->cnt; ++k) {
+        JVOBJECT *jvo = jp->dec[k];
+        const int avail = jvo_avail(jvo, id, fmt);
+        int rank;
+        if (!avail) continue;
+        /* 0: open, 1: open at reduced resolution, 2: closed */
+        rank = avail == 1 ? 2 : jvo_reopens(jvo, w, h);
+        if (!best || rank < best_rank || (rank == best_rank && jvo->lru < best->lru)) {
+          best = jvo;
+          best_rank = rank;
         }
-      } else if (fd >= 0 && fd < framediff) {
-          lru_open = cptr->lru;
-          dec_open = cptr;
-          framediff = fd;
       }
     }
-  } /* end loop over all decoder objects */
+    if (best) {
+      best_cost = dctrl_cost(jp, best, frame, kf, jvo_avail(best, id, fmt) == 2, w, h);
+    }
+    pthread_mutex_unlock(&jp->lock);
+  }
+  pthread_rwlock_unlock(&jvd->lock_jdh);
 
-  debugmsg(DEBUG_DCTL, "DCTL: found %d avail. from %d total decoder(s) for file-id:%d. [%s]\n",
-      avail, found, id, dec_open?"open":dec_closed?"closed":"N/A");
+  debugmsg(DEBUG_DCTL, "DCTL: %d decoder(s) for file-id:%d. [%s, est. %"PRId64"us]\n",
+      total, id, best ? (best->flags&VOF_OPEN ? "open" : "closed") : "N/A", best_cost);
 
-  if (dec_open) {
-    return(dec_open);
-  }
-  if (dec_closed) {
-    return(dec_closed);
-  }
-  return(NULL);
+  return(best);
 }
 
 static void hashref_delete_jvo(JVD *jvd, JVOBJECT *jvo) {
@@ -272,10 +623,9 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
 #endif
     jvd->purge_in_progress++;
     while (jvd->busycnt > 0) {
-      pthread_mutex_unlock(&jvd->lock_busy);
-      mymsleep(5);
-      pthread_mutex_lock(&jvd->lock_busy);
+      pthread_cond_wait(&jvd->cond_busy, &jvd->lock_busy);
     }
+    pthread_mutex_unlock(&jvd->lock_busy);
   }
 
   pthread_mutex_lock(l);
@@ -308,9 +658,7 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
       if (f < 4) {
 	dlog(DLOG_WARNING, "DTCL: waiting for decoder to be unlocked.\n");
         do {
-          pthread_mutex_unlock(&cptr->lock);
-          mymsleep(5);
-          pthread_mutex_lock(&cptr->lock);
+          pthread_cond_wait(&cptr->idle, &cptr->lock);
         } while (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO));
       } else {
         /* we really should not do this */
@@ -322,6 +670,7 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
 
     if (cptr->flags&VOF_OPEN) {
       my_destroy(&cptr->decoder);
+      threads_free(jvd, cptr);
       cptr->decoder = NULL;
       cptr->flags &= ~VOF_OPEN;
       cptr->fmt = PIX_FMT_NONE;
@@ -330,6 +679,7 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
     hashref_delete_jvo(jvd, cptr);
 
     if (f > 0) {
+      if (cptr->flags&VOF_VALID) pool_unlink(jvd, cptr);
       cptr->id = 0;
       cptr->lru = 0;
       cptr->hitcount_info = 0;
@@ -344,19 +694,40 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
     if (f > 1 && mem != jvd->jvo) {
       prev->next = cptr;
       pthread_mutex_destroy(&mem->lock);
+      pthread_cond_destroy(&mem->idle);
       free(mem);
+      jvd->cnt_objects--;
       freed++;
     } else {
+      if (f == 1 && !(mem->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO))) {
+        freelist_push(jvd, mem);
+      }
       prev = mem;
       cleared++;
     }
   }
+
+  if (f > 1) {
+    /* objects may have been freed, re-create the free-list */
+    jvd->jvfree = NULL;
+    for (cptr = jvd->jvo; cptr; cptr = cptr->next) {
+      cptr->isfree = 0;
+      if (!(cptr->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO))) {
+        freelist_push(jvd, cptr);
+      }
+    }
+  }
   pthread_mutex_unlock(l);
 
   if (f > 1) {
+    pthread_mutex_lock(&jvd->lock_busy);
     jvd->purge_in_progress--;
+    pthread_cond_broadcast(&jvd->cond_busy);
     pthread_mutex_unlock(&jvd->lock_busy);
   }
+  if (cleared > 0 || freed > 0) {
+    wq_notify(&jvd->wq);
+  }
 
   debugmsg(DEBUG_DCTL, "DCTL: GC processed %d (freed: %d, cleared: %d, busy: %d) skipped: %d, total: %d\n", count, freed, cleared, busy, skipped, total);
   return (cleared);
@@ -364,16 +735,32 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
 
 
 //get some unused allocated jvo or create one.
+static void dctrl_adapt(JVD *jvd);
+
 static JVOBJECT *getjvo(JVD *jvd) {
-  int cnt_total = 0;
+  int cnt_total;
   JVOBJECT *dec_closed = NULL;
   JVOBJECT *dec_open = NULL;
-  time_t lru = time(NULL) + 1;
-  JVOBJECT *cptr = jvd->jvo;
-#if 1 // garbage collect, close decoders not used since > 10 mins
-  clearjvo(jvd, 1, -1, 600, &jvd->lock_jvo);
-#endif
-  while (cptr) {
+  const time_t now = time(NULL);
+  time_t lru = now + 1;
+  JVOBJECT *cptr;
+  dctrl_adapt(jvd);
+  pthread_mutex_lock(&jvd->lock_jvo);
+  cptr = freelist_pop(jvd);
+  cnt_total = jvd->cnt_objects;
+  pthread_mutex_unlock(&jvd->lock_jvo);
+  if (cptr) {
+    return (cptr);
+  }
+
+  // TODO prefer to allocate a new decoder object IFF
+  // decoder for same file exists but with different format.
+  if (cnt_total < jvd->target_objects
+      && cnt_total < jvd->max_objects && !mem_full(jvd))
+    return(newjvo(jvd));
+
+  /* all objects are associated with a file, re-use the LRU idle one */
+  for (cptr = jvd->jvo; cptr; cptr = cptr->next) {
     if ((cptr->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO)) == 0) {
       return (cptr);
     }
@@ -385,8 +772,6 @@ static JVOBJECT *getjvo(JVD *jvd) {
       lru = cptr->lru;
       dec_open = cptr;
     }
-    cptr = cptr->next;
-    cnt_total++;
   }
 
   if (dec_closed) {
@@ -397,22 +782,18 @@ static JVOBJECT *getjvo(JVD *jvd) {
   debugmsg(DEBUG_DCTL, "DCTL: %d/%d decoders; avail: closed: %s open: %s\n",
       cnt_total, jvd->max_objects, dec_closed?"Y":"N", dec_open?"Y":"N");
 
-  // TODO prefer to allocate a new decoder object IFF
-  // decoder for same file exists but with different format.
-  if (cnt_total < 4
-      && cnt_total < jvd->max_objects)
-    return(newjvo(jvd->jvo, &jvd->lock_jvo));
-
   if (cptr && !pthread_mutex_trylock(&cptr->lock)) {
       if (!(cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO))) {
 
         if (cptr->flags&(VOF_OPEN)) {
           my_destroy(&cptr->decoder); // close it.
+          threads_free(jvd, cptr);
           cptr->decoder = NULL; // not really need..
           cptr->fmt = PIX_FMT_NONE;
         }
 
         hashref_delete_jvo(jvd, cptr);
+        if (cptr->flags&VOF_VALID) pool_unlink(jvd, cptr);
 
         cptr->id = 0;
         cptr->lru = 0;
@@ -427,8 +808,9 @@ static JVOBJECT *getjvo(JVD *jvd) {
     pthread_mutex_unlock(&cptr->lock);
   }
 
-  if (cnt_total < jvd->max_objects)
-    return(newjvo(jvd->jvo, &jvd->lock_jvo));
+  /* burst: grow beyond the target, up to the hard limit */
+  if (cnt_total < jvd->max_objects && !mem_full(jvd))
+    return(newjvo(jvd));
   return (NULL);
 }
 
@@ -444,6 +826,9 @@ static void clearvid(JVD* jvd, void *vc) {
     HASH_DELETE(hr, jvd->vmr, vm);
     if (vc) vcache_clear(vc, vm->id);
     clearjvo(jvd, 3, vm->id, -1, &jvd->lock_jvo);
+    if (vm->kfidx) ff_index_unref(vm->kfidx);
+    if (vm->probe) ff_probe_unref(vm->probe);
+    if (vm->gops) ff_gopcache_unref(vm->gops);
     free(vm->fn);
     free(vm);
   }
@@ -490,6 +875,9 @@ static unsigned short get_id(JVD *jvd, const char *fn, void *vc) {
     if (vlru) {
       HASH_DEL(jvd->vml, vlru);
       HASH_DELETE(hr, jvd->vmr, vlru);
+      if (vlru->kfidx) ff_index_unref(vlru->kfidx);
+      if (vlru->probe) ff_probe_unref(vlru->probe);
+      if (vlru->gops) ff_gopcache_unref(vlru->gops);
       free(vlru->fn);
       vm = vlru;
       memset(vm, 0, sizeof(VidMap));
@@ -532,6 +920,9 @@ static void release_id(JVD *jvd, unsigned short id) {
     HASH_DEL(jvd->vml, vm);
     HASH_DELETE(hr, jvd->vmr, vm);
     pthread_rwlock_unlock(&jvd->lock_vml);
+    if (vm->kfidx) ff_index_unref(vm->kfidx);
+    if (vm->probe) ff_probe_unref(vm->probe);
+    if (vm->gops) ff_gopcache_unref(vm->gops);
     free(vm->fn);
     free(vm);
     return;
@@ -540,25 +931,192 @@ static void release_id(JVD *jvd, unsigned short id) {
   dlog(LOG_ERR, "failed to delete ID from hash table\n");
 }
 
+/* stream parameters of a file that was opened before, if any */
+static void *get_probe(JVD *jvd, unsigned short id) {
+  VidMap *vm;
+  void *pr = NULL;
+  pthread_rwlock_rdlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &id, sizeof(unsigned short), vm);
+  if (vm && vm->probe) pr = ff_probe_ref(vm->probe);
+  pthread_rwlock_unlock(&jvd->lock_vml);
+  return pr;
+}
+
+/* remember the stream parameters of the first decoder that opened the file,
+ * later decoders for the same file skip avformat_find_stream_info().
+ */
+static void set_probe(JVD *jvd, JVOBJECT *jvo) {
+  VidMap *vm;
+  void *pr = ff_get_probe(jvo->decoder);
+  if (!pr) return;
+  pthread_rwlock_wrlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &jvo->id, sizeof(unsigned short), vm);
+  if (vm && !vm->probe) {
+    vm->probe = pr;
+    pr = NULL;
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+  if (pr) ff_probe_unref(pr);
+}
+
+typedef struct {
+  JVD *jvd;
+  unsigned short id;
+  char *fn;
+  void *probe;
+} index_job;
+
+/* scan a file on a private decoder and publish the index in its VidMap */
+static void *index_thread(void *arg) {
+  index_job *job = (index_job*) arg;
+  JVD *jvd = job->jvd;
+  VidMap *vm;
+  void *vd = NULL;
+  void *idx = NULL;
+
+  if (!my_open_movie(&vd, job->fn, DEFAULT_PIX_FMT, 1, job->probe, jvd->use_mmap)) {
+    idx = ff_index_create(vd, jvd->index_cachedir);
+    my_destroy(&vd);
+  }
+
+  pthread_rwlock_wrlock(&jvd->lock_vml);
+  /* the ID may have been released or re-assigned meanwhile */
+  HASH_FIND(hr, jvd->vmr, &job->id, sizeof(unsigned short), vm);
+  if (vm && vm->kfidx_state == VMI_PENDING && !strcmp(vm->fn, job->fn)) {
+    if (idx) {
+      vm->kfidx = ff_index_ref(idx);
+      vm->kfidx_state = VMI_DONE;
+    } else {
+      vm->kfidx_state = VMI_NONE;
+      vm->kfidx_retry = time(NULL) + VMI_RETRY_SEC;
+    }
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+  debugmsg(DEBUG_DCTL, "DCTL: keyframe index for file-id:%d %s\n", job->id, idx ? "is ready" : "failed");
+
+  if (idx) ff_index_unref(idx);
+  if (job->probe) ff_probe_unref(job->probe);
+  free(job->fn);
+  free(job);
+
+  pthread_mutex_lock(&jvd->lock_busy);
+  jvd->index_builds--;
+  pthread_cond_broadcast(&jvd->cond_busy);
+  pthread_mutex_unlock(&jvd->lock_busy);
+  return NULL;
+}
+
+static int index_start(JVD *jvd, VidMap *vm) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  index_job *job = calloc(1, sizeof(index_job));
+  int rv;
+  if (!job) return -1;
+  job->jvd = jvd;
+  job->id = vm->id;
+  job->fn = strdup(vm->fn);
+  job->probe = vm->probe ? ff_probe_ref(vm->probe) : NULL;
+
+  pthread_mutex_lock(&jvd->lock_busy);
+  jvd->index_builds++;
+  pthread_mutex_unlock(&jvd->lock_busy);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  rv = pthread_create(&thread, &attr, index_thread, job);
+  pthread_attr_destroy(&attr);
+  if (rv) {
+    pthread_mutex_lock(&jvd->lock_busy);
+    jvd->index_builds--;
+    pthread_cond_broadcast(&jvd->cond_busy);
+    pthread_mutex_unlock(&jvd->lock_busy);
+    if (job->probe) ff_probe_unref(job->probe);
+    free(job->fn);
+    free(job);
+    return -1;
+  }
+  return 0;
+}
+
+/* assign the file's keyframe index to a decoder that does not have one.
+ * The first decoder for a given file starts building the index in the
+ * background, decoders continue without it (seeking) until it is ready.
+ */
+static void attach_index(JVD *jvd, JVOBJECT *jvo) {
+  VidMap *vm;
+  void *idx = NULL;
+
+  if (ff_has_index(jvo->decoder)) return;
+
+  pthread_rwlock_wrlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &jvo->id, sizeof(unsigned short), vm);
+  if (vm) {
+    if (vm->kfidx) {
+      idx = ff_index_ref(vm->kfidx);
+    } else if (vm->kfidx_state == VMI_NONE && time(NULL) >= vm->kfidx_retry) {
+      debugmsg(DEBUG_DCTL, "DCTL: building keyframe index for file-id:%d\n", jvo->id);
+      vm->kfidx_state = VMI_PENDING;
+      if (index_start(jvd, vm)) {
+        vm->kfidx_state = VMI_NONE;
+        vm->kfidx_retry = time(NULL) + VMI_RETRY_SEC;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+
+  if (idx) {
+    ff_set_index(jvo->decoder, idx);
+    ff_index_unref(idx);
+  }
+}
+
+/* assign the file's packet cache to a freshly opened decoder */
+static void attach_gopcache(JVD *jvd, JVOBJECT *jvo) {
+  VidMap *vm;
+  void *gc = NULL;
+  if (jvd->gop_cache_size < 1) return;
+
+  pthread_rwlock_wrlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &jvo->id, sizeof(unsigned short), vm);
+  if (vm) {
+    if (!vm->gops) vm->gops = ff_gopcache_create(jvd->gop_cache_size);
+    if (vm->gops) gc = ff_gopcache_ref(vm->gops);
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+
+  if (gc) {
+    ff_set_gopcache(jvo->decoder, gc);
+    ff_gopcache_unref(gc);
+  }
+}
 
 static JVOBJECT *new_video_object(JVD *jvd, unsigned short id, int fmt) {
   JVOBJECT *jvo, *jvx;
   debugmsg(DEBUG_DCTL, "new_video_object()\n");
-  do {
-    jvo = getjvo(jvd);
-    if (!jvo) {
-      mymsleep(5);
-      sched_yield();
+  if (jvd->file_max > 0) {
+    JVPool *jp;
+    int cnt = 0;
+    pthread_rwlock_rdlock(&jvd->lock_jdh);
+    HASH_FIND(hh, jvd->pools, &id, sizeof(unsigned short), jp);
+    if (jp) cnt = jp->cnt;
+    pthread_rwlock_unlock(&jvd->lock_jdh);
+    if (cnt >= jvd->file_max) {
+      /* wait for one of the file's decoders */
       return NULL;
     }
-    if (pthread_mutex_trylock(&jvo->lock))
-      continue;
-    if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO))) {
-      pthread_mutex_unlock(&jvo->lock);
-      continue;
-    }
-  } while (!jvo);
-
+  }
+  /* non-blocking, the caller queues up and retries */
+  jvo = getjvo(jvd);
+  if (!jvo) {
+    return NULL;
+  }
+  if (pthread_mutex_trylock(&jvo->lock)) {
+    return NULL;
+  }
+  if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO))) {
+    pthread_mutex_unlock(&jvo->lock);
+    return NULL;
+  }
 
   jvo->id = id;
   jvo->fmt = fmt == PIX_FMT_NONE ? DEFAULT_PIX_FMT : fmt;
@@ -572,6 +1130,7 @@ static JVOBJECT *new_video_object(JVD *jvd, unsigned short id, int fmt) {
     HASH_ADD(hhi, jvd->jvi, id, sizeof(unsigned short), jvo);
     HASH_ADD(hhf, jvd->jvf, id, CLKEYLEN, jvo);
   }
+  pool_link(jvd, jvo);
   pthread_rwlock_unlock(&jvd->lock_jdh);
 
   pthread_mutex_unlock(&jvo->lock);
@@ -596,18 +1155,149 @@ static int release_video_object(JVD *jvd, char *fn) {
 
 #define BUSYDEC(jvd) \
   pthread_mutex_lock(&jvd->lock_busy); \
-  jvd->busycnt--; \
+  if (--jvd->busycnt == 0 && jvd->purge_in_progress) \
+    pthread_cond_broadcast(&jvd->cond_busy); \
   pthread_mutex_unlock(&jvd->lock_busy); \
 
 #define BUSYADD(jvd) \
-  while (jvd->purge_in_progress) mymsleep(5); \
   pthread_mutex_lock(&jvd->lock_busy); \
+  while (jvd->purge_in_progress) \
+    pthread_cond_wait(&jvd->cond_busy, &jvd->lock_busy); \
   jvd->busycnt++; \
   pthread_mutex_unlock(&jvd->lock_busy); \
 
+///////////////////////////////////////////////////////////////////////////////
+// decoder pool size
+//
+// decoder objects are allocated on demand up to max_objects. The number
+// of decoders that are kept open while idle (target_objects) follows the
+// load: it grows when requests had to queue for a decoder and shrinks
+// towards the peak number of concurrently used decoders otherwise.
+// Idle decoders beyond the target or the memory limit are closed.
+
+#define DCTRL_MIN_OBJECTS 4      ///< min. target, also the initial value
+#define DCTRL_ADAPT_INTERVAL 10  ///< [sec]
+#define DCTRL_GC_INTERVAL 60     ///< [sec]
+#define DCTRL_GC_AGE 600         ///< [sec] close decoders not used since
+
+/* close least recently used idle decoders while there are more
+ * open decoders than the target or the memory limit is exceeded */
+static void dctrl_trim(JVD *jvd) {
+  int closed = 0;
+  while (1) {
+    JVOBJECT *cptr, *lru = NULL;
+    int n_open = 0;
+    pthread_mutex_lock(&jvd->lock_jvo);
+    for (cptr = jvd->jvo; cptr; cptr = cptr->next) {
+      if (!(cptr->flags&VOF_OPEN)) continue;
+      n_open++;
+      if (!(cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) && (!lru || cptr->lru < lru->lru)) {
+        lru = cptr;
+      }
+    }
+    if (!lru || (n_open <= jvd->target_objects && !mem_full(jvd))) {
+      pthread_mutex_unlock(&jvd->lock_jvo);
+      break;
+    }
+    if (pthread_mutex_trylock(&lru->lock)) {
+      pthread_mutex_unlock(&jvd->lock_jvo);
+      break;
+    }
+    if ((lru->flags&(VOF_USED|VOF_PENDING|VOF_INFO|VOF_OPEN)) != VOF_OPEN) {
+      pthread_mutex_unlock(&lru->lock);
+      pthread_mutex_unlock(&jvd->lock_jvo);
+      break;
+    }
+    /* keep the object (VOF_VALID) for the file, close the decoder */
+    my_destroy(&lru->decoder);
+    threads_free(jvd, lru);
+    lru->flags &= ~VOF_OPEN;
+    lru->fmt = PIX_FMT_NONE;
+    lru->frame = -1;
+    hashref_delete_jvo(jvd, lru);
+    pthread_mutex_unlock(&lru->lock);
+    pthread_mutex_unlock(&jvd->lock_jvo);
+    closed++;
+  }
+  if (closed > 0) {
+    debugmsg(DEBUG_DCTL, "DCTL: closed %d idle decoder(s), target: %d\n", closed, jvd->target_objects);
+  }
+}
+
+/* adapt the number of decoders to keep, at most every DCTRL_ADAPT_INTERVAL */
+static void dctrl_adapt(JVD *jvd) {
+  const time_t now = time(NULL);
+  int waits, peak, target, gc = 0;
+  int64_t wait_us;
+
+  pthread_mutex_lock(&jvd->lock_busy);
+  if (now - jvd->adapt_time < DCTRL_ADAPT_INTERVAL || jvd->purge_in_progress) {
+    pthread_mutex_unlock(&jvd->lock_busy);
+    return;
+  }
+  jvd->adapt_time = now;
+  if (now - jvd->gc_time >= DCTRL_GC_INTERVAL) {
+    jvd->gc_time = now;
+    gc = 1;
+  }
+  waits = jvd->waits;
+  wait_us = jvd->wait_us;
+  peak = jvd->used_peak;
+  jvd->waits = 0;
+  jvd->wait_us = 0;
+  jvd->used_peak = jvd->used_now;
+
+  target = jvd->target_objects;
+  if (waits > 0) {
+    target += 1 + target / 4;
+  } else if (target > peak + 1) {
+    target--;
+  }
+  if (target > jvd->max_objects) target = jvd->max_objects;
+  if (target < DCTRL_MIN_OBJECTS) target = DCTRL_MIN_OBJECTS;
+  jvd->target_objects = target;
+  pthread_mutex_unlock(&jvd->lock_busy);
+
+  debugmsg(DEBUG_DCTL, "DCTL: %d request(s) waited (avg. %"PRId64"ms), peak: %d decoders -> target: %d\n",
+      waits, waits > 0 ? wait_us / waits / 1000 : 0, peak, target);
+
+  if (gc) {
+    clearjvo(jvd, 1, -1, DCTRL_GC_AGE, &jvd->lock_jvo);
+  }
+  dctrl_trim(jvd);
+}
+
+/* max. time a request queues for a decoder object */
+#define DECODER_WAIT_MS 200
+
+/* wait in line for an idle decoder object (FIFO), until one
+ * is released or the deadline has passed */
+static JVOBJECT *dctrl_wait_decoder(JVD *jvd, unsigned short id, int fmt, int64_t frame, int w, int h) {
+  JVOBJECT *jvo = NULL;
+  struct timespec deadline;
+  struct timeval t0, t1;
+  wq_waiter wt;
+  gettimeofday(&t0, NULL);
+  wq_deadline(&deadline, DECODER_WAIT_MS);
+  wq_join(&jvd->wq, &wt);
+  while (!wq_wait(&jvd->wq, &wt, &deadline)) {
+    jvo = testjvd(jvd, id, fmt, frame, w, h);
+    if (!jvo) jvo = new_video_object(jvd, id, fmt);
+    if (jvo) break;
+    wq_pass(&jvd->wq, &wt);
+  }
+  wq_leave(&jvd->wq, &wt);
+  gettimeofday(&t1, NULL);
+  pthread_mutex_lock(&jvd->lock_busy);
+  jvd->waits++;
+  jvd->wait_us += (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_usec - t0.tv_usec);
+  pthread_mutex_unlock(&jvd->lock_busy);
+  return jvo;
+}
+
 
 // lookup or create new decoder for file ID
-static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t frame, int *err) {
+static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t frame, int w, int h, int threads, int *err) {
   JVD *jvd = (JVD*)p;
   JVOBJECT *jvo = NULL;
   *err = 0;
@@ -633,11 +1323,11 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
     debugmsg(DEBUG_DCTL, "DCTL: get_decoder fileid=%i\n", id);
 
     if (!jvo) {
-      int timeout = 40; // new_video_object() delays 5ms at a time.
-      do {
-        jvo = testjvd(jvd->jvo, id, fmt, frame);
-        if (!jvo) jvo = new_video_object(jvd, id, fmt);
-      } while (--timeout > 0 && !jvo);
+      /* an idle decoder of this file can be used right away,
+       * allocating one has to wait in line behind queued requests */
+      jvo = testjvd(jvd, id, fmt, frame, w, h);
+      if (!jvo && !wq_busy(&jvd->wq)) jvo = new_video_object(jvd, id, fmt);
+      if (!jvo) jvo = dctrl_wait_decoder(jvd, id, fmt, frame, w, h);
     }
 
     if (!jvo) {
@@ -648,26 +1338,51 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
     }
 
     pthread_mutex_lock(&jvo->lock);
-    if ((jvo->flags&(VOF_PENDING))) {
-      pthread_mutex_unlock(&jvo->lock);
-      continue;
+    while ((jvo->flags&(VOF_PENDING))) {
+      /* another thread is opening the file */
+      pthread_cond_wait(&jvo->idle, &jvo->lock);
     }
     jvo->flags |= VOF_PENDING;
     pthread_mutex_unlock(&jvo->lock);
 
     if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_INFO)) == (VOF_VALID)) {
+      if (mem_full(jvd)) dctrl_trim(jvd);
+      if (mem_full(jvd)) {
+        pthread_mutex_lock(&jvo->lock);
+        jvo->flags &= ~VOF_PENDING;
+        pthread_cond_broadcast(&jvo->idle);
+        pthread_mutex_unlock(&jvo->lock);
+        dlog(DLOG_WARNING, "DCTL: decoder memory limit reached.\n");
+        BUSYDEC(jvd)
+        *err = 503; // try again
+        return(NULL);
+      }
       if (fmt == PIX_FMT_NONE) fmt = DEFAULT_PIX_FMT;
-      if (!my_open_movie(&jvo->decoder, get_fn(jvd, jvo->id), fmt)) {
+      void *probe = get_probe(jvd, jvo->id);
+      int rv;
+      jvo->threads = threads_alloc(jvd, threads, 0);
+      rv = my_open_movie(&jvo->decoder, get_fn(jvd, jvo->id), fmt, jvo->threads, probe, jvd->use_mmap);
+      if (probe) ff_probe_unref(probe);
+      if (!rv) {
+        if (!probe) set_probe(jvd, jvo);
+        ff_set_scalepool(jvo->decoder, jvd->scale_pool);
+        attach_index(jvd, jvo);
+        attach_gopcache(jvd, jvo);
+        mem_update(jvd, jvo);
         pthread_mutex_lock(&jvo->lock);
         jvo->fmt = fmt;
         jvo->flags |= VOF_OPEN;
         jvo->flags &= ~VOF_PENDING;
+        pthread_cond_broadcast(&jvo->idle);
         pthread_mutex_unlock(&jvo->lock);
       } else {
+        threads_free(jvd, jvo);
         pthread_mutex_lock(&jvo->lock);
         jvo->flags &= ~VOF_PENDING;
+        pthread_cond_broadcast(&jvo->idle);
         assert(!jvo->decoder);
         pthread_mutex_unlock(&jvo->lock);
+        wq_notify(&jvd->wq);
         release_id(jvd, jvo->id); // mark ID as invalid
         dlog(DLOG_ERR, "DCTL: opening of movie file failed.\n");
         BUSYDEC(jvd)
@@ -678,6 +1393,7 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
 
     pthread_mutex_lock(&jvo->lock);
     jvo->flags &= ~VOF_PENDING;
+    pthread_cond_broadcast(&jvo->idle);
     if (frame < 0) {
       /* we only need info -> decoder may be in use */
       if ((jvo->flags&(VOF_OPEN|VOF_VALID)) == (VOF_VALID|VOF_OPEN)) {
@@ -691,6 +1407,10 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
       if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID)) == (VOF_VALID|VOF_OPEN)) {
         jvo->flags |= VOF_USED;
         pthread_mutex_unlock(&jvo->lock);
+        attach_index(jvd, jvo); // pick up an index that was completed meanwhile
+        pthread_mutex_lock(&jvd->lock_busy);
+        if (++jvd->used_now > jvd->used_peak) jvd->used_peak = jvd->used_now;
+        pthread_mutex_unlock(&jvd->lock_busy);
         BUSYDEC(jvd)
         return(jvo);
       }
@@ -698,35 +1418,303 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
 
     pthread_mutex_unlock(&jvo->lock);
     debugmsg(DEBUG_DCTL, "DCTL: decoder object was busy.\n");
+    jvo = NULL;
   }
 }
 
-static void dctrl_release_decoder(void *dec) {
+static void dctrl_release_decoder(JVD *jvd, void *dec) {
   JVOBJECT *jvo = (JVOBJECT *) dec;
+  pool_update(jvd, jvo);
+  mem_update(jvd, jvo);
+  pthread_mutex_lock(&jvd->lock_busy);
+  jvd->used_now--;
+  pthread_mutex_unlock(&jvd->lock_busy);
   pthread_mutex_lock(&jvo->lock);
   jvo->flags &= ~VOF_USED;
+  pthread_cond_broadcast(&jvo->idle);
   pthread_mutex_unlock(&jvo->lock);
+  wq_notify(&jvd->wq);
+  dctrl_adapt(jvd);
 }
 
-static void dctrl_release_infolock(void *dec) {
+static void dctrl_release_infolock(JVD *jvd, void *dec) {
   JVOBJECT *jvo = (JVOBJECT *) dec;
   pthread_mutex_lock(&jvo->lock);
   if (--jvo->infolock_refcnt < 1) {
     assert(jvo->infolock_refcnt >= 0);
     jvo->flags &= ~(VOF_INFO);
+    pthread_cond_broadcast(&jvo->idle);
+    pthread_mutex_unlock(&jvo->lock);
+    wq_notify(&jvd->wq);
+    return;
   }
   pthread_mutex_unlock(&jvo->lock);
 }
 
-static inline int xdctrl_decode(void *dec, int64_t frame, uint8_t *b, int w, int h) {
+/* close a decoder whose codec could not be re-opened */
+static void dctrl_reopen_failed(JVD *jvd, JVOBJECT *jvo) {
+  dlog(DLOG_ERR, "DCTL: re-opening codec failed.\n");
+  pthread_mutex_lock(&jvo->lock);
+  my_destroy(&jvo->decoder);
+  threads_free(jvd, jvo);
+  jvo->flags &= ~VOF_OPEN;
+  jvo->fmt = PIX_FMT_NONE;
+  jvo->frame = -1;
+  pthread_mutex_unlock(&jvo->lock);
+  hashref_delete_jvo(jvd, jvo);
+}
+
+/* shrink a decoder's threads after this many requests that asked for
+ * fewer threads, or right away if the thread budget is exhausted */
+#define DCTRL_THREADS_SHRINK 8
+
+/* re-open the codec of an acquired decoder if the request asks for more
+ * threads, or give surplus threads back to the budget.
+ * returns -1 if the codec could not be re-opened (the decoder is closed).
+ */
+static int dctrl_fit_threads(JVD *jvd, JVOBJECT *jvo, int want) {
+  int n;
+  if (want < 1) want = jvd->codec_threads;
+  if (want == jvo->threads) {
+    jvo->threads_low = 0;
+    return 0;
+  }
+  if (want > jvo->threads) {
+    jvo->threads_low = 0;
+    n = threads_alloc(jvd, want, jvo->threads);
+  } else {
+    int full;
+    pthread_mutex_lock(&jvd->lock_busy);
+    full = jvd->threads_used >= jvd->max_threads;
+    pthread_mutex_unlock(&jvd->lock_busy);
+    if (!full && ++jvo->threads_low < DCTRL_THREADS_SHRINK) return 0;
+    jvo->threads_low = 0;
+    n = threads_alloc(jvd, want, jvo->threads);
+  }
+  if (n == jvo->threads) return 0;
+  jvo->threads = n;
+  debugmsg(DEBUG_DCTL, "DCTL: file-id:%d using %d codec threads\n", jvo->id, n);
+  if (!ff_set_threads(jvo->decoder, n)) {
+    jvo->frame = -1; // the re-opened codec is not positioned
+    return 0;
+  }
+  dctrl_reopen_failed(jvd, jvo);
+  return -1;
+}
+
+/* a freshly opened decoder is assigned to the output size of its first
+ * request: thumbnail sizes decode at reduced resolution from then on.
+ * A larger request re-opens the codec at a resolution that fits it,
+ * dctrl_cost() steers requests away from decoders where that happens.
+ * returns -1 if the codec could not be re-opened (the decoder is closed).
+ */
+static int dctrl_fit_lowres(JVD *jvd, JVOBJECT *jvo, int w, int h) {
+  if (jvo->lowres_set && (jvo->lowres_w == 0 || (w <= jvo->lowres_w && h <= jvo->lowres_h))) {
+    return 0;
+  }
+  const int prev_w = jvo->lowres_w;
+  const int prev_h = jvo->lowres_h;
+  jvo->lowres_set = 1;
+  if (!ff_set_lowres(jvo->decoder, w, h, &jvo->lowres_w, &jvo->lowres_h)) {
+    if (jvo->lowres_w != prev_w || jvo->lowres_h != prev_h)
+      jvo->frame = -1; // the re-opened codec is not positioned
+    return 0;
+  }
+  dctrl_reopen_failed(jvd, jvo);
+  return -1;
+}
+
+/* adapt an acquired decoder to the request, see above */
+static int dctrl_fit_decoder(JVD *jvd, JVOBJECT *jvo, int threads, int w, int h) {
+  if (dctrl_fit_threads(jvd, jvo, threads)) return -1;
+  return dctrl_fit_lowres(jvd, jvo, w, h);
+}
+
+/* backward playback: the requested frame lies shortly before the frame
+ * that the decoder delivered last, and decoding it means to seek back
+ * to a keyframe and read forward again. (window: max. GOP length of the
+ * file, if known).
+ */
+#define REVERSE_WINDOW 32
+
+static int dctrl_reverse(JVOBJECT *jvo, int64_t frame) {
+  int64_t window = ff_get_maxgop(jvo->decoder);
+  if (window < REVERSE_WINDOW) window = REVERSE_WINDOW;
+  return jvo->frame >= 0 && frame < jvo->frame && jvo->frame - frame <= window;
+}
+
+static inline int xdctrl_decode(JVD *jvd, void *dec, int64_t frame, uint8_t *b, int w, int h, DecoderHints *dh) {
   JVOBJECT *jvo = (JVOBJECT *) dec;
+  struct timeval t0, t1;
+  const int64_t kf = ff_get_keyframe(jvo->decoder, frame);
+  const int seek = dctrl_seeks(jvo->frame, frame, kf);
   jvo->lru = time(NULL);
   jvo->hitcount_decoder++;
-  int rv = my_decode(jvo->decoder, frame, b, w, h);
-  jvo->frame = frame;
+  if (dh) dh->reverse = dctrl_reverse(jvo, frame);
+  gettimeofday(&t0, NULL);
+  int rv = my_decode(jvo->decoder, frame, b, w, h, dh);
+  gettimeofday(&t1, NULL);
+  if (rv == 0 && (!dh || dh->seekmode == SEEKMODE_EXACT)) {
+    dctrl_cost_sample(jvd, jvo->id, seek,
+        seek ? dctrl_seek_frames(frame, kf) : frame - jvo->frame,
+        (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_usec - t0.tv_usec));
+  }
+  jvo->frame = dh ? dh->frame : frame;
   return rv;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// decode worker pool
+//
+// decoding runs on a fixed number of worker threads, connection threads
+// queue a job and wait for it. Jobs are run in order of priority
+// (DPRIO_INTERACTIVE first) and FIFO for the same priority.
+// A waiting level that was passed over DCTRL_JOB_BYPASS times runs
+// next, so prefetch and bulk jobs are delayed but never starve.
+// A job that was not started within DCTRL_JOB_WAIT_MS (4x that for
+// each lower level) is dropped and the request fails with 503.
+
+#define DCTRL_JOB_BYPASS 16
+#define DCTRL_JOB_WAIT_MS 1000
+
+typedef int (*dctrl_job_fn)(JVD *jvd, void *arg);
+
+typedef struct dctrl_job {
+  dctrl_job_fn fn;
+  void *arg;
+  int rv;
+  int started;          // a worker has dequeued the job
+  int done;
+  pthread_cond_t cond;  // signaled when the job is done
+  struct dctrl_job *next;
+} dctrl_job;
+
+/* dequeue the next job, NULL if none is queued.
+ * NB. lock_jobs needs to be held when calling this */
+static dctrl_job *dctrl_next_job(JVD *jvd) {
+  dctrl_job *job;
+  int prio, pick = -1;
+  for (prio = DPRIO_LEVELS - 1; prio > 0; --prio) {
+    if (jvd->jobs[prio] && jvd->jobs_bypassed[prio] >= DCTRL_JOB_BYPASS) {
+      pick = prio;
+      break;
+    }
+  }
+  for (prio = 0; prio < DPRIO_LEVELS && pick < 0; ++prio) {
+    if (jvd->jobs[prio]) pick = prio;
+  }
+  if (pick < 0) return NULL;
+  for (prio = 0; prio < DPRIO_LEVELS; ++prio) {
+    if (prio != pick && jvd->jobs[prio]) jvd->jobs_bypassed[prio]++;
+  }
+  jvd->jobs_bypassed[pick] = 0;
+  job = jvd->jobs[pick];
+  jvd->jobs[pick] = job->next;
+  if (!job->next) jvd->jobs_tail[pick] = NULL;
+  jvd->jobs_queued[pick]--;
+  job->started = 1;
+  return job;
+}
+
+/* remove a job that was not started from its queue.
+ * NB. lock_jobs needs to be held when calling this */
+static void dctrl_unqueue_job(JVD *jvd, int prio, dctrl_job *job) {
+  dctrl_job *prev = NULL, *j;
+  for (j = jvd->jobs[prio]; j && j != job; j = j->next) prev = j;
+  if (!j) return;
+  if (prev) prev->next = job->next; else jvd->jobs[prio] = job->next;
+  if (jvd->jobs_tail[prio] == job) jvd->jobs_tail[prio] = prev;
+  jvd->jobs_queued[prio]--;
+}
+
+static void *dctrl_worker(void *arg) {
+  JVD *jvd = (JVD*) arg;
+  pthread_mutex_lock(&jvd->lock_jobs);
+  while (1) {
+    dctrl_job *job = dctrl_next_job(jvd);
+    if (!job) {
+      struct timespec deadline;
+      if (jvd->workers_stop) break;
+      wq_deadline(&deadline, DCTRL_ADAPT_INTERVAL * 1000);
+      if (pthread_cond_timedwait(&jvd->cond_jobs, &jvd->lock_jobs, &deadline) == ETIMEDOUT) {
+        /* idle: shrink the decoder pool even if no requests arrive */
+        pthread_mutex_unlock(&jvd->lock_jobs);
+        dctrl_adapt(jvd);
+        pthread_mutex_lock(&jvd->lock_jobs);
+      }
+      continue;
+    }
+    pthread_mutex_unlock(&jvd->lock_jobs);
+    job->rv = job->fn(jvd, job->arg);
+    pthread_mutex_lock(&jvd->lock_jobs);
+    job->done = 1;
+    jvd->jobs_done++;
+    pthread_cond_signal(&job->cond);
+  }
+  pthread_mutex_unlock(&jvd->lock_jobs);
+  return NULL;
+}
+
+/* run fn on a decode worker and wait for its result,
+ * or run it right away if the worker pool is disabled */
+static int dctrl_run(JVD *jvd, int prio, dctrl_job_fn fn, void *arg) {
+  dctrl_job job;
+  struct timespec deadline;
+  if (jvd->n_workers < 1) {
+    return fn(jvd, arg);
+  }
+  if (prio < 0 || prio >= DPRIO_LEVELS) prio = DPRIO_INTERACTIVE;
+
+  job.fn = fn;
+  job.arg = arg;
+  job.rv = 0;
+  job.started = 0;
+  job.done = 0;
+  job.next = NULL;
+  pthread_cond_init(&job.cond, NULL);
+  wq_deadline(&deadline, DCTRL_JOB_WAIT_MS << (2 * prio));
+
+  pthread_mutex_lock(&jvd->lock_jobs);
+  if (jvd->jobs_tail[prio]) {
+    jvd->jobs_tail[prio]->next = &job;
+  } else {
+    jvd->jobs[prio] = &job;
+  }
+  jvd->jobs_tail[prio] = &job;
+  jvd->jobs_queued[prio]++;
+  pthread_cond_signal(&jvd->cond_jobs);
+  while (!job.done) {
+    if (job.started) {
+      pthread_cond_wait(&job.cond, &jvd->lock_jobs);
+    } else if (pthread_cond_timedwait(&job.cond, &jvd->lock_jobs, &deadline) == ETIMEDOUT && !job.started) {
+      /* the workers are busy, fail like a request that finds no decoder */
+      dctrl_unqueue_job(jvd, prio, &job);
+      jvd->jobs_expired++;
+      job.rv = 503;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&jvd->lock_jobs);
+  pthread_cond_destroy(&job.cond);
+  return job.rv;
+}
+
+static void dctrl_workers_stop(JVD *jvd) {
+  int i;
+  if (jvd->n_workers < 1) return;
+  pthread_mutex_lock(&jvd->lock_jobs);
+  jvd->workers_stop = 1;
+  pthread_cond_broadcast(&jvd->cond_jobs);
+  pthread_mutex_unlock(&jvd->lock_jobs);
+  for (i = 0; i < jvd->n_workers; ++i) {
+    pthread_join(jvd->workers[i], NULL);
+  }
+  free(jvd->workers);
+  jvd->workers = NULL;
+  jvd->n_workers = 0;
+  jvd->workers_stop = 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // part 2b - video object/decoder API - public API
 
@@ -736,10 +1724,22 @@ void dctrl_create(void **p, int max_decoders, int cache_size) {
   jvd = (*((JVD**)p));
   jvd->monotonic = 1;
   jvd->max_objects = max_decoders;
+  jvd->target_objects = DCTRL_MIN_OBJECTS;
   jvd->cache_size = cache_size;
+  jvd->codec_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  jvd->max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (jvd->max_threads < 1) jvd->max_threads = 1;
+  jvd->scale_pool = ff_scalepool_create();
 
   pthread_mutex_init(&jvd->lock_busy, NULL);
+  pthread_cond_init(&jvd->cond_busy, NULL);
   pthread_mutex_init(&jvd->lock_jvo, NULL);
+  pthread_mutex_init(&jvd->lock_jobs, NULL);
+  pthread_cond_init(&jvd->cond_jobs, NULL);
+  pthread_mutex_init(&jvd->lock_admit, NULL);
+  wq_init(&jvd->wq);
   pthread_rwlock_init(&jvd->lock_vml, NULL);
   pthread_rwlock_init(&jvd->lock_jdh, NULL);
 
@@ -747,7 +1747,11 @@ void dctrl_create(void **p, int max_decoders, int cache_size) {
   jvd->vmr = NULL;
   jvd->jvi = NULL;
   jvd->jvf = NULL;
-  jvd->jvo = newjvo(NULL, &jvd->lock_jvo);
+  jvd->jvfree = NULL;
+  jvd->pools = NULL;
+  jvd->jvo = NULL;
+  newjvo(jvd);
+  freelist_push(jvd, jvd->jvo);
 
   HASH_ADD(hhi, jvd->jvi, id, sizeof(unsigned short), jvd->jvo);
   HASH_ADD(hhf, jvd->jvf, id, CLKEYLEN, jvd->jvo);
@@ -755,55 +1759,316 @@ void dctrl_create(void **p, int max_decoders, int cache_size) {
 
 void dctrl_destroy(void **p) {
   JVD *jvd = (*((JVD**)p));
+  dctrl_workers_stop(jvd);
+  pthread_mutex_lock(&jvd->lock_busy);
+  while (jvd->index_builds > 0) {
+    pthread_cond_wait(&jvd->cond_busy, &jvd->lock_busy);
+  }
+  pthread_mutex_unlock(&jvd->lock_busy);
   clearjvo(jvd, 3, -1, -1, &jvd->lock_jvo);
   clearvid(jvd, NULL);
+  assert(!jvd->pools);
+  ff_scalepool_destroy(jvd->scale_pool);
   pthread_mutex_destroy(&jvd->lock_busy);
+  pthread_cond_destroy(&jvd->cond_busy);
   pthread_mutex_destroy(&jvd->lock_jvo);
+  pthread_mutex_destroy(&jvd->lock_jobs);
+  pthread_cond_destroy(&jvd->cond_jobs);
+  pthread_mutex_destroy(&jvd->lock_admit);
+  wq_destroy(&jvd->wq);
   pthread_rwlock_destroy(&jvd->lock_vml);
   pthread_rwlock_destroy(&jvd->lock_jdh);
+  free(jvd->index_cachedir);
   free(jvd->jvo);
   free(*((JVD**)p));
   *p = NULL;
 }
 
+void dctrl_set_index_cachedir(void *p, const char *dir) {
+  JVD *jvd = (JVD*)p;
+  free(jvd->index_cachedir);
+  jvd->index_cachedir = dir ? strdup(dir) : NULL;
+}
+
+void dctrl_set_threads(void *p, int threads, int max_threads) {
+  JVD *jvd = (JVD*)p;
+  if (threads > 0) jvd->codec_threads = threads;
+  if (max_threads > 0) jvd->max_threads = max_threads;
+}
+
+void dctrl_set_mmap(void *p, int enable) {
+  JVD *jvd = (JVD*)p;
+  jvd->use_mmap = enable;
+}
+
+void dctrl_set_gop_cache(void *p, size_t bytes) {
+  JVD *jvd = (JVD*)p;
+  jvd->gop_cache_size = bytes;
+}
+
+void dctrl_set_scale_threads(void *p, int threads, int min_pixels) {
+  JVD *jvd = (JVD*)p;
+  ff_scalepool_set_threads(jvd->scale_pool, threads, min_pixels);
+}
+
+void dctrl_set_workers(void *p, int workers) {
+  JVD *jvd = (JVD*)p;
+  int i;
+  dctrl_workers_stop(jvd);
+  if (workers < 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (workers < 1) workers = 1;
+  }
+  if (workers == 0) return;
+
+  jvd->workers = calloc(workers, sizeof(pthread_t));
+  for (i = 0; i < workers; ++i) {
+    if (pthread_create(&jvd->workers[i], NULL, dctrl_worker, jvd)) {
+      dlog(DLOG_ERR, "DCTL: cannot create decode worker thread.\n");
+      break;
+    }
+  }
+  jvd->n_workers = i;
+  if (i == 0) {
+    free(jvd->workers);
+    jvd->workers = NULL;
+  }
+  debugmsg(DEBUG_DCTL, "DCTL: started %d decode worker(s)\n", i);
+}
+
+void dctrl_set_limits(void *p, int file_max, size_t mem_max) {
+  JVD *jvd = (JVD*)p;
+  jvd->file_max = file_max > 0 ? file_max : 0;
+  jvd->mem_max = mem_max;
+}
+
+void dctrl_set_admission(void *p, int max_wait_ms) {
+  ((JVD*)p)->admit_max_ms = max_wait_ms > 0 ? max_wait_ms : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// admission control
+//
+// the estimated decode time of admitted requests is summed up per file
+// and in total. A request that would have to wait longer than the
+// configured limit for the decoders to work off the backlog is
+// rejected right away. A file's backlog is worked off by at most
+// file_max decoders, so a single busy file is limited before the
+// total is.
+
+int dctrl_admit(void *p, unsigned short id, int frames, int64_t *ticket, int *retry_after) {
+  JVD *jvd = (JVD*)p;
+  JVPool *jp;
+  VidMap *vm;
+  int64_t us_frame = COST_FRAME_US;
+  int64_t us_seek = COST_SEEK_US;
+  int64_t cost, wait;
+  int capacity, file_capacity;
+
+  *ticket = 0;
+  if (retry_after) *retry_after = 0;
+  if (frames < 1) frames = 1;
+
+  pthread_rwlock_rdlock(&jvd->lock_jdh);
+  HASH_FIND(hh, jvd->pools, &id, sizeof(unsigned short), jp);
+  if (jp) {
+    pthread_mutex_lock(&jp->lock);
+    if (jp->us_frame > 0) us_frame = jp->us_frame;
+    if (jp->us_seek > 0) us_seek = jp->us_seek;
+    pthread_mutex_unlock(&jp->lock);
+  }
+  pthread_rwlock_unlock(&jvd->lock_jdh);
+  cost = us_seek + frames * us_frame;
+
+  /* decodes that can run concurrently */
+  capacity = jvd->max_objects;
+  if (jvd->n_workers > 0 && jvd->n_workers < capacity) capacity = jvd->n_workers;
+  if (capacity < 1) capacity = 1;
+  file_capacity = capacity;
+  if (jvd->file_max > 0 && jvd->file_max < file_capacity) file_capacity = jvd->file_max;
+
+  pthread_rwlock_rdlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &id, sizeof(unsigned short), vm);
+  pthread_mutex_lock(&jvd->lock_admit);
+  wait = (jvd->admit_us + capacity - 1) / capacity;
+  if (vm && vm->admit_cnt > 0) {
+    const int64_t file_wait = (vm->admit_us + file_capacity - 1) / file_capacity;
+    if (file_wait > wait) wait = file_wait;
+  }
+  if (jvd->admit_max_ms > 0 && jvd->admit_cnt > 0 && wait + cost > jvd->admit_max_ms * 1000LL) {
+    jvd->admit_rejected++;
+    pthread_mutex_unlock(&jvd->lock_admit);
+    pthread_rwlock_unlock(&jvd->lock_vml);
+    if (retry_after) *retry_after = 1 + (int)(wait / 1000000);
+    debugmsg(DEBUG_DCTL, "DCTL: rejected request for file-id:%d, est. wait %"PRId64"ms\n", id, wait / 1000);
+    return 503;
+  }
+  jvd->admit_cnt++;
+  jvd->admit_us += cost;
+  if (vm) {
+    vm->admit_cnt++;
+    vm->admit_us += cost;
+  }
+  pthread_mutex_unlock(&jvd->lock_admit);
+  pthread_rwlock_unlock(&jvd->lock_vml);
+  *ticket = cost;
+  return 0;
+}
+
+void dctrl_admit_done(void *p, unsigned short id, int64_t ticket) {
+  JVD *jvd = (JVD*)p;
+  VidMap *vm;
+  if (ticket <= 0) return;
+  pthread_rwlock_rdlock(&jvd->lock_vml);
+  pthread_mutex_lock(&jvd->lock_admit);
+  jvd->admit_cnt--;
+  jvd->admit_us -= ticket;
+  assert(jvd->admit_cnt >= 0);
+  HASH_FIND(hr, jvd->vmr, &id, sizeof(unsigned short), vm);
+  /* the id may have been released and re-used meanwhile */
+  if (vm && vm->admit_cnt > 0) {
+    vm->admit_cnt--;
+    vm->admit_us -= ticket;
+    if (vm->admit_cnt == 0 || vm->admit_us < 0) vm->admit_us = 0;
+  }
+  pthread_mutex_unlock(&jvd->lock_admit);
+  pthread_rwlock_unlock(&jvd->lock_vml);
+}
+
 unsigned short dctrl_get_id(void *vc, void *p, const char *fn) {
   JVD *jvd = (JVD*)p;
   return get_id(jvd, fn, vc);
 }
 
 
-int dctrl_decode(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt) {
+/* decode job arguments */
+typedef struct {
+  unsigned short id;
+  int64_t frame;
+  int count;
+  int stride;
+  uint8_t *b;
+  int w;
+  int h;
+  int fmt;
+  DecoderHints *dh;
+  harvest_get_fn get;
+  harvest_done_fn done;
+  void *arg;
+} dctrl_decode_args;
+
+static int dctrl_decode_job(JVD *jvd, void *arg) {
+  dctrl_decode_args *a = (dctrl_decode_args*) arg;
   int err = 0;
-  void *dec = dctrl_get_decoder(p, id, fmt, frame, &err);
+  const int threads = a->dh ? a->dh->threads : 0;
+  void *dec = dctrl_get_decoder(jvd, a->id, a->fmt, a->frame, a->w, a->h, threads, &err);
   if (!dec) {
     dlog(DLOG_WARNING, "DCTL: no decoder available.\n");
     return err;
   }
-  int rv = xdctrl_decode(dec, frame, b, w, h);
-  dctrl_release_decoder(dec);
+  if (dctrl_fit_decoder(jvd, (JVOBJECT*)dec, threads, a->w, a->h)) {
+    dctrl_release_decoder(jvd, dec);
+    return 503;
+  }
+  int rv = xdctrl_decode(jvd, dec, a->frame, a->b, a->w, a->h, a->dh);
+  dctrl_release_decoder(jvd, dec);
   return (rv);
 }
 
+int dctrl_decode(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt, DecoderHints *dh) {
+  dctrl_decode_args a;
+  memset(&a, 0, sizeof(dctrl_decode_args));
+  a.id = id;
+  a.frame = frame;
+  a.b = b;
+  a.w = w;
+  a.h = h;
+  a.fmt = fmt;
+  a.dh = dh;
+  return dctrl_run((JVD*)p, dh && dh->priority >= 0 ? dh->priority : DPRIO_INTERACTIVE, dctrl_decode_job, &a);
+}
+
+static int dctrl_decode_range_job(JVD *jvd, void *arg) {
+  dctrl_decode_args *a = (dctrl_decode_args*) arg;
+  int err = 0;
+  int i;
+  DecoderHints hints;
+  const int threads = a->dh ? a->dh->threads : 0;
+  void *dec;
+
+  dec = dctrl_get_decoder(jvd, a->id, a->fmt, a->frame, a->w, a->h, threads, &err);
+  if (!dec) {
+    dlog(DLOG_WARNING, "DCTL: no decoder available.\n");
+    return err;
+  }
+  if (dctrl_fit_decoder(jvd, (JVOBJECT*)dec, threads, a->w, a->h)) {
+    dctrl_release_decoder(jvd, dec);
+    return 503;
+  }
+  memset(&hints, 0, sizeof(DecoderHints));
+  if (a->dh) hints = *a->dh;
+  hints.harvest_get = NULL;
+  hints.harvest_done = NULL;
+  /* get() and done() are keyed by the requested frames */
+  hints.seekmode = SEEKMODE_EXACT;
+
+  for (i = 0; i < a->count; ++i) {
+    const int64_t frame = a->frame + (int64_t) i * a->stride;
+    uint8_t *b = a->get(a->arg, frame);
+    if (!b) continue;
+    const int rv = xdctrl_decode(jvd, dec, frame, b, a->w, a->h, &hints);
+    a->done(a->arg, frame, rv == 0);
+  }
+  dctrl_release_decoder(jvd, dec);
+  return 0;
+}
+
+int dctrl_decode_range(void *p, unsigned short id, int64_t start, int count, int stride,
+    int w, int h, int fmt, DecoderHints *dh,
+    harvest_get_fn get, harvest_done_fn done, void *arg) {
+  dctrl_decode_args a;
+  if (count < 1 || stride < 1) return 500;
+  a.id = id;
+  a.frame = start;
+  a.count = count;
+  a.stride = stride;
+  a.b = NULL;
+  a.w = w;
+  a.h = h;
+  a.fmt = fmt;
+  a.dh = dh;
+  a.get = get;
+  a.done = done;
+  a.arg = arg;
+  return dctrl_run((JVD*)p, dh && dh->priority >= 0 ? dh->priority : DPRIO_BULK, dctrl_decode_range_job, &a);
+}
+
 int dctrl_get_info(void *p, unsigned short id, VInfo *i) {
   int err = 0;
-  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, PIX_FMT_NONE, -1, &err);
+  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, PIX_FMT_NONE, -1, 0, 0, 0, &err);
   if (!jvo) return err;
   my_get_info(jvo->decoder, i);
   jvo->hitcount_info++;
-  dctrl_release_infolock(jvo);
+  dctrl_release_infolock((JVD*)p, jvo);
   return(0);
 }
 
 int dctrl_get_info_scale(void *p, unsigned short id, VInfo *i, int w, int h, int fmt) {
   int err = 0;
-  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, fmt, -1, &err);
+  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, fmt, -1, 0, 0, 0, &err);
   if (!jvo) return err;
   my_get_info_canonical(jvo->decoder, i, w, h);
   jvo->hitcount_info++;
-  dctrl_release_infolock(jvo);
+  dctrl_release_infolock((JVD*)p, jvo);
   return(0);
 }
 
+int64_t dctrl_get_keyframe(void *p, unsigned short id, int64_t frame) {
+  return dctrl_keyframe((JVD*)p, id, frame);
+}
+
 void dctrl_cache_clear(void *vc, void *p, int f, int id) {
   JVD *jvd = (JVD*)p;
   clearjvo(jvd, f, id, -1, &jvd->lock_jvo);
@@ -862,12 +2127,17 @@ void dctrl_info_html (void *p, char **m, size_t *o, size_t *s, int tbl) {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>File Mapping:</h3></td></tr>\n");
     rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d</td></tr>\n", ((JVD*)p)->cache_size);
   }
-  rprintf("<tr><th>#</th><th>file-id</th><th></th><th>Filename</th><th></th><th></th><th></th><th>LRU</th></tr>\n");
+  rprintf("<tr><th>#</th><th>file-id</th><th>Keyframes</th><th>GOP cache</th><th>Filename</th><th></th><th>Pending</th><th>LRU</th></tr>\n");
   rprintf("\n");
   pthread_rwlock_rdlock(&((JVD*)p)->lock_vml);
   HASH_ITER(hh, ((JVD*)p)->vml, vm, tmp) {
-    rprintf("<tr><td>%d.</td><td>%i</td><td></td><td colspan=\"4\" class=\"left\">%s</td><td>%"PRIlld"</td></tr>\n",
-        i, vm->id, vm->fn?vm->fn:"(null)", (long long)vm->lru);
+    size_t gbytes = 0;
+    uint64_t ghits = 0, gmisses = 0;
+    if (vm->gops) ff_gopcache_stats(vm->gops, &gbytes, &ghits, &gmisses);
+    rprintf("<tr><td>%d.</td><td>%i</td><td>%"PRIlld"</td><td>%lukB %"PRIlld"/%"PRIlld"</td><td colspan=\"2\" class=\"left\">%s</td><td>%d (%"PRIlld"ms)</td><td>%"PRIlld"</td></tr>\n",
+        i, vm->id, vm->kfidx ? (long long) ff_index_keyframes(vm->kfidx) : 0LL,
+        (unsigned long) (gbytes / 1024), (long long) ghits, (long long) gmisses,
+        vm->fn?vm->fn:"(null)", vm->admit_cnt, (long long) (vm->admit_us / 1000), (long long)vm->lru);
     i++;
   }
   pthread_rwlock_unlock(&((JVD*)p)->lock_vml);
@@ -880,12 +2150,53 @@ void dctrl_info_html (void *p, char **m, size_t *o, size_t *s, int tbl) {
   i = 1;
   if(tbl&4) {
     rprintf("<h3>Decoder Objects:</h3>\n");
-    rprintf("<p>max available: %d, busy: %d%s</p>\n", ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"");
+    rprintf("<p>max available: %d, busy: %d%s, codec-threads: %d/%d</p>\n", ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"",
+        ((JVD*)p)->threads_used, ((JVD*)p)->max_threads);
+    rprintf("<p>target: %d, in use: %d (peak: %d), per file: %d, memory: %luMB/%luMB</p>\n",
+        ((JVD*)p)->target_objects, ((JVD*)p)->used_now, ((JVD*)p)->used_peak, ((JVD*)p)->file_max,
+        (unsigned long) (((JVD*)p)->mem_used >> 20), (unsigned long) (((JVD*)p)->mem_max >> 20));
     rprintf("<table style=\"text-align:center;width:100%%\">\n");
   } else {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>Decoder Objects:</h3></td></tr>\n");
-    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d, busy: %d%s</td></tr>\n",
-        ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"");
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d, busy: %d%s, codec-threads: %d/%d</td></tr>\n",
+        ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"",
+        ((JVD*)p)->threads_used, ((JVD*)p)->max_threads);
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">target: %d, in use: %d (peak: %d), per file: %d, memory: %luMB/%luMB</td></tr>\n",
+        ((JVD*)p)->target_objects, ((JVD*)p)->used_now, ((JVD*)p)->used_peak, ((JVD*)p)->file_max,
+        (unsigned long) (((JVD*)p)->mem_used >> 20), (unsigned long) (((JVD*)p)->mem_max >> 20));
+  }
+  if(tbl&4) {
+    rprintf("<p>decode-workers: %d, queued: %d/%d/%d (interactive/prefetch/bulk), done: %lu, expired: %lu</p>\n",
+        ((JVD*)p)->n_workers, ((JVD*)p)->jobs_queued[DPRIO_INTERACTIVE], ((JVD*)p)->jobs_queued[DPRIO_PREFETCH],
+        ((JVD*)p)->jobs_queued[DPRIO_BULK], ((JVD*)p)->jobs_done, ((JVD*)p)->jobs_expired);
+    rprintf("<p>admission: pending: %d (%"PRIlld"ms), max. wait: %dms, rejected: %lu</p>\n",
+        ((JVD*)p)->admit_cnt, (long long) (((JVD*)p)->admit_us / 1000), ((JVD*)p)->admit_max_ms, ((JVD*)p)->admit_rejected);
+  } else {
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">decode-workers: %d, queued: %d/%d/%d (interactive/prefetch/bulk), done: %lu, expired: %lu</td></tr>\n",
+        ((JVD*)p)->n_workers, ((JVD*)p)->jobs_queued[DPRIO_INTERACTIVE], ((JVD*)p)->jobs_queued[DPRIO_PREFETCH],
+        ((JVD*)p)->jobs_queued[DPRIO_BULK], ((JVD*)p)->jobs_done, ((JVD*)p)->jobs_expired);
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">admission: pending: %d (%"PRIlld"ms), max. wait: %dms, rejected: %lu</td></tr>\n",
+        ((JVD*)p)->admit_cnt, (long long) (((JVD*)p)->admit_us / 1000), ((JVD*)p)->admit_max_ms, ((JVD*)p)->admit_rejected);
+  }
+  if(tbl&4) {
+    rprintf("<p>decode cost (file-id: ms/frame, ms/seek):");
+  } else {
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">decode cost (file-id: ms/frame, ms/seek):");
+  }
+  pthread_rwlock_rdlock(&((JVD*)p)->lock_jdh);
+  {
+    JVPool *jp, *jtmp;
+    HASH_ITER(hh, ((JVD*)p)->pools, jp, jtmp) {
+      pthread_mutex_lock(&jp->lock);
+      rprintf(" %d: %.1f, %.1f;", jp->id, jp->us_frame / 1000.0, jp->us_seek / 1000.0);
+      pthread_mutex_unlock(&jp->lock);
+    }
+  }
+  pthread_rwlock_unlock(&((JVD*)p)->lock_jdh);
+  if(tbl&4) {
+    rprintf("</p>\n");
+  } else {
+    rprintf("</td></tr>\n");
   }
   rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Filename</th><th>Hitcount</th><th>PixFmt</th><th>Frame#</th><th>LRU</th></tr>\n");
   rprintf("\n");
@@ -36,6 +36,98 @@ void dctrl_create(void **p, int max_decoders, int cache_size);
  * @param p object pointer to free
  */
 void dctrl_destroy(void **p);
+/**
+ * set directory to store keyframe-index files.
+ * Indices are keyed by file name, file size and modification time
+ * and memory-mapped when a file is opened again later.
+ * @param p pointer to a decoder-control object
+ * @param dir writable directory or NULL to disable the on-disk cache
+ */
+void dctrl_set_index_cachedir(void *p, const char *dir);
+/**
+ * configure codec (slice) threading.
+ * Each decoder uses at least one thread. Additional threads are
+ * only assigned while the sum over all open decoders does not
+ * exceed \a max_threads. Threads that a decoder holds beyond what
+ * its requests ask for are returned when the budget runs out or
+ * after a few such requests.
+ * @param p pointer to a decoder-control object
+ * @param threads default number of codec threads per decoder (0: keep)
+ * @param max_threads total limit (0: keep, default: number of CPU cores)
+ */
+void dctrl_set_threads(void *p, int threads, int max_threads);
+/**
+ * read local files through a shared read-only memory-mapping
+ * (applies to decoders that are opened afterwards).
+ * @param p pointer to a decoder-control object
+ * @param enable 1: use mmap() for regular files, 0: libavformat's file I/O
+ */
+void dctrl_set_mmap(void *p, int enable);
+/**
+ * configure the per-file cache of compressed packets. Seeking to a
+ * keyframe whose GOP was read before replays the packets from memory.
+ * This requires a keyframe index.
+ * @param p pointer to a decoder-control object
+ * @param bytes max. size of packet data per file (0: disable)
+ */
+void dctrl_set_gop_cache(void *p, size_t bytes);
+/**
+ * configure sliced colour-space conversion.
+ * Large frames that are not scaled vertically are converted in
+ * horizontal bands by a pool of worker threads shared by the decoders
+ * of this decoder-control object. Call this before decoding starts.
+ * @param p pointer to a decoder-control object
+ * @param threads number of worker threads (0: convert in the decoding thread)
+ * @param min_pixels minimum output size (width * height) to use the pool (0: keep, default: 1920x1080)
+ */
+void dctrl_set_scale_threads(void *p, int threads, int min_pixels);
+/**
+ * run decodes on a pool of worker threads. Callers of dctrl_decode()
+ * and dctrl_decode_range() queue a job by DecoderHints.priority and
+ * wait for it to complete. Lower priorities are delayed, not starved:
+ * a level that was passed over 16 times runs next. A job that no
+ * worker started within 1s (interactive), 4s (prefetch) or 16s (bulk)
+ * is dropped and the call returns 503.
+ * @param p pointer to a decoder-control object
+ * @param workers number of worker threads, -1: number of CPUs, 0: decode in the calling thread (default)
+ */
+void dctrl_set_workers(void *p, int workers);
+/**
+ * reject decode requests if the decoders are expected to be busy
+ * with already admitted requests for longer than the given time.
+ * @param p pointer to a decoder-control object
+ * @param max_wait_ms maximum expected wait in milliseconds, 0: admit all requests (default)
+ */
+void dctrl_set_admission(void *p, int max_wait_ms);
+/**
+ * limit the decoder objects. Besides the hard limit given to
+ * dctrl_create() the number of decoders that are kept open follows
+ * the load.
+ * @param p pointer to a decoder-control object
+ * @param file_max max. number of decoder objects per file, 0: unlimited (default)
+ * @param mem_max max. estimated memory of all open decoders in bytes, 0: unlimited (default)
+ */
+void dctrl_set_limits(void *p, int file_max, size_t mem_max);
+/**
+ * admission control: account a decode request before it is started.
+ * It is rejected if the expected wait for the backlog of all files,
+ * or for the backlog of this file on its decoders, exceeds the limit
+ * set with dctrl_set_admission().
+ * @param p pointer to a decoder-control object
+ * @param id file-id
+ * @param frames number of frames that will be decoded
+ * @param ticket return value, to be passed to dctrl_admit_done()
+ * @param retry_after return value if rejected: seconds after which the request may succeed (may be NULL)
+ * @return 0 if the request is admitted, 503 if the server is overloaded
+ */
+int dctrl_admit(void *p, unsigned short id, int frames, int64_t *ticket, int *retry_after);
+/**
+ * an admitted request has completed (or failed).
+ * @param p pointer to a decoder-control object
+ * @param id file-id
+ * @param ticket value returned by dctrl_admit()
+ */
+void dctrl_admit_done(void *p, unsigned short id, int64_t ticket);
 /**
  * request a video-object id for the given file
  *
@@ -71,11 +163,33 @@ int dctrl_get_info(void *p, unsigned short id, VInfo *i);
  * @return 0 on success, -1 otherwise
  */
 int dctrl_get_info_scale(void *p, unsigned short id, VInfo *i, int w, int h, int fmt);
+/**
+ * look up the keyframe at or before a frame in the file's keyframe index
+ * @param p  pointer to a decoder-control object
+ * @param id id of the decoder
+ * @param frame frame-number
+ * @return frame-number of the keyframe, -1 if the index is not (yet) available
+ */
+int64_t dctrl_get_keyframe(void *p, unsigned short id, int64_t frame);
 
 /**
  * used by the frame-cache to decode a frame
+ * @param dh optional per-request hints, may be NULL
+ */
+int dctrl_decode(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt, DecoderHints *dh);
+/**
+ * decode the frames start, start + stride, .. (count frames) in one
+ * sequential pass using a single decoder.
+ * For each frame \a get is called for a buffer of w x h at fmt;
+ * frames for which it returns NULL are skipped. \a done is called
+ * once the frame was decoded into that buffer.
+ * Frames are always decoded exactly, DecoderHints.seekmode is ignored.
+ * @param dh optional per-request hints, may be NULL
+ * @return 0 on success, 503 if no decoder is available, 500 if the file is invalid
  */
-int dctrl_decode(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt);
+int dctrl_decode_range(void *p, unsigned short vid, int64_t start, int count, int stride,
+    int w, int h, int fmt, DecoderHints *dh,
+    harvest_get_fn get, harvest_done_fn done, void *arg);
 
 /**
  */
@@ -18,6 +18,7 @@
  */
 #include <stdio.h>
 #include <stdint.h>     /* uint8_t */
+#include <inttypes.h>
 #include <stdlib.h>     /* calloc et al.*/
 #include <string.h>     /* memset */
 #include <unistd.h>
@@ -26,11 +27,20 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#endif
 
 #include "vinfo.h"
 #include "ffdecoder.h"
 
 #include "ffcompat.h"
+#include "lrulist.h"
 #include <libswscale/swscale.h>
 
 
@@ -41,12 +51,111 @@ enum {  SEEK_ANY, ///< directly seek to givenvideo frame
         SEEK_LIVESTREAM, ///< decode until next keyframe in a live-stream and set initial PTS offset; later decode cont. until PTS match
 };
 
+/* keyframe/PTS index -- built once per file, shared by all its decoders */
+typedef struct {
+  pthread_mutex_t lock; ///< lock to modify refcnt
+  int      refcnt;
+  int64_t  frames;  ///< total number of video frames in the file
+  int64_t  maxgop;  ///< max. number of frames between two keyframes
+  int64_t  nkeys;   ///< number of keyframes
+  int64_t *keypts;  ///< sorted keyframe timestamps (stream time-base)
+  int64_t *keyframes; ///< the same as frame-numbers, see ff_index_keyframe_at()
+  void    *map;     ///< if !NULL keypts points into this mmap()ed sidecar file
+  size_t   maplen;
+} ffindex;
+
+/* on-disk keyframe index (sidecar cache file)
+ * header, followed by the file-name (zero padded to 8 bytes)
+ * and nkeys int64_t keyframe timestamps. native byte-order.
+ */
+#define FFI_MAGIC "HVIDKFI"
+#define FFI_VERSION 1
+#define FFI_BOM 0x01020304
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t bom;     ///< byte-order mark
+  int64_t  fsize;   ///< size of the video file
+  int64_t  mtime;   ///< modification time of the video file
+  int64_t  frames;
+  int64_t  maxgop;
+  int64_t  nkeys;
+  int32_t  stream;  ///< video stream index
+  uint32_t pathlen; ///< strlen() of the video file-name
+} ffindex_hdr;
+
+#define FFI_PAD8(x) (((x) + 7) & ~((size_t)7))
+
+/* stream parameters found by avformat_find_stream_info()
+ * -- probed once per file, shared by all its decoders */
+typedef struct {
+  pthread_mutex_t lock; ///< lock to modify refcnt
+  int      refcnt;
+  unsigned int nb_streams;
+  int      stream;    ///< video stream index
+  int      codec_id;
+  int      width;
+  int      height;
+  int      pix_fmt;
+  int      has_b_frames;
+  int      ticks_per_frame;
+  AVRational sample_aspect_ratio;
+  AVRational codec_time_base;
+  AVRational time_base;
+  AVRational avg_frame_rate;
+  AVRational r_frame_rate;
+  int64_t  nb_frames;
+  int64_t  duration;   ///< stream duration
+  int64_t  start_time; ///< stream start time
+  int64_t  fmt_duration;
+  int64_t  fmt_start_time;
+} ffprobe;
+
+/* compressed video packets of one GOP: from a keyframe up to
+ * (excluding) the next keyframe.
+ */
+typedef struct {
+  uint8_t *data;
+  int      size;
+  int      flags;
+  int64_t  pts;
+  int64_t  dts;
+} ffgoppkt;
+
+typedef struct ffgop {
+  int64_t   key;    ///< keyframe timestamp (as in ffindex)
+  int64_t   next;   ///< timestamp of the following keyframe
+  size_t    bytes;
+  int       npkt;
+  int       alloc;
+  ffgoppkt *pkt;
+  int       users;  ///< decoders currently replaying this GOP
+  lru_node  ln;     ///< linked to ffgopcache.lru
+} ffgop;
+
+/* per-file packet cache -- shared by all decoders of a file */
+typedef struct {
+  pthread_mutex_t lock; ///< lock to modify refcnt and the GOP list
+  int      refcnt;
+  size_t   budget;  ///< max. bytes of packet data
+  size_t   used;
+  uint64_t hits;
+  uint64_t misses;
+  lru_list lru;     ///< all cached GOPs, most recently replayed first
+} ffgopcache;
+
+
+#define MAX_SLICES 16  ///< max. number of bands for sliced scaling
+#define SLICE_ALIGN 16 ///< band height granularity (multiple of chroma subsampling)
+#define SLICE_OVERLAP 16 ///< rows converted beyond each band edge (chroma filter taps)
 
 /* ffmpeg source */
 typedef struct {
   /* file specific decoder settings */
   int   want_ignstart; //< set before calling ff_open_movie()
   int   want_genpts;
+  int   want_mmap;     //< read local files from a memory-mapping, see ff_set_mmap()
   int   seekflags;
   /* Video File Info */
   int   movie_width;  ///< original file geometry
@@ -63,6 +172,20 @@ typedef struct {
   double tpf;
   int64_t avprev;
   int64_t stream_pts_offset;
+  ffindex *index; ///< optional keyframe index, see ff_set_index()
+  ffprobe *probe; ///< optional stream parameters, see ff_set_probe()
+  ffgopcache *gopcache; ///< optional packet cache, see ff_set_gopcache()
+  ffgop *gop_rec;  ///< GOP that is currently read from the file
+  ffgop *gop_play; ///< GOP that is currently replayed from the cache
+  int    gop_pos;  ///< next packet to replay
+  /* memory-mapped I/O, see ff_mmap_open() */
+  uint8_t     *io_map;
+  size_t       io_maplen; ///< length of the mapping
+  int64_t      io_size;   ///< readable bytes, shrinks if the file is truncated
+  int64_t      io_pos;
+  int          io_advice; ///< current madvise() setting
+  int          io_reads;  ///< packets read since the last seek
+  AVIOContext *io_ctx;
   /* */
   uint8_t *internal_buffer; //< if !NULL this buffer is free()d on destroy
   uint8_t *buffer;
@@ -70,6 +193,16 @@ typedef struct {
   int   buf_height; ///< current geometry for allocated buffer
   int   videoStream;
   int   render_fmt;  //< pFrame/buffer output format (RGB24)
+  int   threads;     ///< codec slice-threads, see ff_set_threads()
+  int   codec_width;  ///< coded size at full resolution
+  int   codec_height; ///< (pCodecCtx's size is reduced with lowres)
+  int   lowres;       ///< current codec lowres setting
+  int   thumbnail;    ///< cheap decode and scale for small output sizes
+  int   seekmode;     ///< per-request seek accuracy, see ff_set_seekmode()
+  int64_t delivered;  ///< frame-number of the last rendered frame
+  harvest_get_fn  harvest_get;  ///< optional, see ff_set_harvest()
+  harvest_done_fn harvest_done;
+  void           *harvest_arg;
   /* ffmpeg internals*/
   AVPacket          packet;
   AVFormatContext   *pFormatCtx;
@@ -77,6 +210,10 @@ typedef struct {
   AVFrame           *pFrame;
   AVFrame           *pFrameFMT;
   struct SwsContext *pSWSCtx;
+  struct SwsContext *pSliceCtx[MAX_SLICES]; ///< see ff_scale_sliced()
+  uint8_t           *slice_buf;   ///< converted bands incl. overlap
+  size_t             slice_alloc;
+  struct ffscalepool *scalepool;  ///< optional, see ff_set_scalepool()
 } ffst;
 
 /* Option flags and global variables */
@@ -84,6 +221,499 @@ extern int want_quiet;
 extern int want_verbose;
 
 static pthread_mutex_t avcodec_lock;
+static int avcodec_lockmgr = 0; ///< libav serializes codec open/close itself
+
+/* The global lock is only needed if libav does not have a lock-manager:
+ * avcodec_open2() and avcodec_close() (also called by
+ * avformat_find_stream_info()) are otherwise protected by libav.
+ */
+static inline void ff_lock(void) {
+  if (!avcodec_lockmgr) pthread_mutex_lock(&avcodec_lock);
+}
+
+static inline void ff_unlock(void) {
+  if (!avcodec_lockmgr) pthread_mutex_unlock(&avcodec_lock);
+}
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(53, 0, 0)
+static int ff_lockmgr(void **mutex, enum AVLockOp op) {
+  pthread_mutex_t *m = (pthread_mutex_t*) *mutex;
+  switch (op) {
+    case AV_LOCK_CREATE:
+      m = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
+      if (!m || pthread_mutex_init(m, NULL)) {
+        free(m);
+        return 1;
+      }
+      *mutex = m;
+      return 0;
+    case AV_LOCK_OBTAIN:
+      return !!pthread_mutex_lock(m);
+    case AV_LOCK_RELEASE:
+      return !!pthread_mutex_unlock(m);
+    case AV_LOCK_DESTROY:
+      pthread_mutex_destroy(m);
+      free(m);
+      *mutex = NULL;
+      return 0;
+  }
+  return 1;
+}
+#endif
+
+/* sliced colour-space conversion: large frames are converted in
+ * horizontal bands, in parallel, by a pool of worker threads that is
+ * shared by the decoders of a decoder-control object.
+ * Each band uses its own scaler context. Its source rows extend
+ * SLICE_OVERLAP rows into the neighbouring bands, so that the
+ * (chroma) filters see the same input as for the complete frame;
+ * only the band's own rows are copied to the output.
+ */
+typedef struct ffslice {
+  struct SwsContext *ctx;
+  const uint8_t *src[4];
+  const int *srcStride;
+  int h;                ///< converted rows, incl. overlap
+  uint8_t *tmp[4];      ///< conversion result, same strides as dst
+  uint8_t *dst[4];      ///< the band's rows in the output
+  const int *dstStride;
+  int skip;             ///< overlap rows at the top of tmp
+  int rows;             ///< band height
+  int vshift;           ///< vertical subsampling of output planes 1 and 2
+  int *pending;         ///< outstanding slices of the frame this band belongs to
+  struct ffslice *next;
+} ffslice;
+
+typedef struct ffscalepool {
+  pthread_mutex_t lock;
+  pthread_cond_t  wake; ///< a slice was queued or the pool is stopping
+  pthread_cond_t  done; ///< a slice was completed
+  pthread_t *workers;
+  int        nworkers;
+  int        run;
+  int        min_pixels; ///< only frames at least this large are sliced
+  ffslice   *queue;
+} ffscalepool;
+
+static void ff_slice_run(ffslice *s) {
+  int p;
+  sws_scale(s->ctx, s->src, s->srcStride, 0, s->h, s->tmp, s->dstStride);
+  for (p = 0; p < 4 && s->dst[p]; ++p) {
+    const int vs = (p == 1 || p == 2) ? s->vshift : 0;
+    const int r0 = s->skip >> vs; // bands start at a multiple of SLICE_ALIGN
+    const int r1 = (s->skip + s->rows + (1 << vs) - 1) >> vs;
+    memcpy(s->dst[p], s->tmp[p] + r0 * s->dstStride[p], (size_t) (r1 - r0) * s->dstStride[p]);
+  }
+}
+
+static void *ff_scale_worker(void *arg) {
+  ffscalepool *sp = (ffscalepool*) arg;
+  pthread_mutex_lock(&sp->lock);
+  while (sp->run) {
+    ffslice *s = sp->queue;
+    if (!s) {
+      pthread_cond_wait(&sp->wake, &sp->lock);
+      continue;
+    }
+    sp->queue = s->next;
+    pthread_mutex_unlock(&sp->lock);
+    ff_slice_run(s);
+    pthread_mutex_lock(&sp->lock);
+    --*s->pending;
+    pthread_cond_broadcast(&sp->done);
+  }
+  pthread_mutex_unlock(&sp->lock);
+  return NULL;
+}
+
+static void ff_scalepool_stop(ffscalepool *sp) {
+  int i;
+  pthread_mutex_lock(&sp->lock);
+  sp->run = 0;
+  pthread_cond_broadcast(&sp->wake);
+  pthread_mutex_unlock(&sp->lock);
+  for (i = 0; i < sp->nworkers; ++i)
+    pthread_join(sp->workers[i], NULL);
+  free(sp->workers);
+  sp->workers = NULL;
+  sp->nworkers = 0;
+}
+
+void *ff_scalepool_create(void) {
+  ffscalepool *sp = (ffscalepool*) calloc(1, sizeof(ffscalepool));
+  if (!sp) return NULL;
+  pthread_mutex_init(&sp->lock, NULL);
+  pthread_cond_init(&sp->wake, NULL);
+  pthread_cond_init(&sp->done, NULL);
+  sp->min_pixels = 1920 * 1080;
+  return sp;
+}
+
+void ff_scalepool_destroy(void *ptr) {
+  ffscalepool *sp = (ffscalepool*) ptr;
+  if (!sp) return;
+  ff_scalepool_stop(sp);
+  pthread_cond_destroy(&sp->wake);
+  pthread_cond_destroy(&sp->done);
+  pthread_mutex_destroy(&sp->lock);
+  free(sp);
+}
+
+/* (re)start the pool's worker threads.
+ * This must not be called while decoders use the pool.
+ */
+void ff_scalepool_set_threads(void *ptr, int threads, int min_pixels) {
+  ffscalepool *sp = (ffscalepool*) ptr;
+  int i;
+  ff_scalepool_stop(sp);
+  if (min_pixels > 0) sp->min_pixels = min_pixels;
+  if (threads < 1) return;
+  if (threads > MAX_SLICES - 1) threads = MAX_SLICES - 1;
+
+  sp->workers = (pthread_t*) calloc(threads, sizeof(pthread_t));
+  if (!sp->workers) return;
+  sp->run = 1;
+  for (i = 0; i < threads; ++i) {
+    if (pthread_create(&sp->workers[i], NULL, ff_scale_worker, sp)) break;
+  }
+  sp->nworkers = i;
+  if (want_verbose)
+    fprintf(stdout, "FFMPEG: %d scaler threads, min. %d pixels.\n", i, sp->min_pixels);
+}
+
+void ff_set_scalepool(void *ptr, void *sp) {
+  ((ffst*) ptr)->scalepool = (ffscalepool*) sp;
+}
+
+/* memory-mapped I/O for local files: the demuxer reads from a shared,
+ * read-only mapping of the file instead of using read() calls.
+ * The kernel is advised to expect random access after keyframe seeks
+ * and sequential access once the decoder reads on (catch-up).
+ *
+ * If the file is truncated (e.g. re-exported in place) while it is
+ * mapped, accessing pages beyond its new end raises SIGBUS. Copies from
+ * the mapping are guarded: the signal aborts the read with EIO and the
+ * mapping is treated as ending there.
+ */
+#define MMAP_IOBUF 32768
+#define MMAP_SEQ_PACKETS 8 ///< packets read after a seek until access is considered sequential
+
+#ifndef WIN32
+static __thread sigjmp_buf * volatile mmap_jmp; ///< set while this thread copies from a mapping
+static struct sigaction mmap_oldbus;
+static pthread_once_t mmap_once = PTHREAD_ONCE_INIT;
+
+static void ff_mmap_sigbus(int sig, siginfo_t *si, void *uc) {
+  if (mmap_jmp) {
+    siglongjmp(*mmap_jmp, 1);
+  }
+  /* not ours, restore the previous disposition and re-raise */
+  sigaction(SIGBUS, &mmap_oldbus, NULL);
+  raise(sig);
+  (void) si; (void) uc;
+}
+
+static void ff_mmap_guard_init(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = ff_mmap_sigbus;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER; // not blocked after siglongjmp()
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, &mmap_oldbus);
+}
+#endif
+
+static int ff_mmap_read(void *opaque, uint8_t *buf, int buf_size) {
+  ffst *ff = (ffst*) opaque;
+  int64_t n = ff->io_size - ff->io_pos;
+#ifndef WIN32
+  sigjmp_buf jb;
+#endif
+  if (n <= 0) return AVERROR_EOF;
+  if (n > buf_size) n = buf_size;
+#ifndef WIN32
+  if (sigsetjmp(jb, 0)) {
+    mmap_jmp = NULL;
+    if (!want_quiet)
+      fprintf(stderr, "FFMPEG: file was truncated while it is mapped.\n");
+    ff->io_size = ff->io_pos;
+    return AVERROR(EIO);
+  }
+  mmap_jmp = &jb;
+#endif
+  memcpy(buf, ff->io_map + ff->io_pos, n);
+#ifndef WIN32
+  mmap_jmp = NULL;
+#endif
+  ff->io_pos += n;
+  return (int) n;
+}
+
+static int64_t ff_mmap_seek(void *opaque, int64_t offset, int whence) {
+  ffst *ff = (ffst*) opaque;
+  int64_t pos;
+#ifdef AVSEEK_FORCE
+  whence &= ~AVSEEK_FORCE;
+#endif
+  switch (whence) {
+    case AVSEEK_SIZE:
+      return ff->io_size;
+    case SEEK_SET:
+      pos = offset;
+      break;
+    case SEEK_CUR:
+      pos = ff->io_pos + offset;
+      break;
+    case SEEK_END:
+      pos = ff->io_size + offset;
+      break;
+    default:
+      return -1;
+  }
+  if (pos < 0 || pos > ff->io_size) return -1;
+  ff->io_pos = pos;
+  return pos;
+}
+
+static void ff_mmap_close(ffst *ff) {
+  if (ff->io_ctx) {
+    av_free(ff->io_ctx->buffer);
+    av_free(ff->io_ctx);
+  }
+  ff->io_ctx = NULL;
+#ifndef WIN32
+  if (ff->io_map)
+    munmap(ff->io_map, ff->io_maplen);
+#endif
+  ff->io_map = NULL;
+}
+
+/* map the file and prepare a format-context that reads from it
+ * @return 0 on success, -1 to fall back to the default file protocol.
+ */
+static int ff_mmap_open(ffst *ff, const char *file_name) {
+#ifndef WIN32
+  struct stat sb;
+  void *map;
+  uint8_t *iobuf;
+  int fd;
+
+  pthread_once(&mmap_once, ff_mmap_guard_init);
+  if ((fd = open(file_name, O_RDONLY)) < 0) return -1;
+  if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) || sb.st_size < 1
+      || (uint64_t) sb.st_size > (uint64_t) SIZE_MAX) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  ff->io_map = (uint8_t*) map;
+  ff->io_maplen = sb.st_size;
+  ff->io_size = sb.st_size;
+  ff->io_pos = 0;
+  ff->io_advice = MADV_NORMAL;
+  ff->io_reads = 0;
+
+  if (!(iobuf = (uint8_t*) av_malloc(MMAP_IOBUF))) {
+    ff_mmap_close(ff);
+    return -1;
+  }
+  ff->io_ctx = avio_alloc_context(iobuf, MMAP_IOBUF, 0, ff, ff_mmap_read, NULL, ff_mmap_seek);
+  if (!ff->io_ctx) {
+    av_free(iobuf);
+    ff_mmap_close(ff);
+    return -1;
+  }
+  if (!(ff->pFormatCtx = avformat_alloc_context())) {
+    ff_mmap_close(ff);
+    return -1;
+  }
+  ff->pFormatCtx->pb = ff->io_ctx;
+  ff->pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+static void ff_mmap_advise(ffst *ff, int random) {
+#ifndef WIN32
+  const int advice = random ? MADV_RANDOM : MADV_SEQUENTIAL;
+  if (!ff->io_map || ff->io_advice == advice) return;
+  madvise(ff->io_map, ff->io_maplen, advice);
+  ff->io_advice = advice;
+#endif
+}
+
+/* GOP packet cache: while reading a file sequentially, the packets of
+ * each GOP are recorded. Complete GOPs are stored in the file's
+ * cache and replayed from memory when seeking to their keyframe.
+ * This requires a keyframe index (see ff_set_index).
+ */
+static void ff_gop_free(ffgop *gop) {
+  int i;
+  if (!gop) return;
+  for (i = 0; i < gop->npkt; ++i)
+    free(gop->pkt[i].data);
+  free(gop->pkt);
+  free(gop);
+}
+
+/* find a cached GOP by its keyframe, gc->lock must be held */
+static ffgop *ff_gop_find(ffgopcache *gc, int64_t key) {
+  lru_node *n;
+  for (n = gc->lru.head; n; n = n->next) {
+    ffgop *g = LRU_ENTRY(n, ffgop, ln);
+    if (g->key == key) return g;
+  }
+  return NULL;
+}
+
+/* add a complete GOP to the cache, evicting least recently used GOPs
+ * as needed. The GOP is owned by the cache afterwards. */
+static void ff_gop_store(ffgopcache *gc, ffgop *gop) {
+  ffgop *g;
+  lru_node *n;
+  pthread_mutex_lock(&gc->lock);
+  g = ff_gop_find(gc, gop->key);
+  n = lru_tail(&gc->lru);
+  while (!g && n && gc->used + gop->bytes > gc->budget) {
+    ffgop *victim = LRU_ENTRY(n, ffgop, ln);
+    n = n->prev;
+    if (victim->users > 0) continue; // being replayed
+    lru_unlink(&victim->ln);
+    gc->used -= victim->bytes;
+    ff_gop_free(victim);
+  }
+  if (g || gc->used + gop->bytes > gc->budget) {
+    /* already cached, or does not fit */
+    pthread_mutex_unlock(&gc->lock);
+    ff_gop_free(gop);
+    return;
+  }
+  lru_push(&gc->lru, &gop->ln);
+  gc->used += gop->bytes;
+  pthread_mutex_unlock(&gc->lock);
+}
+
+static void ff_gop_stop(ffst *ff) {
+  if (ff->gop_play) {
+    pthread_mutex_lock(&ff->gopcache->lock);
+    ff->gop_play->users--;
+    pthread_mutex_unlock(&ff->gopcache->lock);
+    ff->gop_play = NULL;
+  }
+  ff_gop_free(ff->gop_rec);
+  ff->gop_rec = NULL;
+}
+
+/* start to replay the GOP beginning at the given keyframe
+ * @return 0 on success, -1 if the GOP is not cached.
+ */
+static int ff_gop_replay(ffst *ff, int64_t key) {
+  ffgop *g;
+  ffgopcache *gc = ff->gopcache;
+  ff_gop_stop(ff);
+  if (!gc) return -1;
+  pthread_mutex_lock(&gc->lock);
+  if ((g = ff_gop_find(gc, key))) {
+    g->users++;
+    lru_push(&gc->lru, &g->ln);
+    gc->hits++;
+  } else {
+    gc->misses++;
+  }
+  pthread_mutex_unlock(&gc->lock);
+  if (!g) return -1;
+  ff->gop_play = g;
+  ff->gop_pos = 0;
+  return 0;
+}
+
+/* keep a copy of a video packet that was read from the file */
+static void ff_gop_record(ffst *ff, const AVPacket *pkt) {
+  ffgoppkt *p;
+  const int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+  if ((pkt->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+    if (ff->gop_rec) {
+      ff->gop_rec->next = ts;
+      ff_gop_store(ff->gopcache, ff->gop_rec);
+    }
+    ff->gop_rec = (ffgop*) calloc(1, sizeof(ffgop));
+    if (!ff->gop_rec) return;
+    ff->gop_rec->key = ts;
+  }
+  if (!ff->gop_rec) return;
+
+  if (ff->gop_rec->npkt == ff->gop_rec->alloc) {
+    ffgoppkt *tmp;
+    const int alloc = ff->gop_rec->alloc ? 2 * ff->gop_rec->alloc : 32;
+    tmp = (ffgoppkt*) realloc(ff->gop_rec->pkt, alloc * sizeof(ffgoppkt));
+    if (!tmp) goto abort;
+    ff->gop_rec->pkt = tmp;
+    ff->gop_rec->alloc = alloc;
+  }
+  /* a single GOP may use at most half of the budget */
+  if (ff->gop_rec->bytes + pkt->size > ff->gopcache->budget / 2) goto abort;
+
+  p = &ff->gop_rec->pkt[ff->gop_rec->npkt];
+  if (!(p->data = (uint8_t*) malloc(pkt->size > 0 ? pkt->size : 1))) goto abort;
+  memcpy(p->data, pkt->data, pkt->size);
+  p->size = pkt->size;
+  p->flags = pkt->flags;
+  p->pts = pkt->pts;
+  p->dts = pkt->dts;
+  ff->gop_rec->npkt++;
+  ff->gop_rec->bytes += pkt->size;
+  return;
+
+abort:
+  ff_gop_free(ff->gop_rec);
+  ff->gop_rec = NULL;
+}
+
+/* av_read_frame() replacement: replays cached packets, records
+ * packets that are read from the file */
+static int ff_read_packet(ffst *ff, AVPacket *pkt) {
+  int rv;
+  if (ff->gop_play) {
+    ffgop *g = ff->gop_play;
+    if (ff->gop_pos < g->npkt) {
+      const ffgoppkt *p = &g->pkt[ff->gop_pos++];
+      if (av_new_packet(pkt, p->size)) return -1;
+      memcpy(pkt->data, p->data, p->size);
+      pkt->stream_index = ff->videoStream;
+      pkt->flags = p->flags;
+      pkt->pts = p->pts;
+      pkt->dts = p->dts;
+      return 0;
+    } else {
+      /* end of the GOP, continue to read from the file */
+      const int64_t next = g->next;
+      ff_gop_stop(ff);
+      if (av_seek_frame(ff->pFormatCtx, ff->videoStream, next, AVSEEK_FLAG_BACKWARD) < 0)
+        return -1;
+    }
+  }
+  if (++ff->io_reads == MMAP_SEQ_PACKETS)
+    ff_mmap_advise(ff, 0);
+  rv = av_read_frame(ff->pFormatCtx, pkt);
+  if (rv >= 0 && ff->gopcache && ff->index && pkt->stream_index == ff->videoStream)
+    ff_gop_record(ff, pkt);
+  return rv;
+}
+
+/* av_seek_frame() replacement, ends replay and recording */
+static int ff_seek(ffst *ff, int64_t timestamp, int flags) {
+  ff_gop_stop(ff);
+  ff_mmap_advise(ff, 1);
+  ff->io_reads = 0;
+  return av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp, flags);
+}
+
 static const AVRational c1_Q = { 1, 1 };
 
 //#define SCALE_UP  ///< positive pixel-aspect scales up X axis - else positive pixel-aspect scales down Y-Axis.
@@ -205,9 +835,9 @@ static double ff_get_aspectratio(void *ptr) {
     aspect_ratio = 0;
   else
     aspect_ratio = av_q2d(ff->pCodecCtx->sample_aspect_ratio)
-                   * (double)ff->pCodecCtx->width / (double)ff->pCodecCtx->height;
+                   * (double)ff->codec_width / (double)ff->codec_height;
   if (aspect_ratio <= 0.0)
-    aspect_ratio = (double)ff->pCodecCtx->width / (double)ff->pCodecCtx->height;
+    aspect_ratio = (double)ff->codec_width / (double)ff->codec_height;
   return (aspect_ratio);
 }
 
@@ -221,11 +851,11 @@ static void ff_caononicalize_size2(void *ptr, int *w, int *h) {
 
   if ((*w) < 16 || (*h) < 16) {
 #ifdef SCALE_UP
-    (*w) = (int) floor((double)ff->pCodecCtx->height * aspect_ratio);
-    (*h) = ff->pCodecCtx->height;
+    (*w) = (int) floor((double)ff->codec_height * aspect_ratio);
+    (*h) = ff->codec_height;
 #else
-    (*w) = ff->pCodecCtx->width ;
-    (*h) = (int) floor((double)ff->pCodecCtx->width / aspect_ratio);
+    (*w) = ff->codec_width ;
+    (*h) = (int) floor((double)ff->codec_width / aspect_ratio);
 #endif
   }
 }
@@ -270,6 +900,11 @@ void ff_initialize (void) {
   av_register_all();
   avcodec_register_all();
   pthread_mutex_init(&avcodec_lock, NULL);
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(53, 0, 0)
+  avcodec_lockmgr = !av_lockmgr_register(ff_lockmgr);
+#endif
+  if (want_verbose)
+    fprintf(stdout, "FFMPEG: %s lock-manager.\n", avcodec_lockmgr ? "using libav" : "global codec");
 
   if(want_quiet) av_log_set_level(AV_LOG_QUIET);
   else if (want_verbose) av_log_set_level(AV_LOG_VERBOSE);
@@ -277,15 +912,30 @@ void ff_initialize (void) {
 }
 
 void ff_cleanup (void) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(53, 0, 0)
+  if (avcodec_lockmgr) av_lockmgr_register(NULL);
+#endif
+  avcodec_lockmgr = 0;
   pthread_mutex_destroy(&avcodec_lock);
 }
 
 int ff_close_movie(void *ptr) {
   ffst *ff = (ffst*)ptr;
+  int i;
   if(ff->current_file) free(ff->current_file);
   ff->current_file = NULL;
+  if (ff->probe) ff_probe_unref(ff->probe);
+  ff->probe = NULL;
+  if (ff->gopcache) {
+    ff_gop_stop(ff);
+    ff_gopcache_unref(ff->gopcache);
+  }
+  ff->gopcache = NULL;
 
-  if (!ff->pFrameFMT) return(-1);
+  if (!ff->pFrameFMT) {
+    ff_mmap_close(ff); // format-context was closed on failure
+    return(-1);
+  }
   if (ff->out_width < 0 || ff->out_height < 0) {
     ff->out_width = ff->movie_width;
     ff->out_height = ff->movie_height;
@@ -295,11 +945,22 @@ int ff_close_movie(void *ptr) {
   if (ff->pFrameFMT) av_free(ff->pFrameFMT);
   if (ff->pFrame) av_free(ff->pFrame);
   ff->buffer = NULL;ff->pFrameFMT = ff->pFrame = NULL;
-  pthread_mutex_lock(&avcodec_lock);
+  ff_lock();
   avcodec_close(ff->pCodecCtx);
   avformat_close_input(&ff->pFormatCtx);
-  pthread_mutex_unlock(&avcodec_lock);
+  ff_unlock();
+  ff_mmap_close(ff);
   if (ff->pSWSCtx) sws_freeContext(ff->pSWSCtx);
+  ff->pSWSCtx = NULL;
+  for (i = 0; i < MAX_SLICES; ++i) {
+    if (ff->pSliceCtx[i]) sws_freeContext(ff->pSliceCtx[i]);
+    ff->pSliceCtx[i] = NULL;
+  }
+  free(ff->slice_buf);
+  ff->slice_buf = NULL;
+  ff->slice_alloc = 0;
+  if (ff->index) ff_index_unref(ff->index);
+  ff->index = NULL;
   return (0);
 }
 
@@ -340,13 +1001,180 @@ static void ff_set_framerate(ffst *ff) {
   }
 }
 
+/* Only slice-threading is used: frame-threading delays the decoder
+ * output by (thread_count - 1) frames, while my_seek_frame() and
+ * ff_render() expect the decoded frame to correspond to the last packet.
+ */
+static void ff_codec_threads(ffst *ff) {
+  ff->pCodecCtx->thread_count = ff->threads > 1 ? ff->threads : 1;
+#ifdef FF_THREAD_SLICE
+  ff->pCodecCtx->thread_type = FF_THREAD_SLICE;
+#endif
+}
+
+/* close and re-open the codec to apply thread and lowres settings.
+ * The next ff_render() call seeks to the keyframe before the
+ * requested frame.
+ */
+static int ff_reopen_codec(ffst *ff) {
+  AVCodec *pCodec;
+  int rv;
+
+  pCodec = avcodec_find_decoder(ff->pCodecCtx->codec_id);
+  if (!pCodec) return -1;
+
+  ff_lock();
+  avcodec_close(ff->pCodecCtx);
+  ff->pCodecCtx->width = ff->codec_width;
+  ff->pCodecCtx->height = ff->codec_height;
+  ff->pCodecCtx->lowres = ff->lowres;
+  ff_codec_threads(ff);
+  rv = avcodec_open2(ff->pCodecCtx, pCodec, NULL);
+  ff_unlock();
+  if (rv < 0) {
+    if (!want_quiet)
+      fprintf(stderr, "Cannot re-open the codec for file %s\n", ff->current_file);
+    return -1;
+  }
+  ff->avprev = INT64_MAX; // force seek
+  return 0;
+}
+
+/* Thumbnail mode: if the output is at least 4 times smaller than the
+ * video, skip the loop-filter, skip the IDCT of non-reference frames
+ * that are only decoded to reach the requested one, and use a faster
+ * scaler. Decoders that are assigned to thumbnails (ff_set_lowres())
+ * also decode at reduced resolution.
+ */
+#define THUMB_RATIO 4
+
+/* lowres level for the given output size: the codec's size is
+ * reduced as long as it remains at least twice the output size */
+static int ff_lowres_for(ffst *ff, int w, int h) {
+  int lowres = 0;
+  if (   w * THUMB_RATIO > ff->codec_width
+      || h * THUMB_RATIO > ff->codec_height
+      || !ff->pCodecCtx->codec)
+    return 0;
+  while (lowres < ff->pCodecCtx->codec->max_lowres
+      && (ff->codec_width  >> (lowres + 1)) >= 2 * w
+      && (ff->codec_height >> (lowres + 1)) >= 2 * h)
+    ++lowres;
+  return lowres;
+}
+
+static int ff_change_lowres(ffst *ff, int lowres) {
+  const int prev = ff->lowres;
+  if (lowres == prev) return 0;
+  ff->lowres = lowres;
+  if (want_verbose)
+    fprintf(stdout, "changing lowres: %d -> %d\n", prev, lowres);
+  if (ff_reopen_codec(ff)) {
+    ff->lowres = prev;
+    if (ff_reopen_codec(ff)) return -1;
+  }
+  return 0;
+}
+
+static int ff_thumbnail_mode(ffst *ff) {
+  const int thumbnail =
+       ff->out_width  * THUMB_RATIO <= ff->codec_width
+    && ff->out_height * THUMB_RATIO <= ff->codec_height;
+
+  /* lowres is only lowered here, when the output needs more detail */
+  if (ff->lowres > 0) {
+    const int lowres = ff_lowres_for(ff, ff->out_width, ff->out_height);
+    if (lowres < ff->lowres && ff_change_lowres(ff, lowres)) return -1;
+  }
+
+  if (thumbnail != ff->thumbnail) {
+    ff->thumbnail = thumbnail;
+    ff->pCodecCtx->skip_loop_filter = thumbnail ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+  }
+  return 0;
+}
+
+/* remember the stream parameters of a freshly probed file */
+static ffprobe *ff_probe_save(ffst *ff, int stream) {
+  ffprobe *pr;
+  AVStream *avs = ff->pFormatCtx->streams[stream];
+  AVCodecContext *cc = avs->codec;
+
+  pr = (ffprobe*) calloc(1, sizeof(ffprobe));
+  if (!pr) return NULL;
+  pthread_mutex_init(&pr->lock, NULL);
+  pr->refcnt = 1;
+  pr->nb_streams = ff->pFormatCtx->nb_streams;
+  pr->stream = stream;
+  pr->codec_id = cc->codec_id;
+  pr->width = cc->width;
+  pr->height = cc->height;
+  pr->pix_fmt = cc->pix_fmt;
+  pr->has_b_frames = cc->has_b_frames;
+  pr->ticks_per_frame = cc->ticks_per_frame;
+  pr->sample_aspect_ratio = cc->sample_aspect_ratio;
+  pr->codec_time_base = cc->time_base;
+  pr->time_base = avs->time_base;
+  pr->avg_frame_rate = avs->avg_frame_rate;
+  pr->r_frame_rate = avs->r_frame_rate;
+  pr->nb_frames = avs->nb_frames;
+  pr->duration = avs->duration;
+  pr->start_time = avs->start_time;
+  pr->fmt_duration = ff->pFormatCtx->duration;
+  pr->fmt_start_time = ff->pFormatCtx->start_time;
+  return pr;
+}
+
+/* apply previously probed stream parameters instead of calling
+ * avformat_find_stream_info(). This is only done if the container
+ * header matches the probed file.
+ * @return 0 on success, -1 if the file needs to be probed.
+ */
+static int ff_probe_apply(ffst *ff, ffprobe *pr) {
+  AVStream *avs;
+  AVCodecContext *cc;
+
+  if (!pr || ff->pFormatCtx->nb_streams != pr->nb_streams) return -1;
+  avs = ff->pFormatCtx->streams[pr->stream];
+  cc = avs->codec;
+  if (cc->codec_type != AVMEDIA_TYPE_VIDEO
+      || cc->codec_id != pr->codec_id
+      || av_cmp_q(avs->time_base, pr->time_base))
+    return -1;
+
+  if (!cc->width || !cc->height) {
+    cc->width = pr->width;
+    cc->height = pr->height;
+  }
+  if (cc->pix_fmt == PIX_FMT_NONE)
+    cc->pix_fmt = pr->pix_fmt;
+  if (!cc->sample_aspect_ratio.num)
+    cc->sample_aspect_ratio = pr->sample_aspect_ratio;
+  cc->has_b_frames = pr->has_b_frames;
+  cc->ticks_per_frame = pr->ticks_per_frame;
+  cc->time_base = pr->codec_time_base;
+  avs->avg_frame_rate = pr->avg_frame_rate;
+  avs->r_frame_rate = pr->r_frame_rate;
+  avs->nb_frames = pr->nb_frames;
+  avs->duration = pr->duration;
+  avs->start_time = pr->start_time;
+  ff->pFormatCtx->duration = pr->fmt_duration;
+  ff->pFormatCtx->start_time = pr->fmt_start_time;
+  return 0;
+}
+
 int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   int i;
   AVCodec *pCodec;
   ffst *ff = (ffst*) ptr;
+  ffprobe *probe = ff->probe; // see ff_set_probe()
+  ff->probe = NULL;
 
   if (ff->pFrameFMT) {
-    if (ff->current_file && !strcmp(file_name, ff->current_file)) return(0);
+    if (ff->current_file && !strcmp(file_name, ff->current_file)) {
+      ff->probe = probe;
+      return(0);
+    }
     /* close currently open movie */
     if (!want_quiet)
       fprintf(stderr, "replacing current video file buffer\n");
@@ -369,10 +1197,16 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   ff->render_fmt = render_fmt;
 
   /* Open video file */
+  if (ff->want_mmap && strncmp(file_name, "http://", 7) && ff_mmap_open(ff, file_name)) {
+    if (want_verbose)
+      fprintf(stdout, "Cannot map video file %s, using default I/O\n", file_name);
+  }
   if(avformat_open_input(&ff->pFormatCtx, file_name, NULL, NULL) <0)
   {
     if (!want_quiet)
       fprintf(stderr, "Cannot open video file %s\n", file_name);
+    ff_mmap_close(ff);
+    if (probe) ff_probe_unref(probe);
     return (-1);
   }
 #if 1 /// XXX http is not neccesarily a live-stream!
@@ -385,16 +1219,23 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   // TODO: live-stream: remember first pts as offset! -> don't use multiple-decoders for the same stream ?!
 #endif
 
-  pthread_mutex_lock(&avcodec_lock);
   /* Retrieve stream information */
-  if(avformat_find_stream_info(ff->pFormatCtx, NULL) < 0) {
-    if (!want_quiet)
-      fprintf(stderr, "Cannot find stream information in file %s\n", file_name);
-    avformat_close_input(&ff->pFormatCtx);
-    pthread_mutex_unlock(&avcodec_lock);
-    return (-1);
+  if (!ff_probe_apply(ff, probe)) {
+    ff->probe = probe;
+    if (want_verbose)
+      fprintf(stdout, "re-using probed stream parameters\n");
+  } else {
+    if (probe) ff_probe_unref(probe);
+    ff_lock();
+    if(avformat_find_stream_info(ff->pFormatCtx, NULL) < 0) {
+      if (!want_quiet)
+        fprintf(stderr, "Cannot find stream information in file %s\n", file_name);
+      avformat_close_input(&ff->pFormatCtx);
+      ff_unlock();
+      return (-1);
+    }
+    ff_unlock();
   }
-  pthread_mutex_unlock(&avcodec_lock);
 
   if (want_verbose) av_dump_format(ff->pFormatCtx, 0, file_name, 0);
 
@@ -419,6 +1260,9 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
     return (-1);
   }
 
+  if (!ff->probe)
+    ff->probe = ff_probe_save(ff, ff->videoStream);
+
   ff_set_framerate(ff);
 
   {
@@ -455,15 +1299,19 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
 #else
   ff->pCodecCtx = &(ff->pFormatCtx->streams[ff->videoStream]->codec);
 #endif
+  ff->codec_width = ff->pCodecCtx->width;
+  ff->codec_height = ff->pCodecCtx->height;
+  ff->lowres = 0;
+  ff->thumbnail = 0;
 
 // FIXME: don't scale here - announce aspect ratio
 // out_width/height remains in aspect 1:1
 #ifdef SCALE_UP
-  ff->movie_width = (int) floor((double)ff->pCodecCtx->height * ff_get_aspectratio(ff));
-  ff->movie_height = ff->pCodecCtx->height;
+  ff->movie_width = (int) floor((double)ff->codec_height * ff_get_aspectratio(ff));
+  ff->movie_height = ff->codec_height;
 #else
-  ff->movie_width = ff->pCodecCtx->width;
-  ff->movie_height = (int) floor((double)ff->pCodecCtx->width / ff_get_aspectratio(ff));
+  ff->movie_width = ff->codec_width;
+  ff->movie_height = (int) floor((double)ff->codec_width / ff_get_aspectratio(ff));
 #endif
 
   // somewhere around LIBAVFORMAT_BUILD  4630
@@ -487,15 +1335,16 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   }
 
   // Open codec
-  pthread_mutex_lock(&avcodec_lock);
+  ff_lock();
+  ff_codec_threads(ff);
   if(avcodec_open2(ff->pCodecCtx, pCodec, NULL) < 0) {
     if (!want_quiet)
       fprintf(stderr, "Cannot open the codec for file %s\n", file_name);
-    pthread_mutex_unlock(&avcodec_lock);
+    ff_unlock();
     avformat_close_input(&ff->pFormatCtx);
     return(-1);
   }
-  pthread_mutex_unlock(&avcodec_lock);
+  ff_unlock();
 
   if (!(ff->pFrame = avcodec_alloc_frame())) {
     if (!want_quiet)
@@ -520,6 +1369,387 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   return(0);
 }
 
+//--------------------------------------------
+// Keyframe index
+//--------------------------------------------
+
+static int cmp_int64(const void *a, const void *b) {
+  const int64_t x = *(const int64_t*)a;
+  const int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* return timestamp of the last keyframe at or before ts
+ * or AV_NOPTS_VALUE if there is none */
+static int64_t ff_index_keyframe(ffindex *idx, int64_t ts) {
+  int64_t lo = 0, hi = idx->nkeys;
+  while (lo < hi) {
+    const int64_t mid = lo + (hi - lo) / 2;
+    if (idx->keypts[mid] <= ts) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo > 0 ? idx->keypts[lo - 1] : AV_NOPTS_VALUE;
+}
+
+static int64_t ff_pts_to_frame(ffst *ff, int64_t pts);
+
+#ifndef WIN32
+/* sidecar file-name: FNV-1a hash of the video's path name */
+static char *ff_index_cachefile(const char *cachedir, const char *fn) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *c;
+  char *rv;
+  for (c = (const unsigned char*) fn; *c; ++c) {
+    h ^= *c;
+    h *= 0x100000001b3ULL;
+  }
+  rv = malloc(strlen(cachedir) + 22);
+  sprintf(rv, "%s/%016llx.kfi", cachedir, (unsigned long long) h);
+  return rv;
+}
+
+static ffindex *ff_index_load(ffst *ff, const char *cachefn, const struct stat *vsb) {
+  struct stat sb;
+  ffindex_hdr *hdr;
+  ffindex *idx;
+  size_t off;
+  void *map;
+  const size_t pathlen = strlen(ff->current_file);
+
+  int fd = open(cachefn, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &sb) || sb.st_size < sizeof(ffindex_hdr)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  hdr = (ffindex_hdr*) map;
+  off = sizeof(ffindex_hdr) + FFI_PAD8(pathlen);
+  if (   memcmp(hdr->magic, FFI_MAGIC, sizeof(FFI_MAGIC))
+      || hdr->version != FFI_VERSION
+      || hdr->bom != FFI_BOM
+      || hdr->fsize != (int64_t) vsb->st_size
+      || hdr->mtime != (int64_t) vsb->st_mtime
+      || hdr->stream != ff->videoStream
+      || hdr->pathlen != pathlen
+      || hdr->nkeys < 1
+      || sb.st_size != off + hdr->nkeys * sizeof(int64_t)
+      || memcmp(((char*)map) + sizeof(ffindex_hdr), ff->current_file, pathlen)
+     ) {
+    munmap(map, sb.st_size);
+    return NULL;
+  }
+
+  idx = (ffindex*) calloc(1, sizeof(ffindex));
+  idx->frames = hdr->frames;
+  idx->maxgop = hdr->maxgop;
+  idx->nkeys  = hdr->nkeys;
+  idx->keypts = (int64_t*) (((char*)map) + off);
+  idx->map    = map;
+  idx->maplen = sb.st_size;
+  return idx;
+}
+
+static void ff_index_save(ffst *ff, ffindex *idx, const char *cachefn, const struct stat *vsb) {
+  ffindex_hdr hdr;
+  const size_t pathlen = strlen(ff->current_file);
+  const char pad[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  char *tmpfn;
+  int fd, ok;
+
+  memset(&hdr, 0, sizeof(ffindex_hdr));
+  memcpy(hdr.magic, FFI_MAGIC, sizeof(FFI_MAGIC));
+  hdr.version = FFI_VERSION;
+  hdr.bom     = FFI_BOM;
+  hdr.fsize   = vsb->st_size;
+  hdr.mtime   = vsb->st_mtime;
+  hdr.frames  = idx->frames;
+  hdr.maxgop  = idx->maxgop;
+  hdr.nkeys   = idx->nkeys;
+  hdr.stream  = ff->videoStream;
+  hdr.pathlen = pathlen;
+
+  /* write to temp-file and rename: concurrent readers only ever see complete files */
+  tmpfn = malloc(strlen(cachefn) + 8);
+  sprintf(tmpfn, "%s.XXXXXX", cachefn);
+  if ((fd = mkstemp(tmpfn)) < 0) {
+    if (!want_quiet)
+      fprintf(stderr, "Cannot create keyframe index cache file in %s\n", cachefn);
+    free(tmpfn);
+    return;
+  }
+  ok =  write(fd, &hdr, sizeof(ffindex_hdr)) == sizeof(ffindex_hdr)
+     && write(fd, ff->current_file, pathlen) == pathlen
+     && write(fd, pad, FFI_PAD8(pathlen) - pathlen) == FFI_PAD8(pathlen) - pathlen
+     && write(fd, idx->keypts, idx->nkeys * sizeof(int64_t)) == idx->nkeys * sizeof(int64_t);
+  close(fd);
+  if (!ok || rename(tmpfn, cachefn)) {
+    if (!want_quiet)
+      fprintf(stderr, "Cannot write keyframe index cache file %s\n", cachefn);
+    unlink(tmpfn);
+  }
+  free(tmpfn);
+}
+#endif
+
+/* demux the complete file and collect keyframe timestamps */
+static ffindex *ff_index_scan(ffst *ff) {
+  ffindex *idx;
+  AVPacket packet;
+  size_t alloc = 256;
+  int64_t gop = 0;
+  int sorted = 1;
+
+  idx = (ffindex*) calloc(1, sizeof(ffindex));
+  idx->keypts = (int64_t*) malloc(alloc * sizeof(int64_t));
+  ff_mmap_advise(ff, 0);
+  av_init_packet(&packet);
+  packet.data = NULL;
+
+  while (av_read_frame(ff->pFormatCtx, &packet) >= 0) {
+    if (packet.stream_index == ff->videoStream) {
+      const int64_t ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+      idx->frames++;
+      if ((packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+        if (idx->nkeys == alloc) {
+          alloc *= 2;
+          idx->keypts = (int64_t*) realloc(idx->keypts, alloc * sizeof(int64_t));
+        }
+        if (idx->nkeys > 0 && ts <= idx->keypts[idx->nkeys - 1]) sorted = 0;
+        idx->keypts[idx->nkeys++] = ts;
+        if (gop > idx->maxgop) idx->maxgop = gop;
+        gop = 0;
+      }
+      gop++;
+    }
+    av_free_packet(&packet);
+  }
+  if (gop > idx->maxgop) idx->maxgop = gop;
+
+  ff_seek(ff, 0, AVSEEK_FLAG_BACKWARD);
+  avcodec_flush_buffers(ff->pCodecCtx);
+  ff->avprev = 0;
+
+  if (idx->nkeys == 0) {
+    if (!want_quiet)
+      fprintf(stderr, "No keyframes found in file %s\n", ff->current_file);
+    free(idx->keypts);
+    free(idx);
+    return NULL;
+  }
+  if (!sorted) {
+    qsort(idx->keypts, idx->nkeys, sizeof(int64_t), cmp_int64);
+  }
+  return idx;
+}
+
+/* get keyframe index for the currently open file.
+ * If cachedir is not NULL, a previously stored index is memory-mapped
+ * from there, otherwise the complete file is demuxed (and the result
+ * saved to cachedir).
+ * The decoder is rewound to the beginning of the file after a scan.
+ */
+void *ff_index_create(void *ptr, const char *cachedir) {
+  ffst *ff = (ffst*) ptr;
+  ffindex *idx = NULL;
+#ifndef WIN32
+  struct stat vsb;
+  char *cachefn = NULL;
+#endif
+
+  if (!ff->pFormatCtx || ff->videoStream < 0 || ff->seekflags != SEEK_CONTINUOUS)
+    return NULL;
+
+#ifndef WIN32
+  if (cachedir && !stat(ff->current_file, &vsb)) {
+    cachefn = ff_index_cachefile(cachedir, ff->current_file);
+    idx = ff_index_load(ff, cachefn, &vsb);
+    if (idx && want_verbose)
+      fprintf(stdout, "keyframe index: loaded from %s\n", cachefn);
+  }
+#endif
+
+  if (!idx) {
+    idx = ff_index_scan(ff);
+#ifndef WIN32
+    if (idx && cachefn)
+      ff_index_save(ff, idx, cachefn, &vsb);
+#endif
+  }
+#ifndef WIN32
+  free(cachefn);
+#endif
+  if (!idx) return NULL;
+
+  idx->keyframes = (int64_t*) malloc(idx->nkeys * sizeof(int64_t));
+  if (idx->keyframes) {
+    int64_t i;
+    for (i = 0; i < idx->nkeys; ++i) {
+      const int64_t f = ff_pts_to_frame(ff, idx->keypts[i]);
+      idx->keyframes[i] = f < 0 ? 0 : f;
+    }
+  }
+
+  pthread_mutex_init(&idx->lock, NULL);
+  idx->refcnt = 1;
+  if (want_verbose)
+    fprintf(stdout, "keyframe index: %"PRId64" frames, %"PRId64" keyframes, max GOP: %"PRId64"\n",
+        idx->frames, idx->nkeys, idx->maxgop);
+  return idx;
+}
+
+void *ff_index_ref(void *ptr) {
+  ffindex *idx = (ffindex*) ptr;
+  pthread_mutex_lock(&idx->lock);
+  idx->refcnt++;
+  pthread_mutex_unlock(&idx->lock);
+  return idx;
+}
+
+void ff_index_unref(void *ptr) {
+  ffindex *idx = (ffindex*) ptr;
+  int refcnt;
+  pthread_mutex_lock(&idx->lock);
+  refcnt = --idx->refcnt;
+  pthread_mutex_unlock(&idx->lock);
+  assert(refcnt >= 0);
+  if (refcnt > 0) return;
+  pthread_mutex_destroy(&idx->lock);
+#ifndef WIN32
+  if (idx->map)
+    munmap(idx->map, idx->maplen);
+  else
+#endif
+  free(idx->keypts);
+  free(idx->keyframes);
+  free(idx);
+}
+
+int64_t ff_index_keyframes(void *ptr) {
+  return ((ffindex*) ptr)->nkeys;
+}
+
+/* frame-number of the last keyframe at or before the given
+ * frame, -1 if it is not known */
+int64_t ff_index_keyframe_at(void *ptr, int64_t frame) {
+  ffindex *idx = (ffindex*) ptr;
+  int64_t lo = 0, hi;
+  if (!idx || !idx->keyframes || frame < 0) return -1;
+  hi = idx->nkeys;
+  while (lo < hi) {
+    const int64_t mid = lo + (hi - lo) / 2;
+    if (idx->keyframes[mid] <= frame) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo > 0 ? idx->keyframes[lo - 1] : -1;
+}
+
+void ff_set_index(void *ptr, void *idx) {
+  ffst *ff = (ffst*) ptr;
+  if (ff->index) ff_index_unref(ff->index);
+  ff->index = idx ? (ffindex*) ff_index_ref(idx) : NULL;
+  if (ff->index && ff->index->frames > 0)
+    ff->frames = ff->index->frames;
+}
+
+int ff_has_index(void *ptr) {
+  return ((ffst*) ptr)->index ? 1 : 0;
+}
+
+void *ff_probe_ref(void *ptr) {
+  ffprobe *pr = (ffprobe*) ptr;
+  pthread_mutex_lock(&pr->lock);
+  pr->refcnt++;
+  pthread_mutex_unlock(&pr->lock);
+  return pr;
+}
+
+void ff_probe_unref(void *ptr) {
+  ffprobe *pr = (ffprobe*) ptr;
+  int refcnt;
+  pthread_mutex_lock(&pr->lock);
+  refcnt = --pr->refcnt;
+  pthread_mutex_unlock(&pr->lock);
+  assert(refcnt >= 0);
+  if (refcnt > 0) return;
+  pthread_mutex_destroy(&pr->lock);
+  free(pr);
+}
+
+void *ff_get_probe(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  return ff->probe ? ff_probe_ref(ff->probe) : NULL;
+}
+
+void ff_set_probe(void *ptr, void *pr) {
+  ffst *ff = (ffst*) ptr;
+  if (ff->probe) ff_probe_unref(ff->probe);
+  ff->probe = pr ? (ffprobe*) ff_probe_ref(pr) : NULL;
+}
+
+void *ff_gopcache_create(size_t budget) {
+  ffgopcache *gc;
+  if (budget < 1) return NULL;
+  gc = (ffgopcache*) calloc(1, sizeof(ffgopcache));
+  if (!gc) return NULL;
+  pthread_mutex_init(&gc->lock, NULL);
+  gc->refcnt = 1;
+  gc->budget = budget;
+  lru_init(&gc->lru);
+  return gc;
+}
+
+void *ff_gopcache_ref(void *ptr) {
+  ffgopcache *gc = (ffgopcache*) ptr;
+  pthread_mutex_lock(&gc->lock);
+  gc->refcnt++;
+  pthread_mutex_unlock(&gc->lock);
+  return gc;
+}
+
+void ff_gopcache_unref(void *ptr) {
+  ffgopcache *gc = (ffgopcache*) ptr;
+  int refcnt;
+  pthread_mutex_lock(&gc->lock);
+  refcnt = --gc->refcnt;
+  pthread_mutex_unlock(&gc->lock);
+  assert(refcnt >= 0);
+  if (refcnt > 0) return;
+  while (lru_tail(&gc->lru)) {
+    ffgop *g = LRU_ENTRY(lru_tail(&gc->lru), ffgop, ln);
+    lru_unlink(&g->ln);
+    assert(g->users == 0);
+    ff_gop_free(g);
+  }
+  pthread_mutex_destroy(&gc->lock);
+  free(gc);
+}
+
+void ff_gopcache_stats(void *ptr, size_t *bytes, uint64_t *hits, uint64_t *misses) {
+  ffgopcache *gc = (ffgopcache*) ptr;
+  pthread_mutex_lock(&gc->lock);
+  *bytes = gc->used;
+  *hits = gc->hits;
+  *misses = gc->misses;
+  pthread_mutex_unlock(&gc->lock);
+}
+
+void ff_set_mmap(void *ptr, int enable) {
+  ((ffst*)ptr)->want_mmap = enable;
+}
+
+void ff_set_gopcache(void *ptr, void *gc) {
+  ffst *ff = (ffst*) ptr;
+  if (ff->gopcache) {
+    ff_gop_stop(ff);
+    ff_gopcache_unref(ff->gopcache);
+  }
+  ff->gopcache = gc ? (ffgopcache*) ff_gopcache_ref(gc) : NULL;
+}
+
 static void reset_video_head(ffst *ff, AVPacket *packet) {
   int frameFinished = 0;
   if (!want_quiet)
@@ -527,12 +1757,12 @@ static void reset_video_head(ffst *ff, AVPacket *packet) {
 #if LIBAVFORMAT_BUILD < 4617
   av_seek_frame(ff->pFormatCtx, ff->videoStream, 0);
 #else
-  av_seek_frame(ff->pFormatCtx, ff->videoStream, 0, AVSEEK_FLAG_BACKWARD);
+  ff_seek(ff, 0, AVSEEK_FLAG_BACKWARD);
 #endif
   avcodec_flush_buffers(ff->pCodecCtx);
 
   while (!frameFinished) {
-    av_read_frame(ff->pFormatCtx, packet);
+    ff_read_packet(ff, packet);
     if(packet->stream_index == ff->videoStream)
 #if LIBAVCODEC_VERSION_MAJOR < 52 || (LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR < 21)
     avcodec_decode_video(ff->pCodecCtx, ff->pFrame, &frameFinished, packet->data, packet->size);
@@ -544,6 +1774,219 @@ static void reset_video_head(ffst *ff, AVPacket *packet) {
   ff->avprev = 0;
 }
 
+/* vertical chroma subsampling (log2) of the planes 1 and 2
+ * for formats that can be split into bands, -1 otherwise.
+ * packed formats only use plane 0.
+ */
+static int ff_slice_vshift(int fmt) {
+  switch (fmt) {
+    case PIX_FMT_YUV420P:
+    case PIX_FMT_YUVJ420P:
+    case PIX_FMT_YUV440P:
+      return 1;
+    case PIX_FMT_YUV422P:
+    case PIX_FMT_YUVJ422P:
+    case PIX_FMT_YUV444P:
+    case PIX_FMT_YUVJ444P:
+    case PIX_FMT_YUYV422:
+    case PIX_FMT_UYVY422:
+    case PIX_FMT_RGB24:
+    case PIX_FMT_BGR24:
+    case PIX_FMT_RGBA:
+    case PIX_FMT_ARGB:
+    case PIX_FMT_BGRA:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+static void ff_slice_planes(uint8_t **out, uint8_t * const *in, const int *stride, int y, int vshift) {
+  int p;
+  for (p = 0; p < 4; ++p) {
+    out[p] = in[p] ? in[p] + (y >> (p == 1 || p == 2 ? vshift : 0)) * stride[p] : NULL;
+  }
+}
+
+/* convert large frames in horizontal bands using the scaler pool.
+ * This is only done if the height is not scaled, so that output
+ * rows correspond to source rows.
+ * @return 0 on success, -1 if the frame is not suitable.
+ */
+static int ff_scale_sliced(ffst *ff, AVPicture *dst) {
+  ffslice slices[MAX_SLICES];
+  ffscalepool *sp = ff->scalepool;
+  const int h = ff->out_height;
+  const int svs = ff_slice_vshift(ff->pCodecCtx->pix_fmt);
+  const int dvs = ff_slice_vshift(ff->render_fmt);
+  size_t need = 0;
+  int pending, n, bh, i, p;
+
+  if (!sp || sp->nworkers < 1
+      || h != ff->pCodecCtx->height
+      || ff->out_width * h < sp->min_pixels
+      || svs < 0 || dvs < 0)
+    return -1;
+
+  n = sp->nworkers + 1;
+  if (n > h / SLICE_ALIGN) n = h / SLICE_ALIGN;
+  if (n < 2) return -1;
+  bh = (h / n) & ~(SLICE_ALIGN - 1);
+
+  for (i = 0; i < n; ++i) {
+    ffslice *s = &slices[i];
+    const int y = i * bh;
+    const int y0 = y > SLICE_OVERLAP ? y - SLICE_OVERLAP : 0;
+    int y1;
+    s->rows = (i == n - 1) ? h - y : bh;
+    y1 = y + s->rows + SLICE_OVERLAP < h ? y + s->rows + SLICE_OVERLAP : h;
+    s->skip = y - y0;
+    s->h = y1 - y0;
+    s->vshift = dvs;
+    for (p = 0; p < 4 && dst->data[p]; ++p) {
+      const int vs = (p == 1 || p == 2) ? dvs : 0;
+      need += (size_t) ((s->h + (1 << vs) - 1) >> vs) * dst->linesize[p];
+    }
+  }
+
+  if (need > ff->slice_alloc) {
+    free(ff->slice_buf);
+    ff->slice_alloc = 0;
+    if (!(ff->slice_buf = malloc(need))) return -1;
+    ff->slice_alloc = need;
+  }
+
+  need = 0;
+  for (i = 0; i < n; ++i) {
+    ffslice *s = &slices[i];
+    const int y = i * bh;
+    ff->pSliceCtx[i] = sws_getCachedContext(ff->pSliceCtx[i],
+        ff->pCodecCtx->width, s->h, ff->pCodecCtx->pix_fmt,
+        ff->out_width, s->h, ff->render_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!ff->pSliceCtx[i]) return -1;
+    s->ctx = ff->pSliceCtx[i];
+    ff_slice_planes((uint8_t**) s->src, ff->pFrame->data, ff->pFrame->linesize, y - s->skip, svs);
+    s->srcStride = ff->pFrame->linesize;
+    ff_slice_planes(s->dst, dst->data, dst->linesize, y, dvs);
+    s->dstStride = dst->linesize;
+    memset(s->tmp, 0, sizeof(s->tmp));
+    for (p = 0; p < 4 && dst->data[p]; ++p) {
+      const int vs = (p == 1 || p == 2) ? dvs : 0;
+      s->tmp[p] = ff->slice_buf + need;
+      need += (size_t) ((s->h + (1 << vs) - 1) >> vs) * dst->linesize[p];
+    }
+    s->pending = &pending;
+  }
+
+  /* queue all but the first band, which is converted by this thread */
+  pthread_mutex_lock(&sp->lock);
+  pending = n - 1;
+  for (i = n - 1; i > 0; --i) {
+    slices[i].next = sp->queue;
+    sp->queue = &slices[i];
+  }
+  pthread_cond_broadcast(&sp->wake);
+  pthread_mutex_unlock(&sp->lock);
+
+  ff_slice_run(&slices[0]);
+
+  /* help out with queued bands until all of this frame's are done */
+  pthread_mutex_lock(&sp->lock);
+  while (pending > 0) {
+    ffslice *s = sp->queue;
+    if (!s) {
+      pthread_cond_wait(&sp->done, &sp->lock);
+      continue;
+    }
+    sp->queue = s->next;
+    pthread_mutex_unlock(&sp->lock);
+    ff_slice_run(s);
+    pthread_mutex_lock(&sp->lock);
+    --*s->pending;
+    pthread_cond_broadcast(&sp->done);
+  }
+  pthread_mutex_unlock(&sp->lock);
+  return 0;
+}
+
+/* Convert the decoded frame to the output format and size.
+ * If the decoder already produces the requested format at the
+ * requested size, the planes are copied directly (no swscale pass).
+ */
+static int ff_scale_frame(ffst *ff, AVPicture *dst) {
+  if (ff->pCodecCtx->pix_fmt == ff->render_fmt
+      && ff->pCodecCtx->width == ff->out_width
+      && ff->pCodecCtx->height == ff->out_height) {
+    av_picture_copy(dst, (const AVPicture*) ff->pFrame, ff->render_fmt, ff->out_width, ff->out_height);
+    return ff->out_height;
+  }
+  if (!ff->thumbnail && !ff_scale_sliced(ff, dst))
+    return ff->out_height;
+  ff->pSWSCtx = sws_getCachedContext(ff->pSWSCtx, ff->pCodecCtx->width, ff->pCodecCtx->height, ff->pCodecCtx->pix_fmt, ff->out_width, ff->out_height, ff->render_fmt, ff->thumbnail ? SWS_FAST_BILINEAR : SWS_BICUBIC, NULL, NULL, NULL);
+  if (!ff->pSWSCtx) return -1;
+  return sws_scale(ff->pSWSCtx, (const uint8_t * const*) ff->pFrame->data, ff->pFrame->linesize, 0, ff->pCodecCtx->height, dst->data, dst->linesize);
+}
+
+/* convert a packet timestamp to a frame-number (inverse of the
+ * conversion in my_seek_frame()), returns -1 if that is not possible.
+ */
+static int64_t ff_pts_to_frame(ffst *ff, int64_t pts) {
+#if LIBAVFORMAT_BUILD > 4629
+  AVStream *v_stream = ff->pFormatCtx->streams[ff->videoStream];
+  int64_t frame;
+  if (pts == AV_NOPTS_VALUE) return -1;
+  if (v_stream->avg_frame_rate.num == 0 || v_stream->avg_frame_rate.den == 0) return -1;
+
+  const AVRational spf = { v_stream->avg_frame_rate.den, v_stream->avg_frame_rate.num };
+  frame = av_rescale_q(pts, v_stream->time_base, spf);
+  if (ff->want_ignstart)
+    frame -= (int64_t) rint(ff->framerate*((double)ff->pFormatCtx->start_time / (double)AV_TIME_BASE));
+  return frame < 0 ? -1 : frame;
+#else
+  return -1;
+#endif
+}
+
+/* timestamp of the picture in pFrame. With frame reordering (B-frames)
+ * it differs from the one of the packet that was decoded last.
+ * returns AV_NOPTS_VALUE if the decoder does not report it.
+ */
+static int64_t ff_picture_pts(ffst *ff) {
+  int64_t pts = AV_NOPTS_VALUE;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(53, 0, 0)
+  pts = ff->pFrame->pkt_pts;
+#endif
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54, 0, 0)
+  if (pts == AV_NOPTS_VALUE)
+    pts = ff->pFrame->pkt_dts;
+#endif
+  return pts;
+}
+
+/* offer a frame that was decoded while reading forward to the
+ * frame-cache (see ff_set_harvest). pts is the packet's timestamp,
+ * it is only used if the picture's own is unknown and the codec
+ * does not reorder frames.
+ */
+static void ff_harvest(ffst *ff, int64_t pts) {
+  AVPicture pic;
+  uint8_t *buf;
+  int64_t frame;
+  const int64_t ppts = ff_picture_pts(ff);
+
+  if (ff->seekflags != SEEK_CONTINUOUS || ff->out_width < 1 || ff->out_height < 1) return;
+  if (ppts != AV_NOPTS_VALUE) {
+    pts = ppts;
+  } else if (ff->pCodecCtx->has_b_frames > 0) {
+    return;
+  }
+  if ((frame = ff_pts_to_frame(ff, pts)) < 0) return;
+
+  if (!(buf = ff->harvest_get(ff->harvest_arg, frame))) return;
+  avpicture_fill(&pic, buf, ff->render_fmt, ff->out_width, ff->out_height);
+  ff->harvest_done(ff->harvest_arg, frame, ff_scale_frame(ff, &pic) > 0);
+}
+
 // TODO: set this high (>1000) if transport stopped and to a low value (<100) if transport is running.
 #define MAX_CONT_FRAMES (1000)
 
@@ -572,12 +2015,23 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t timestamp) {
   rv= av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp / framerate * 1000000LL);
 #else
   if (ff->seekflags == SEEK_ANY) {
-    rv = av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp, AVSEEK_FLAG_ANY | AVSEEK_FLAG_BACKWARD) ;
+    rv = ff_seek(ff, timestamp, AVSEEK_FLAG_ANY | AVSEEK_FLAG_BACKWARD);
     avcodec_flush_buffers(ff->pCodecCtx);
   } else if (ff->seekflags == SEEK_KEY) {
-    rv = av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp, AVSEEK_FLAG_BACKWARD) ;
+    rv = ff_seek(ff, timestamp, AVSEEK_FLAG_BACKWARD);
     avcodec_flush_buffers(ff->pCodecCtx);
   } else if (ff->seekflags == SEEK_LIVESTREAM) {
+  } else if (ff->index) /* SEEK_CONTINUOUS w/ keyframe index */ {
+    const int64_t key = ff_index_keyframe(ff->index, timestamp);
+    /* read on only if there is no keyframe between the
+     * last decoded frame and the frame to seek to. */
+    if (ff->avprev >= timestamp || (key != AV_NOPTS_VALUE && key > ff->avprev)) {
+      if (key != AV_NOPTS_VALUE && !ff_gop_replay(ff, key))
+        rv = 0;
+      else
+        rv = ff_seek(ff, key != AV_NOPTS_VALUE ? key : timestamp, AVSEEK_FLAG_BACKWARD);
+      avcodec_flush_buffers(ff->pCodecCtx);
+    }
   } else /* SEEK_CONTINUOUS */ if (ff->avprev >= timestamp || ((ff->avprev + 32*ff->tpf) < timestamp)) {
     // NOTE: only seek if last-frame is less then 32 frames behind
     // else read continuously until we get there :D
@@ -588,7 +2042,7 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t timestamp) {
     // timestamp-my_avprev > threshold! - Oh well.
 
     // seek to keyframe *BEFORE* this frame
-    rv= av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp, AVSEEK_FLAG_BACKWARD) ;
+    rv = ff_seek(ff, timestamp, AVSEEK_FLAG_BACKWARD);
     avcodec_flush_buffers(ff->pCodecCtx);
   }
 #endif
@@ -598,7 +2052,7 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t timestamp) {
 
 read_frame:
   nolivelock++;
-  if(av_read_frame(ff->pFormatCtx, packet) < 0) {
+  if(ff_read_packet(ff, packet) < 0) {
     if (!want_quiet) {
       fprintf(stderr, "Reached movie end\n");
     }
@@ -661,14 +2115,21 @@ read_frame:
 
   /* skip to next frame */
 
+  /* no other frame refers to a non-reference frame before the target,
+   * thumbnails do not need its picture unless it is harvested. */
+  if (ff->thumbnail && !ff->harvest_get)
+    ff->pCodecCtx->skip_idct = AVDISCARD_NONREF;
+
 #if LIBAVCODEC_VERSION_MAJOR < 52 || ( LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR < 21)
   avcodec_decode_video(ff->pCodecCtx, ff->pFrame, &frameFinished, packet->data, packet->size);
 #else
   avcodec_decode_video2(ff->pCodecCtx, ff->pFrame, &frameFinished, packet);
 #endif
   av_free_packet(packet);
+  ff->pCodecCtx->skip_idct = AVDISCARD_DEFAULT;
   if (!frameFinished) goto read_frame;
-  if (nolivelock < MAX_CONT_FRAMES) goto read_frame;
+  if (ff->harvest_get) ff_harvest(ff, mtsb);
+  if (nolivelock < MAX_CONT_FRAMES + (ff->index ? ff->index->maxgop : 0)) goto read_frame;
   reset_video_head(ff, packet);
   return (0); // seek failed.
 }
@@ -695,7 +2156,26 @@ int ff_render(void *ptr, unsigned long frame,
     ff_init_moviebuffer(ff);
   }
 
+  if (ff->pFrameFMT && ff->pFormatCtx && ff_thumbnail_mode(ff)) {
+    render_empty_frame(ff, buf, w, h, xoff, ys);
+    return -1;
+  }
+
+  const int seekflags = ff->seekflags;
+  if (ff->seekmode != SEEKMODE_EXACT && seekflags == SEEK_CONTINUOUS)
+    ff->seekflags = SEEK_KEY;
+  ff->delivered = timestamp;
+
   if (ff->pFrameFMT && ff->pFormatCtx && my_seek_frame(ff, &ff->packet, timestamp)) {
+    if (ff->seekflags != seekflags) {
+      /* the first packet after the seek is the keyframe */
+      const int64_t pts = ff->packet.pts != AV_NOPTS_VALUE ? ff->packet.pts : ff->packet.dts;
+      const int64_t key = ff_pts_to_frame(ff, pts);
+      if (key >= 0) {
+        ff->delivered = key;
+        ff->avprev = pts;
+      }
+    }
     while (1) { /* Decode video frame */
       frameFinished = 0;
       if(ff->packet.stream_index == ff->videoStream)
@@ -705,13 +2185,12 @@ int ff_render(void *ptr, unsigned long frame,
 	avcodec_decode_video2(ff->pCodecCtx, ff->pFrame, &frameFinished, &ff->packet);
 #endif
       if(frameFinished) { /* Convert the image from its native format to FMT */
-	ff->pSWSCtx = sws_getCachedContext(ff->pSWSCtx, ff->pCodecCtx->width, ff->pCodecCtx->height, ff->pCodecCtx->pix_fmt, ff->out_width, ff->out_height, ff->render_fmt, SWS_BICUBIC, NULL, NULL, NULL);
-	sws_scale(ff->pSWSCtx, (const uint8_t * const*) ff->pFrame->data, ff->pFrame->linesize, 0, ff->pCodecCtx->height, ff->pFrameFMT->data, ff->pFrameFMT->linesize);
+	ff_scale_frame(ff, (AVPicture*) ff->pFrameFMT);
 	av_free_packet(&ff->packet);
 	break;
       } else  {
 	if(ff->packet.data) av_free_packet(&ff->packet);
-	if(av_read_frame(ff->pFormatCtx, &ff->packet) < 0) {
+	if(ff_read_packet(ff, &ff->packet) < 0) {
 	  if (!want_quiet) fprintf(stderr, "read error!\n");
 	  reset_video_head(ff, &ff->packet);
 	  render_empty_frame(ff, buf, w, h, xoff, ys);
@@ -729,6 +2208,7 @@ int ff_render(void *ptr, unsigned long frame,
   } else {
     if (ff->pFrameFMT && !want_quiet) fprintf( stderr, "frame seek unsucessful (frame: %lu).\n", frame);
   }
+  ff->seekflags = seekflags;
 
   if (!frameFinished) {
     render_empty_frame(ff, buf, w, h, xoff, ys);
@@ -767,6 +2247,100 @@ void ff_get_info_canonical(void *ptr, VInfo *i, int w, int h) {
   i->buffersize = ff_picture_bytesize(ff->render_fmt, i->out_width, i->out_height);
 }
 
+/* set number of codec threads.
+ * If the decoder is already open, the codec is re-opened.
+ */
+int ff_set_threads(void *ptr, int threads) {
+  ffst *ff = (ffst*) ptr;
+
+  if (threads < 1) threads = 1;
+  if (ff->threads == threads) return 0;
+  ff->threads = threads;
+  if (!ff->pFrameFMT) return 0; // not open, used by ff_open_movie()
+  return ff_reopen_codec(ff);
+}
+
+/* assign the decoder to output sizes up to w x h: decode thumbnail
+ * sizes at reduced resolution. The codec is re-opened if the setting
+ * changes. max_w, max_h: largest output size that can be rendered at
+ * this resolution (0: full resolution).
+ */
+int ff_set_lowres(void *ptr, int w, int h, int *max_w, int *max_h) {
+  ffst *ff = (ffst*) ptr;
+  int rv = 0;
+  if (ff->pFrameFMT && ff->pCodecCtx) {
+    rv = ff_change_lowres(ff, ff_lowres_for(ff, w, h));
+  }
+  *max_w = ff->lowres > 0 ? (ff->codec_width  >> ff->lowres) / 2 : 0;
+  *max_h = ff->lowres > 0 ? (ff->codec_height >> ff->lowres) / 2 : 0;
+  return rv;
+}
+
+/* set seek accuracy for subsequent ff_render() calls:
+ * SEEKMODE_EXACT or (SEEKMODE_KEY, SEEKMODE_NEAREST) keyframe.
+ * This only affects files that are seeked continuously.
+ */
+void ff_set_seekmode(void *ptr, int mode) {
+  ffst *ff = (ffst*) ptr;
+  ff->seekmode = mode;
+}
+
+/* frame-number of the last rendered frame, this differs from
+ * the requested frame if the decoder seeked to a keyframe.
+ */
+int64_t ff_get_frame(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  return ff->delivered;
+}
+
+int64_t ff_get_maxgop(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  return ff->index ? ff->index->maxgop : 0;
+}
+
+int64_t ff_get_keyframe(void *ptr, int64_t frame) {
+  ffst *ff = (ffst*) ptr;
+  return ff_index_keyframe_at(ff->index, frame);
+}
+
+/* decoded pictures held by the codec in addition to
+ * B-frame delay and frame-threads (reference frames) */
+#define FF_MEM_FRAMES 4
+
+/* estimate the memory used by an open decoder: decoded pictures,
+ * the output buffer and the GOP that is currently recorded.
+ */
+size_t ff_get_memsize(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  size_t bytes = sizeof(ffst);
+  if (ff->pCodecCtx) {
+    const int frames = FF_MEM_FRAMES + ff->pCodecCtx->has_b_frames + (ff->threads > 1 ? ff->threads : 0);
+    bytes += (size_t) frames * ff_picture_bytesize(ff->pCodecCtx->pix_fmt, ff->pCodecCtx->width, ff->pCodecCtx->height);
+  }
+  if (ff->internal_buffer)
+    bytes += ff_picture_bytesize(ff->render_fmt, ff->buf_width, ff->buf_height);
+  if (ff->gop_rec)
+    bytes += ff->gop_rec->bytes;
+  bytes += ff->slice_alloc;
+  return bytes;
+}
+
+/* set callbacks to pass on frames that are decoded while
+ * reading forward to the requested frame (NULL: disable).
+ * Frames are scaled to the current output geometry.
+ */
+void ff_set_harvest(void *ptr, harvest_get_fn get, harvest_done_fn done, void *arg) {
+  ffst *ff = (ffst*) ptr;
+  ff->harvest_get  = (get && done) ? get : NULL;
+  ff->harvest_done = done;
+  ff->harvest_arg  = arg;
+}
+
+int ff_get_threads(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  return ff->threads > 1 ? ff->threads : 1;
+}
+
 void ff_create(void **ff) {
   (*((ffst**)ff)) = (ffst*) calloc(1, sizeof(ffst));
   (*((ffst**)ff))->render_fmt = PIX_FMT_RGB24;
@@ -774,6 +2348,7 @@ void ff_create(void **ff) {
   (*((ffst**)ff))->want_ignstart = 0;
   (*((ffst**)ff))->want_genpts = 0;
   (*((ffst**)ff))->packet.data = NULL;
+  (*((ffst**)ff))->threads = 1;
 }
 
 void ff_destroy(void **ff) {
@@ -31,6 +31,40 @@ int ff_render(void *ptr, unsigned long frame,
 
 int ff_open_movie(void *ptr, char *file_name, int render_fmt);
 int ff_close_movie(void *ptr);
+int ff_set_threads(void *ptr, int threads);
+int ff_get_threads(void *ptr);
+int ff_set_lowres(void *ptr, int w, int h, int *max_w, int *max_h);
+void ff_set_seekmode(void *ptr, int mode);
+int64_t ff_get_frame(void *ptr);
+int64_t ff_get_maxgop(void *ptr);
+int64_t ff_get_keyframe(void *ptr, int64_t frame);
+size_t ff_get_memsize(void *ptr);
+void ff_set_harvest(void *ptr, harvest_get_fn get, harvest_done_fn done, void *arg);
+
+void *ff_scalepool_create(void);
+void ff_scalepool_destroy(void *sp);
+void ff_scalepool_set_threads(void *sp, int threads, int min_pixels);
+void ff_set_scalepool(void *ptr, void *sp);
+
+void *ff_index_create(void *ptr, const char *cachedir);
+void *ff_index_ref(void *idx);
+void ff_index_unref(void *idx);
+int64_t ff_index_keyframes(void *idx);
+int64_t ff_index_keyframe_at(void *idx, int64_t frame);
+void ff_set_index(void *ptr, void *idx);
+int ff_has_index(void *ptr);
+
+void *ff_probe_ref(void *pr);
+void ff_probe_unref(void *pr);
+void *ff_get_probe(void *ptr);
+void ff_set_probe(void *ptr, void *pr);
+
+void *ff_gopcache_create(size_t budget);
+void *ff_gopcache_ref(void *gc);
+void ff_gopcache_unref(void *gc);
+void ff_gopcache_stats(void *gc, size_t *bytes, uint64_t *hits, uint64_t *misses);
+void ff_set_gopcache(void *ptr, void *gc);
+void ff_set_mmap(void *ptr, int enable);
 
 void ff_initialize (void);
 void ff_cleanup (void);
@@ -28,6 +28,10 @@
 #include "frame_cache.h"
 #include "ffcompat.h"
 #include "ffdecoder.h"
+#include "waitq.h"
+#include "lrulist.h"
+#include "slab.h"
+#include "zframe_cache.h"
 
 #include <time.h>
 #include <assert.h>
@@ -39,9 +43,10 @@
 
 /* FLAGS */
 #define CLF_DECODING 1 //< decoder is active
-#define CLF_INUSE 2    //< currently being served
+#define CLF_INUSE 2    //< currently being served (status info only: refcnt > 0)
 #define CLF_VALID 4    //< cacheline is valid (has decoded frame)
 #define CLF_RELEASE 8  //<invalidate this cacheline once it's no longer in use
+#define CLF_HARVEST 16 //< decoded in passing, not requested yet
 
 typedef struct videocacheline {
   int id;         // file ID from VidMap
@@ -50,49 +55,236 @@ typedef struct videocacheline {
   int fmt;        // pixel format
   int64_t frame;
   int flags;
-  int refcnt;     // CLF_INUSE reference count
+  int refcnt;     // reference count, changed atomically
   time_t lru;     // east recently used time
   //int hitcount  //  -- unused; least-frequently used idea
   uint8_t *b;     //< data buffer pointer
   int alloc_size; //< allocated buffer size (status info)
+  int shard;      //< index of the shard that holds this line
+  int referenced; //< hit since the last replacement scan (second chance)
+  lru_node ln;    //< linked to the shard's lru or cold list unless decoding
   UT_hash_handle hh;
 } videocacheline;
 
 /* id +w +h + fmt + frame */
 #define CLKEYLEN (offsetof(videocacheline, flags) - offsetof(videocacheline, id))
 
-/* get a new cacheline or replace and existing one
- * NB. the cache needs to be write-locked when calling this
+///////////////////////////////////////////////////////////////////////////////
+// Cache Control
+
+#define FC_SHARDS 16      ///< max. number of shards
+#define FC_SHARD_LINES 16 ///< min. number of cachelines per shard
+
+/* a part of the cache, cachelines are assigned to a shard by hashing
+ * their key. Hits and releases only read-lock the shard and change
+ * the reference-count atomically. Misses, replacement and CLF_RELEASE
+ * require the write-lock. The line-count and memory budget apply
+ * to the cache as a whole.
+ */
+typedef struct {
+  videocacheline *vcache;
+  lru_list lru;      ///< valid cachelines, replaced least recently used first
+  lru_list cold;     ///< harvested or invalid cachelines, replaced before any in lru
+  pthread_rwlock_t lock;
+} fc_shard;
+
+typedef struct {
+  int cfg_cachesize;
+  int cfg_harvest; ///< max. frames to harvest per decode, 0: disabled
+  size_t cfg_budget; ///< max. bytes of frame buffers, 0: limited by cfg_cachesize only
+  int nshards;       ///< shards in use
+  fc_shard shard[FC_SHARDS];
+  size_t used;       ///< bytes of frame buffers of all shards, changed atomically
+  int lines;         ///< cachelines of all shards, changed atomically
+  void *slab;        ///< frame buffer allocator
+  void *ztier;       ///< compressed second tier for evicted frames
+  int cache_hits;
+  int cache_miss;
+  int cache_harvest;
+  int cache_reverse; ///< frames harvested during backward playback
+  int cache_coalesced; ///< requests that waited for a concurrent decode of the same frame
+  waitq wq;          ///< requests waiting for a cacheline to become available
+} xjcd;
+
+static int shard_count(int cachesize) {
+  const int n = cachesize / FC_SHARD_LINES;
+  return n < 1 ? 1 : (n > FC_SHARDS ? FC_SHARDS : n);
+}
+
+/* the shard that holds the given key */
+static fc_shard *cl_shard(xjcd *cc, const videocacheline *k) {
+  uint64_t h = ((uint64_t) k->id << 48) ^ ((uint64_t) (uint16_t) k->w << 32)
+    ^ ((uint64_t) (uint16_t) k->h << 16) ^ (uint64_t) k->fmt;
+  h = h * 0x9E3779B97F4A7C15ULL ^ (uint64_t) k->frame * 0xC2B2AE3D27D4EB4FULL;
+  return &cc->shard[(h >> 32) % cc->nshards];
+}
+
+/* lock two shards (in order) for moving a cacheline */
+static void shard_lock2(fc_shard *a, fc_shard *b) {
+  if (a > b) { fc_shard *t = a; a = b; b = t; }
+  pthread_rwlock_wrlock(&a->lock);
+  if (b != a) pthread_rwlock_wrlock(&b->lock);
+}
+
+static void shard_unlock2(fc_shard *a, fc_shard *b) {
+  if (b != a) pthread_rwlock_unlock(&b->lock);
+  pthread_rwlock_unlock(&a->lock);
+}
+
+/* a cacheline is no longer decoding: make it available
+ * for replacement. Frames that were harvested and not requested yet
+ * and invalid lines go to the cold list. Lines in use stay on
+ * the list, they are skipped until they are released.
+ * NB. the shard needs to be write-locked when calling this
+ */
+static void cl_idle(xjcd *cc, videocacheline *cl, int cold) {
+  fc_shard *sh = &cc->shard[cl->shard];
+  if (cold || !(cl->flags&CLF_VALID)) {
+    lru_push(&sh->cold, &cl->ln);
+  } else {
+    lru_push(&sh->lru, &cl->ln);
+  }
+}
+
+/* remove a cacheline from the hash of its shard and the totals
+ * NB. the shard needs to be write-locked when calling this
+ */
+static void cl_detach(xjcd *cc, fc_shard *sh, videocacheline *cl) {
+  HASH_DEL(sh->vcache, cl);
+  __sync_sub_and_fetch(&cc->used, (size_t) cl->alloc_size);
+  __sync_sub_and_fetch(&cc->lines, 1);
+}
+
+/* remove a cacheline from the cache and free it
+ * NB. the shard needs to be write-locked when calling this
+ */
+static void cl_free(xjcd *cc, videocacheline *cl) {
+  fc_shard *sh = &cc->shard[cl->shard];
+  lru_unlink(&cl->ln);
+  cl_detach(cc, sh, cl);
+  slab_free(cc->slab, cl->b, cl->alloc_size);
+  free(cl);
+}
+
+/* does a buffer of the given size exceed the memory budget?
+ * A frame larger than the whole budget is still allowed
+ * into an empty cache.
+ */
+static int over_budget(xjcd *cc, size_t need) {
+  const size_t used = __sync_add_and_fetch(&cc->used, 0);
+  return cc->cfg_budget > 0 && used + need > cc->cfg_budget && used > 0;
+}
+
+/* find a cacheline to replace: the least recently used one that is
+ * neither in use nor was hit since the last scan. Lines that were hit
+ * get a second chance at the head of the lru list, that is also how
+ * requested harvested frames leave the cold list.
+ * if cold is not zero, only cachelines of the cold list are replaced.
+ * NB. the shard needs to be write-locked when calling this
+ */
+static videocacheline *cl_victim(fc_shard *sh, int cold) {
+  int scan = 2 * (sh->lru.count + sh->cold.count) + 1;
+  while (scan-- > 0) {
+    videocacheline *cl;
+    lru_node *n = lru_tail(&sh->cold);
+    if (!n && !cold) n = lru_tail(&sh->lru);
+    if (!n) break;
+    cl = LRU_ENTRY(n, videocacheline, ln);
+    if (cl->refcnt > 0 || cl->referenced) {
+      cl->referenced = 0;
+      lru_push((cl->flags&CLF_VALID) ? &sh->lru : &sh->cold, n);
+      continue;
+    }
+    lru_unlink(n);
+    return cl;
+  }
+  return NULL;
+}
+
+/* find a cacheline to replace in the given shard or else in one of
+ * the others and detach it from its shard. Other shards are only
+ * searched if they are not locked, the limits are soft.
+ * NB. the given shard needs to be write-locked when calling this
+ */
+static videocacheline *cl_victim_any(xjcd *cc, fc_shard *sh, int cold) {
+  videocacheline *cl = cl_victim(sh, cold);
+  int s;
+  if (cl) {
+    cl_detach(cc, sh, cl);
+    return cl;
+  }
+  for (s = 1; s < cc->nshards && !cl; ++s) {
+    fc_shard *o = &cc->shard[(sh - cc->shard + s) % cc->nshards];
+    if (pthread_rwlock_trywrlock(&o->lock)) continue;
+    if ((cl = cl_victim(o, cold))) {
+      cl_detach(cc, o, cl);
+    }
+    pthread_rwlock_unlock(&o->lock);
+  }
+  return cl;
+}
+
+/* evict idle cachelines until the cache fits its memory budget */
+static void trimcache(xjcd *cc) {
+  int s;
+  for (s = 0; s < cc->nshards; ++s) {
+    fc_shard *sh = &cc->shard[s];
+    pthread_rwlock_wrlock(&sh->lock);
+    while (over_budget(cc, 0)) {
+      videocacheline *cl = cl_victim(sh, 0);
+      if (!cl) break;
+      cl_free(cc, cl);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+  }
+}
+
+/* frames that getcl() evicted, to be moved to the compressed
+ * tier by fc_demote() once the shard is unlocked */
+#define FC_EVICT_MAX 4
+
+typedef struct {
+  int n;
+  videocacheline *cl[FC_EVICT_MAX];
+} fc_evicted;
+
+/* get a new cacheline or replace existing ones: lines are evicted,
+ * from this shard first, until both the line-count and the memory
+ * budget of the cache allow for the new frame. The buffer of an evicted line of the same slab
+ * size-class is re-used as is, regardless of its geometry.
+ * if cold is not zero, only cachelines of the cold list
+ * (harvested, not requested) are replaced.
+ * if ev is not NULL, evicted valid frames that were requested are
+ * detached and collected in ev instead of being freed.
+ * NB. the shard needs to be write-locked when calling this
  * and realloccl_buf() must be called after this
  */
-static videocacheline *getcl(videocacheline **cache, int cfg_cachesize,
-    unsigned short id, short w, short h, int fmt, int64_t frame) {
+static videocacheline *getcl(xjcd *cc, fc_shard *sh,
+    unsigned short id, short w, short h, int fmt, int64_t frame, int cold, fc_evicted *ev) {
   videocacheline *cl = NULL;
-
-  if (HASH_COUNT(*cache) >= cfg_cachesize) {
-    time_t lru = time(NULL) + 1;
-    videocacheline *tmp, *clru = NULL;
-    HASH_ITER(hh, *cache, cl, tmp) {
-      if (cl->flags == 0) return cl;
-      if (!(cl->flags&(CLF_DECODING|CLF_INUSE)) && (cl->lru < lru))  {
-        lru = cl->lru;
-        clru = cl;
+  const int need = slab_size(ff_picture_bytesize(fmt, w, h));
+
+  while (__sync_add_and_fetch(&cc->lines, 0) >= cc->cfg_cachesize || over_budget(cc, need)) {
+    videocacheline *clru = cl_victim_any(cc, sh, cold);
+    if (!clru) {
+      if (cl) {
+        slab_free(cc->slab, cl->b, cl->alloc_size);
+        free(cl);
       }
+      if (!cold) dlog(DLOG_WARNING, "CACHE: cache full - all cache-lines in use.\n");
+      return NULL;
     }
-    if (clru) {
-      HASH_DEL(*cache, clru);
-      assert(clru->refcnt == 0);
+    assert(!(clru->flags&CLF_DECODING));
+    assert(clru->refcnt == 0);
+    if (ev && ev->n < FC_EVICT_MAX && (clru->flags&(CLF_VALID|CLF_HARVEST)) == CLF_VALID) {
+      ev->cl[ev->n++] = clru;
+    } else if (!cl && clru->b && clru->alloc_size == need) {
       cl = clru;
-      if (cl->b && cl->w == w && cl->h == h && cl->fmt == fmt) {
-        cl->flags = 0;
-        memset(&cl->hh, 0, sizeof(UT_hash_handle));
-      } else {
-        free(cl->b);
-        memset(cl, 0, sizeof(videocacheline));
-      }
+      cl->flags = 0;
+      memset(&cl->hh, 0, sizeof(UT_hash_handle));
     } else {
-      dlog(DLOG_WARNING, "CACHE: cache full - all cache-lines in use.\n");
-      return NULL;
+      slab_free(cc->slab, clru->b, clru->alloc_size);
+      free(clru);
     }
   }
 
@@ -105,19 +297,71 @@ static videocacheline *getcl(videocacheline **cache, int cfg_cachesize,
   cl->fmt = fmt;
   cl->frame = frame;
   cl->lru = 0;
-  HASH_ADD(hh, *cache, id, CLKEYLEN, cl);
+  cl->alloc_size = need;
+  cl->shard = sh - cc->shard;
+  cl->referenced = 0;
+  __sync_add_and_fetch(&cc->used, (size_t) need);
+  __sync_add_and_fetch(&cc->lines, 1);
+  HASH_ADD(hh, sh->vcache, id, CLKEYLEN, cl);
   return cl;
 }
 
-/* check if requested data exists in cache */
-static videocacheline *testclwh(videocacheline *cache,
-    pthread_rwlock_t *lock,
-    int64_t frame, short w, short h, int fmt, unsigned short id) {
+/* move evicted frames to the compressed tier,
+ * NB. this must be called without holding a lock */
+static void fc_demote(xjcd *cc, fc_evicted *ev) {
+  int i;
+  for (i = 0; i < ev->n; ++i) {
+    videocacheline *cl = ev->cl[i];
+    zcache_put(cc->ztier, cl->id, cl->frame, cl->w, cl->h, cl->fmt,
+        cl->b, ff_picture_bytesize(cl->fmt, cl->w, cl->h));
+    slab_free(cc->slab, cl->b, cl->alloc_size);
+    free(cl);
+  }
+  ev->n = 0;
+}
+
+/* check if requested data exists in cache and reference it.
+ * Only the shard's read-lock is taken: the reference-count is
+ * changed atomically and CLF_RELEASE is only set with the
+ * write-lock held.
+ */
+static videocacheline *fc_lookup(xjcd *cc, const videocacheline *cmp) {
+  fc_shard *sh = cl_shard(cc, cmp);
   videocacheline *rv;
-  const videocacheline cmp = {id, w, h, fmt, frame, 0, 0, 0, NULL };
-  pthread_rwlock_rdlock(lock);
-  HASH_FIND(hh, cache, &cmp, CLKEYLEN, rv);
-  pthread_rwlock_unlock(lock);
+  pthread_rwlock_rdlock(&sh->lock);
+  HASH_FIND(hh, sh->vcache, cmp, CLKEYLEN, rv);
+  if (rv && (rv->flags&(CLF_VALID|CLF_RELEASE)) == CLF_VALID) {
+    __sync_add_and_fetch(&rv->refcnt, 1);
+    rv->referenced = 1;
+    if (rv->flags&CLF_HARVEST) {
+      __sync_fetch_and_and(&rv->flags, ~CLF_HARVEST);
+    }
+  } else {
+    rv = NULL;
+  }
+  pthread_rwlock_unlock(&sh->lock);
+  if (rv) rv->lru = time(NULL);
+  return rv;
+}
+
+/* find a valid cached frame near the requested one
+ * (for SEEKMODE_NEAREST), earlier frames are preferred */
+#define NEAREST_WINDOW 12
+
+static videocacheline *fc_lookup_near(xjcd *cc, const videocacheline *k) {
+  videocacheline *rv = NULL;
+  videocacheline cmp = *k;
+  int d;
+  for (d = 1; d <= NEAREST_WINDOW && !rv; ++d) {
+    if (k->frame >= d) {
+      cmp.frame = k->frame - d;
+      rv = fc_lookup(cc, &cmp);
+    }
+    if (!rv) {
+      cmp.frame = k->frame + d;
+      rv = fc_lookup(cc, &cmp);
+    }
+  }
   return rv;
 }
 
@@ -126,115 +370,389 @@ static videocacheline *testclwh(videocacheline *cache,
  * if f==0 the cache is flushed objects in use are retained
  * time a cacheline is needed
  */
-static void clearcache(videocacheline **cache, pthread_rwlock_t *cachelock, int f, int id) {
-  videocacheline *tmp, *cl = NULL;
-  HASH_ITER(hh, *cache, cl, tmp) {
-    if (id >= 0 && cl->id != id) {
-      continue;
-    }
-    if (f) {
-      if (cl->flags & (CLF_DECODING|CLF_INUSE)) {
-        dlog(DLOG_WARNING, "CACHE: waiting for cacheline to be unlocked.\n");
+static void clearcache(xjcd *cc, int f, int id) {
+  int s;
+  for (s = 0; s < FC_SHARDS; ++s) {
+    fc_shard *sh = &cc->shard[s];
+    videocacheline *tmp, *cl = NULL;
+    pthread_rwlock_wrlock(&sh->lock);
+    HASH_ITER(hh, sh->vcache, cl, tmp) {
+      if (id >= 0 && cl->id != id) {
+        continue;
       }
-      while (cl->flags & (CLF_DECODING|CLF_INUSE)) {
-        pthread_rwlock_unlock(cachelock);
-        mymsleep(5);
-        pthread_rwlock_wrlock(cachelock);
+      if (f) {
+        if ((cl->flags & CLF_DECODING) || cl->refcnt > 0) {
+          dlog(DLOG_WARNING, "CACHE: waiting for cacheline to be unlocked.\n");
+        }
+        while ((cl->flags & CLF_DECODING) || cl->refcnt > 0) {
+          const unsigned int gen = wq_generation(&cc->wq);
+          pthread_rwlock_unlock(&sh->lock);
+          wq_wait_change(&cc->wq, gen, NULL);
+          pthread_rwlock_wrlock(&sh->lock);
+        }
       }
+      if ((cl->flags & CLF_DECODING) || cl->refcnt > 0) {
+        continue;
+      }
+      cl_free(cc, cl);
     }
-    if (cl->flags & (CLF_DECODING|CLF_INUSE)) {
-      continue;
-    }
-    HASH_DEL(*cache, cl);
-    assert(cl->refcnt == 0);
-    free(cl->b);
-    free(cl);
+    pthread_rwlock_unlock(&sh->lock);
   }
 }
 
-static void realloccl_buf(videocacheline *cptr, int w, int h, int fmt) {
-  if (cptr->b && cptr->w == w && cptr->h == h && cptr->fmt == fmt)
-    return; // already allocated
+/* allocate the buffer of a cacheline returned by getcl(),
+ * a re-used buffer is not cleared, the decoder overwrites it.
+ * returns -1 if out of memory.
+ */
+static int realloccl_buf(xjcd *cc, videocacheline *cptr) {
+  if (cptr->b)
+    return 0; // already allocated
 
-  free(cptr->b);
-  cptr->alloc_size = ff_picture_bytesize(fmt, w, h);
-  cptr->b = calloc(cptr->alloc_size, sizeof(uint8_t));
+  cptr->b = slab_alloc(cc->slab, cptr->alloc_size);
+  return cptr->b ? 0 : -1;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Cache Control
-
+/* state of a decode that harvests frames into the cache */
 typedef struct {
-  int cfg_cachesize;
-  videocacheline *vcache;
-  pthread_rwlock_t lock;
-  int cache_hits;
-  int cache_miss;
-} xjcd;
+  xjcd *cc;
+  unsigned short id;
+  short w;
+  short h;
+  int fmt;
+  int budget;          ///< remaining frames to harvest
+  int64_t frame;       ///< requested frame
+  DecoderHints *hints; ///< hints of the decode, dctrl sets hints->reverse
+  videocacheline *cl;  ///< cacheline currently being filled
+} fc_harvest;
 
 static void fc_initialize_cache (xjcd *cc) {
-  assert(!cc->vcache);
-  cc->vcache = NULL;
+  int s;
   cc->cache_hits = 0;
   cc->cache_miss = 0;
-  pthread_rwlock_init(&cc->lock, NULL);
+  cc->cache_harvest = 0;
+  cc->cache_reverse = 0;
+  cc->cache_coalesced = 0;
+  for (s = 0; s < FC_SHARDS; ++s) {
+    fc_shard *sh = &cc->shard[s];
+    assert(!sh->vcache);
+    sh->vcache = NULL;
+    lru_init(&sh->lru);
+    lru_init(&sh->cold);
+    pthread_rwlock_init(&sh->lock, NULL);
+  }
+  wq_init(&cc->wq);
 }
 
 static void fc_flush_cache (xjcd *cc) {
-  pthread_rwlock_wrlock(&cc->lock);
-  clearcache(&cc->vcache, &cc->lock, 1, -1);
+  clearcache(cc, 1, -1);
+  zcache_clear(cc->ztier, -1);
   cc->cache_hits = 0;
   cc->cache_miss = 0;
-  pthread_rwlock_unlock(&cc->lock);
+  cc->cache_harvest = 0;
+  cc->cache_reverse = 0;
+  cc->cache_coalesced = 0;
 }
 
-static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid, int *err) {
-  /* check if the requested frame is cached */
-  videocacheline *rv = testclwh(cc->vcache, &cc->lock, frame, w, h, fmt, vid);
+/* harvested frames only ever replace other harvested frames
+ * that have not been requested meanwhile, and they are
+ * the first to go (cold list) when the cache is full.
+ *
+ * During backward playback the frames between the keyframe and the
+ * requested frame are going to be requested next: up to half of the
+ * cache is filled with them in a single pass, replacing any LRU line.
+ */
+static uint8_t *fc_harvest_get(void *arg, int64_t frame) {
+  fc_harvest *hv = (fc_harvest*) arg;
+  xjcd *cc = hv->cc;
+  videocacheline *cl;
+  const videocacheline cmp = {hv->id, hv->w, hv->h, hv->fmt, frame, 0, 0, 0, NULL };
+  fc_shard *sh = cl_shard(cc, &cmp);
+  const int reverse = hv->hints->reverse;
+
+  if (reverse) {
+    int64_t window = cc->cfg_cachesize / 2;
+    if (cc->cfg_budget > 0) {
+      const int64_t fit = cc->cfg_budget / 2 / slab_size(ff_picture_bytesize(hv->fmt, hv->w, hv->h));
+      if (fit < window) window = fit;
+    }
+    if (frame >= hv->frame || frame < hv->frame - window) return NULL;
+  } else if (hv->budget <= 0) {
+    return NULL;
+  }
+  assert(!hv->cl);
+
+  pthread_rwlock_wrlock(&sh->lock);
+  HASH_FIND(hh, sh->vcache, &cmp, CLKEYLEN, cl);
+  if (cl) {
+    pthread_rwlock_unlock(&sh->lock);
+    return NULL;
+  }
+  cl = getcl(cc, sh, hv->id, hv->w, hv->h, hv->fmt, frame, !reverse, NULL);
+  if (cl) {
+    cl->flags |= CLF_DECODING;
+  }
+  pthread_rwlock_unlock(&sh->lock);
+
+  if (cl && realloccl_buf(cc, cl)) {
+    pthread_rwlock_wrlock(&sh->lock);
+    cl_free(cc, cl);
+    pthread_rwlock_unlock(&sh->lock);
+    cl = NULL;
+  }
+  if (!cl) {
+    hv->budget = 0;
+    return NULL;
+  }
+  hv->budget--;
+  hv->cl = cl;
+  return cl->b;
+}
+
+static void fc_harvest_done(void *arg, int64_t frame, int ok) {
+  fc_harvest *hv = (fc_harvest*) arg;
+  xjcd *cc = hv->cc;
+  videocacheline *cl = hv->cl;
+  fc_shard *sh;
+
+  assert(cl && cl->frame == frame);
+  sh = &cc->shard[cl->shard];
+  pthread_rwlock_wrlock(&sh->lock);
+  if (ok) {
+    cl->flags = CLF_VALID|CLF_HARVEST;
+    cl->lru = time(NULL);
+    if (hv->hints->reverse) {
+      __sync_add_and_fetch(&cc->cache_reverse, 1);
+    }
+    cl_idle(cc, cl, !hv->hints->reverse);
+    __sync_add_and_fetch(&cc->cache_harvest, 1);
+  } else {
+    cl_free(cc, cl);
+  }
+  pthread_rwlock_unlock(&sh->lock);
+  wq_notify(&cc->wq);
+  hv->cl = NULL;
+}
+
+/* a decode completed: mark the cacheline valid and referenced.
+ * If a keyframe was decoded instead of the requested frame, the
+ * cacheline is filed under the frame-number that it actually holds,
+ * which may move it to another shard.
+ */
+static videocacheline *fc_complete(xjcd *cc, videocacheline *cl, int64_t frame) {
+  videocacheline *cx = NULL;
+  const videocacheline cmp = {cl->id, cl->w, cl->h, cl->fmt, frame, 0, 0, 0, NULL };
+  fc_shard *sa = &cc->shard[cl->shard];
+  fc_shard *sb = cl_shard(cc, &cmp);
+
+  shard_lock2(sa, sb);
+  cl->flags |= CLF_VALID;
+  cl->flags &= ~CLF_DECODING;
+  cl->refcnt = 1;
+  if (cl->frame == frame) {
+    cl_idle(cc, cl, 0);
+    shard_unlock2(sa, sb);
+    return cl;
+  }
+
+  HASH_FIND(hh, sb->vcache, &cmp, CLKEYLEN, cx);
+  if (!cx) {
+    HASH_DEL(sa->vcache, cl);
+    cl->frame = frame;
+    cl->shard = sb - cc->shard;
+    HASH_ADD(hh, sb->vcache, id, CLKEYLEN, cl);
+    cl_idle(cc, cl, 0);
+  } else if ((cx->flags&(CLF_VALID|CLF_RELEASE)) == CLF_VALID) {
+    /* already cached, use that and drop the new one */
+    cl->refcnt = 0;
+    cl_free(cc, cl);
+    __sync_add_and_fetch(&cx->refcnt, 1);
+    cx->referenced = 1;
+    cx->flags &= ~CLF_HARVEST;
+    cl = cx;
+  } else {
+    /* being decoded concurrently: changing the key makes the
+     * cacheline unreachable for lookups, it is freed on release */
+    cl->frame = frame;
+    cl->flags &= ~CLF_VALID;
+    cl->flags |= CLF_RELEASE;
+  }
+  shard_unlock2(sa, sb);
+  return cl;
+}
+
+/* max. time to wait for a frame that another request is decoding */
+#define INFLIGHT_WAIT_MS 2000
+
+/* single-flight: if another request is decoding the very same frame
+ * wait for it and return its (referenced) cacheline.
+ * returns NULL if the frame is not being decoded or decoding failed.
+ */
+static videocacheline *fc_wait_inflight(xjcd *cc, const videocacheline *cmp) {
+  fc_shard *sh = cl_shard(cc, cmp);
+  struct timespec deadline;
+  videocacheline *cl;
+  int waited = 0;
+
+  while (1) {
+    /* query the generation first, not to miss a wakeup */
+    const unsigned int gen = wq_generation(&cc->wq);
+    int flags = 0;
+    if ((cl = fc_lookup(cc, cmp))) {
+      if (waited) __sync_add_and_fetch(&cc->cache_coalesced, 1);
+      __sync_add_and_fetch(&cc->cache_hits, 1);
+      return cl;
+    }
+    pthread_rwlock_rdlock(&sh->lock);
+    HASH_FIND(hh, sh->vcache, cmp, CLKEYLEN, cl);
+    if (cl) flags = cl->flags;
+    pthread_rwlock_unlock(&sh->lock);
+    if ((flags&(CLF_VALID|CLF_RELEASE)) == CLF_VALID) {
+      continue; // completed meanwhile
+    }
+    if (!(flags&CLF_DECODING)) {
+      return NULL;
+    }
+    if (!waited) {
+      wq_deadline(&deadline, INFLIGHT_WAIT_MS);
+      waited = 1;
+    }
+    if (wq_wait_change(&cc->wq, gen, &deadline)) {
+      return NULL;
+    }
+  }
+}
+
+static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid, DecoderHints *dh, int *err) {
+  const videocacheline cmp = {vid, w, h, fmt, frame, 0, 0, 0, NULL };
+  fc_shard *sh = cl_shard(cc, &cmp);
+  videocacheline *rv;
+  DecoderHints hints;
+  fc_harvest hv;
+  fc_evicted ev;
+  fc_evicted *evp = zcache_enabled(cc->ztier) ? &ev : NULL;
+  int64_t ticket = 0;
   int ds;
   if (err) *err = 0;
+  ev.n = 0;
+
+  /* check if the requested frame is cached */
+  rv = fc_lookup(cc, &cmp);
+  if (!rv && dh && dh->seekmode == SEEKMODE_NEAREST) {
+    rv = fc_lookup_near(cc, &cmp);
+  }
   if (rv) {
-    pthread_rwlock_wrlock(&cc->lock); // rdlock should suffice here
-    /* check if it has been recently invalidated by another thread */
-    if (rv->flags&CLF_VALID) {
-      rv->refcnt++;
-      rv->flags |= CLF_INUSE;
-      pthread_rwlock_unlock(&cc->lock);
-      rv->lru = time(NULL);
-      cc->cache_hits++;
-      return(rv);
-    }
-    pthread_rwlock_unlock(&cc->lock);
-    rv = NULL;
+    __sync_add_and_fetch(&cc->cache_hits, 1);
+    return(rv);
+  }
+
+  if ((rv = fc_wait_inflight(cc, &cmp))) {
+    return(rv);
+  }
+
+  /* reject right away if the decoders are overloaded,
+   * unless the frame can be restored from the compressed tier */
+  if (!zcache_has(cc->ztier, vid, frame, w, h, fmt)
+      && dctrl_admit(dc, vid, 1, &ticket, dh ? &dh->retry_after : NULL)) {
+    if (err) *err = 503;
+    return NULL;
   }
 
   /* too bad, now we need to allocate a new or free an used
    * cacheline and then decode the video... */
-  int timeout = 250; /* 1 second to get a buffer */
-  do {
-    pthread_rwlock_wrlock(&cc->lock);
-    rv = getcl(&cc->vcache, cc->cfg_cachesize, vid, w, h, fmt, frame);
+  if (!wq_busy(&cc->wq)) {
+    pthread_rwlock_wrlock(&sh->lock);
+    rv = getcl(cc, sh, vid, w, h, fmt, frame, 0, evp);
     if (rv) {
       rv->flags |= CLF_DECODING;
     }
-    pthread_rwlock_unlock(&cc->lock);
-    if (!rv) {
-      mymsleep(5);
+    pthread_rwlock_unlock(&sh->lock);
+    fc_demote(cc, &ev);
+  }
+
+  if (!rv) {
+    /* queue up until a cacheline is released, 1 second to get a buffer */
+    struct timespec deadline;
+    wq_waiter wt;
+    wq_deadline(&deadline, 1000);
+    wq_join(&cc->wq, &wt);
+    while (!wq_wait(&cc->wq, &wt, &deadline)) {
+      pthread_rwlock_wrlock(&sh->lock);
+      rv = getcl(cc, sh, vid, w, h, fmt, frame, 0, evp);
+      if (rv) {
+        rv->flags |= CLF_DECODING;
+      }
+      pthread_rwlock_unlock(&sh->lock);
+      fc_demote(cc, &ev);
+      if (rv) break;
+      wq_pass(&cc->wq, &wt);
     }
-  } while(--timeout > 0 && !rv);
+    wq_leave(&cc->wq, &wt);
+  }
 
   if (!rv) {
     dlog(DLOG_WARNING, "CACHE: no buffer available.\n");
+    dctrl_admit_done(dc, vid, ticket);
     /* no buffer available */
     if (err) *err = 503;
     return NULL;
   }
 
-  /* set w,h,fmt and re-alloc buffer if neccesary */
-  realloccl_buf(rv, w, h, fmt);
+  /* allocate the buffer if the cacheline is new */
+  if (realloccl_buf(cc, rv)) {
+    pthread_rwlock_wrlock(&sh->lock);
+    cl_free(cc, rv);
+    pthread_rwlock_unlock(&sh->lock);
+    wq_notify(&cc->wq);
+    dctrl_admit_done(dc, vid, ticket);
+    if (err) *err = 503;
+    return NULL;
+  }
+
+  /* restore the frame from the compressed tier, if it is there */
+  if (!zcache_take(cc->ztier, vid, frame, w, h, fmt, rv->b, ff_picture_bytesize(fmt, w, h))) {
+    dctrl_admit_done(dc, vid, ticket);
+    rv->lru = time(NULL);
+    rv = fc_complete(cc, rv, frame);
+    wq_notify(&cc->wq);
+    __sync_add_and_fetch(&cc->cache_miss, 1);
+    return(rv);
+  }
+
+  /* the compressed frame was taken meanwhile (or failed to restore),
+   * the decode that follows needs to be admitted after all */
+  if (ticket == 0 && dctrl_admit(dc, vid, 1, &ticket, dh ? &dh->retry_after : NULL)) {
+    pthread_rwlock_wrlock(&sh->lock);
+    cl_free(cc, rv);
+    pthread_rwlock_unlock(&sh->lock);
+    wq_notify(&cc->wq);
+    if (err) *err = 503;
+    return NULL;
+  }
+
+  if (dh) {
+    memcpy(&hints, dh, sizeof(DecoderHints));
+  } else {
+    memset(&hints, 0, sizeof(DecoderHints));
+  }
+  hints.frame = frame;
+  hints.reverse = 0;
+  hv.cc = cc;
+  hv.id = vid;
+  hv.w = w;
+  hv.h = h;
+  hv.fmt = fmt;
+  hv.budget = cc->cfg_harvest;
+  hv.frame = frame;
+  hv.hints = &hints;
+  hv.cl = NULL;
+  hints.harvest_get  = fc_harvest_get;
+  hints.harvest_done = fc_harvest_done;
+  hints.harvest_arg  = &hv;
 
   /* fill cacheline with data - decode video */
-  if ((ds=dctrl_decode(dc, vid, frame, rv->b, w, h, fmt))) {
+  ds = dctrl_decode(dc, vid, frame, rv->b, w, h, fmt, &hints);
+  dctrl_admit_done(dc, vid, ticket);
+  if (ds) {
     dlog(DLOG_WARNING, "CACHE: decode failed (%d).\n",ds);
     /* ds == -1 -> decode error; black frame will be rendered
      * ds == 503 -> no decoder avail.
@@ -242,29 +760,27 @@ static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, sho
      * (should not happen here - dctrl_get_info sorts that out)
      */
     if(err) *err = ds;
-    pthread_rwlock_wrlock(&cc->lock); // rdlock should suffice here
+    pthread_rwlock_wrlock(&sh->lock);
     /* we don't cache decode-errors */
     rv->flags &= ~CLF_VALID;
     rv->flags &= ~CLF_DECODING;
+    cl_idle(cc, rv, 1);
     if (ds > 0) {
       /* no decoder available */
       rv = NULL;
     } else {
       /* decoder available but decoding failed (EOF, invalid geometry...)*/
-      rv->flags |= CLF_INUSE;
-      rv->refcnt++;
+      rv->refcnt = 1;
     }
-    pthread_rwlock_unlock(&cc->lock);
+    pthread_rwlock_unlock(&sh->lock);
+    wq_notify(&cc->wq);
     return (rv);
   }
 
   rv->lru = time(NULL);
-  pthread_rwlock_wrlock(&cc->lock); // rdlock should suffice here
-  rv->flags |= CLF_VALID|CLF_INUSE;
-  rv->flags &= ~CLF_DECODING;
-  rv->refcnt++;
-  pthread_rwlock_unlock(&cc->lock);
-  cc->cache_miss++;
+  rv = fc_complete(cc, rv, hints.frame);
+  wq_notify(&cc->wq); // wake up requests waiting for this frame
+  __sync_add_and_fetch(&cc->cache_miss, 1);
   return(rv);
 }
 
@@ -273,72 +789,128 @@ static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, sho
 
 void vcache_clear (void *p, int id) {
   xjcd *cc = (xjcd*) p;
-  pthread_rwlock_wrlock(&cc->lock);
-  clearcache(&cc->vcache, &cc->lock, 0, id);
+  clearcache(cc, 0, id);
+  zcache_clear(cc->ztier, id);
   cc->cache_hits = 0;
   cc->cache_miss = 0;
-  pthread_rwlock_unlock(&cc->lock);
+  cc->cache_harvest = 0;
+  cc->cache_reverse = 0;
+  cc->cache_coalesced = 0;
 }
 
 void vcache_create(void **p) {
   (*((xjcd**)p)) = (xjcd*) calloc(1, sizeof(xjcd));
   (*((xjcd**)p))->cfg_cachesize = 48;
+  (*((xjcd**)p))->nshards = shard_count(48);
+  slab_create(&(*((xjcd**)p))->slab);
+  zcache_create(&(*((xjcd**)p))->ztier);
   fc_initialize_cache((*((xjcd**)p)));
 }
 
+/* NB. changing the number of shards re-distributes cachelines:
+ * the cache is flushed, this is meant to be called before serving
+ * any requests.
+ */
 void vcache_resize(void **p, int size) {
-  if (size < (*((xjcd**)p))->cfg_cachesize)
-    fc_flush_cache((*((xjcd**)p)));
-  if (size > 0)
-    (*((xjcd**)p))->cfg_cachesize = size;
+  xjcd *cc = *(xjcd**) p;
+  if (size < cc->cfg_cachesize || (size > 0 && shard_count(size) != cc->nshards))
+    fc_flush_cache(cc);
+  if (size > 0) {
+    cc->cfg_cachesize = size;
+    cc->nshards = shard_count(size);
+  }
+}
+
+void vcache_set_harvest(void *p, int max_frames) {
+  ((xjcd*)p)->cfg_harvest = max_frames > 0 ? max_frames : 0;
+}
+
+void vcache_set_budget(void *p, size_t bytes) {
+  xjcd *cc = (xjcd*) p;
+  cc->cfg_budget = bytes;
+  trimcache(cc);
+}
+
+int vcache_set_compressed(void *p, size_t bytes) {
+  return zcache_set_budget(((xjcd*)p)->ztier, bytes);
+}
+
+void vcache_set_hugepages(void *p, int enable) {
+  slab_set_hugepages(((xjcd*)p)->slab, enable);
 }
 
 void vcache_destroy(void **p) {
   xjcd *cc = *(xjcd**) p;
+  int s;
   fc_flush_cache(cc);
-  pthread_rwlock_destroy(&cc->lock);
-  free(cc->vcache);
+  zcache_destroy(&cc->ztier);
+  slab_destroy(&cc->slab);
+  for (s = 0; s < FC_SHARDS; ++s) {
+    pthread_rwlock_destroy(&cc->shard[s].lock);
+  }
+  wq_destroy(&cc->wq);
   free(cc);
   *p = NULL;
 }
 
-uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, void **cptr, int *err) {
-  videocacheline *cl = fc_readcl((xjcd*)p, dc, frame, w, h, fmt, id, err);
+uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, DecoderHints *dh, void **cptr, int *err) {
+  videocacheline *cl;
+  if (dh && dh->seekmode == SEEKMODE_KEY) {
+    /* the decoder delivers the keyframe, which is cached under its own number */
+    const int64_t kf = dctrl_get_keyframe(dc, id, frame);
+    if (kf >= 0) frame = kf;
+  }
+  cl = fc_readcl((xjcd*)p, dc, frame, w, h, fmt, id, dh, err);
   if (!cl) {
     if (cptr) *cptr = NULL;
     return NULL;
   }
   if (cptr) *cptr = cl;
+  if (dh) dh->frame = cl->frame;
   return cl->b;
 }
 
+/* the last reference is dropped with the read-lock only, unless the
+ * cacheline is to be freed: CLF_RELEASE is set with the write-lock held
+ * by a thread that references the line. From then on all references
+ * are dropped with the write-lock, the last one frees it.
+ */
 void vcache_release_buffer(void *p, void *cptr) {
   xjcd *cc = (xjcd*) p;
   videocacheline *cl = (videocacheline *)cptr;
+  fc_shard *sh;
+  int refcnt;
   if (!cptr) return;
-  pthread_rwlock_wrlock(&cc->lock);
-  if (--cl->refcnt < 1) {
-    assert(cl->refcnt >= 0);
-    cl->flags &= ~CLF_INUSE;
-
-    if (cl->flags & CLF_RELEASE) {
-      HASH_DEL(cc->vcache, cl);
-      assert(cl->refcnt == 0);
-      free(cl->b);
-      free(cl);
-    }
+  sh = &cc->shard[cl->shard];
+  pthread_rwlock_rdlock(&sh->lock);
+  if (!(cl->flags & CLF_RELEASE)) {
+    refcnt = __sync_sub_and_fetch(&cl->refcnt, 1);
+    pthread_rwlock_unlock(&sh->lock);
+    assert(refcnt >= 0);
+    if (refcnt == 0) wq_notify(&cc->wq);
+    return;
+  }
+  pthread_rwlock_unlock(&sh->lock);
+
+  pthread_rwlock_wrlock(&sh->lock);
+  refcnt = __sync_sub_and_fetch(&cl->refcnt, 1);
+  assert(refcnt >= 0);
+  if (refcnt == 0) {
+    cl_free(cc, cl);
   }
-  // TODO delete cacheline IFF !CLF_VALID (decode failed) ?!
-  pthread_rwlock_unlock(&cc->lock);
+  pthread_rwlock_unlock(&sh->lock);
+  if (refcnt == 0) wq_notify(&cc->wq);
 }
 
 void vcache_invalidate_buffer(void *p, void *cptr) {
   xjcd *cc = (xjcd*) p;
   videocacheline *cl = (videocacheline *)cptr;
+  fc_shard *sh;
   if (!cptr) return;
-  pthread_rwlock_wrlock(&cc->lock);
+  sh = &cc->shard[cl->shard];
+  pthread_rwlock_wrlock(&sh->lock);
   cl->flags |= CLF_RELEASE;
-  pthread_rwlock_unlock(&cc->lock);
+  pthread_rwlock_unlock(&sh->lock);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -369,37 +941,53 @@ static char *flags2txt(int f) {
     rv = (char*) realloc(rv, (off+8) * sizeof(char));
     off += sprintf(rv+off, "to-free ");
   }
+  if (f&CLF_HARVEST) {
+    rv = (char*) realloc(rv, (off+10) * sizeof(char));
+    off += sprintf(rv+off, "harvest ");
+  }
   return rv;
 }
 
 void vcache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
+  xjcd *cc = (xjcd*) p;
   int i = 1;
+  int n;
+  const size_t used = cc->used;
   videocacheline *cptr, *tmp;
   uint64_t total_bytes = 0;
   char bsize[32];
+  size_t slab_mapped;
+  int slab_arenas, slab_huge;
+  int z_frames, z_hits;
+  size_t z_bytes, z_raw, z_budget;
 
   if (tbl&1) {
     rprintf("<h3>Raw Video Frame Cache:</h3>\n");
-    rprintf("<p>max available: %i\n", ((xjcd*)p)->cfg_cachesize);
-    rprintf("cache-hits: %d, cache-misses: %d</p>\n", ((xjcd*)p)->cache_hits, ((xjcd*)p)->cache_miss);
+    rprintf("<p>max available: %i in %d shard%s, memory: %luMB/%luMB\n", cc->cfg_cachesize, cc->nshards, cc->nshards == 1 ? "" : "s",
+        (unsigned long) (used >> 20), (unsigned long) (cc->cfg_budget >> 20));
+    rprintf("cache-hits: %d, cache-misses: %d, harvested: %d (reverse: %d), coalesced: %d</p>\n", cc->cache_hits, cc->cache_miss, cc->cache_harvest, cc->cache_reverse, cc->cache_coalesced);
     rprintf("<table style=\"text-align:center;width:100%%\">\n");
   } else {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>Raw Video Frame Cache:</h3></td></tr>\n");
-    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d\n", ((xjcd*)p)->cfg_cachesize);
-    rprintf(", cache-hits: %d, cache-misses: %d</td></tr>\n", ((xjcd*)p)->cache_hits, ((xjcd*)p)->cache_miss);
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d in %d shard%s, memory: %luMB/%luMB\n", cc->cfg_cachesize, cc->nshards, cc->nshards == 1 ? "" : "s",
+        (unsigned long) (used >> 20), (unsigned long) (cc->cfg_budget >> 20));
+    rprintf(", cache-hits: %d, cache-misses: %d, harvested: %d (reverse: %d), coalesced: %d</td></tr>\n", cc->cache_hits, cc->cache_miss, cc->cache_harvest, cc->cache_reverse, cc->cache_coalesced);
   }
   rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Allocated Bytes</th><th>Geometry</th><th>Buffer</th><th>Frame#</th><th>LRU</th></tr>\n");
-  /* walk comlete tree */
-  pthread_rwlock_rdlock(&((xjcd*)p)->lock);
-  HASH_ITER(hh, ((xjcd*)p)->vcache, cptr, tmp) {
-    char *tmp = flags2txt(cptr->flags);
-    rprintf(
-        "<tr><td>%d.</td><td>%d</td><td>%s</td><td>%d bytes</td><td>%dx%d</td><td>%s</td><td>%"PRId64"</td><td>%"PRIlld"</td></tr>\n",
-        i, cptr->id, tmp, cptr->alloc_size, cptr->w, cptr->h,
-        (cptr->b ? ff_fmt_to_text(cptr->fmt) : "null"), cptr->frame, (long long) cptr->lru);
-    free(tmp);
-    total_bytes += cptr->alloc_size;
-    i++;
+  /* walk comlete tree of every shard */
+  for (n = 0; n < cc->nshards; ++n) {
+    pthread_rwlock_rdlock(&cc->shard[n].lock);
+    HASH_ITER(hh, cc->shard[n].vcache, cptr, tmp) {
+      char *tmp = flags2txt(cptr->flags | (cptr->refcnt > 0 ? CLF_INUSE : 0));
+      rprintf(
+          "<tr><td>%d.</td><td>%d</td><td>%s</td><td>%d bytes</td><td>%dx%d</td><td>%s</td><td>%"PRId64"</td><td>%"PRIlld"</td></tr>\n",
+          i, cptr->id, tmp, cptr->alloc_size, cptr->w, cptr->h,
+          (cptr->b ? ff_fmt_to_text(cptr->fmt) : "null"), cptr->frame, (long long) cptr->lru);
+      free(tmp);
+      total_bytes += cptr->alloc_size;
+      i++;
+    }
+    pthread_rwlock_unlock(&cc->shard[n].lock);
   }
 
   if ((tbl&1) == 0) {
@@ -418,8 +1006,14 @@ void vcache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
     sprintf(bsize, "%.2f %s", total_bytes / 1073741824.0, "Gi");
   }
 
-  rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB in memory</td></tr>\n", bsize);
-  pthread_rwlock_unlock(&((xjcd*)p)->lock);
+  slab_stats(cc->slab, &slab_mapped, NULL, &slab_arenas, &slab_huge);
+  zcache_stats(cc->ztier, &z_frames, &z_bytes, &z_raw, &z_budget, &z_hits);
+  rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB in memory, %luMB mapped in %d slab%s (huge pages: %d)</td></tr>\n",
+      bsize, (unsigned long) (slab_mapped >> 20), slab_arenas, slab_arenas == 1 ? "" : "s", slab_huge);
+  if (z_budget > 0) {
+    rprintf("<tr><td colspan=\"8\" class=\"left\">compressed tier: %d frames, memory: %luMB/%luMB (%luMB uncompressed), restored: %d</td></tr>\n",
+        z_frames, (unsigned long) (z_bytes >> 20), (unsigned long) (z_budget >> 20), (unsigned long) (z_raw >> 20), z_hits);
+  }
   if (tbl&2) {
     rprintf("</table>\n");
   }
@@ -21,13 +21,22 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include "vinfo.h"
 
 void vcache_create(void **p);
 void vcache_destroy(void **p);
 void vcache_resize(void **p, int size);
 void vcache_clear (void *p, int id);
-
-uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, void **cptr, int *err);
+void vcache_set_harvest(void *p, int max_frames);
+/* limit the memory of cached frames, 0: limited by the number of lines only */
+void vcache_set_budget(void *p, size_t bytes);
+/* back frame buffers that are allocated from now on by huge pages */
+void vcache_set_hugepages(void *p, int enable);
+/* keep evicted frames LZ4-compressed, up to the given size in bytes.
+ * returns -1 if harvid was built without LZ4 */
+int vcache_set_compressed(void *p, size_t bytes);
+
+uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, DecoderHints *dh, void **cptr, int *err);
 void vcache_release_buffer(void *p, void *cptr);
 void vcache_invalidate_buffer(void *p, void *cptr);
 
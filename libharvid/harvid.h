@@ -40,7 +40,7 @@ extern "C" {
 /* public ffdecoder.h API */
 void ff_initialize (void);
 void ff_cleanup (void);
-int  picture_bytesize(int render_fmt, int w, int h);
+int  ff_picture_bytesize(int render_fmt, int w, int h);
 
 #ifdef __cplusplus
 }
@@ -25,6 +25,8 @@
 
 #include "dlog.h"
 #include "image_cache.h"
+#include "waitq.h"
+#include "lrulist.h"
 
 #include <time.h>
 #include <assert.h>
@@ -37,6 +39,9 @@
 /* FLAGS */
 #define CLF_VALID 1    //< cacheline is valid (has decoded frame) -- not needed, is it?!
 #define CLF_INUSE 2    //< currently being served
+#define CLF_PENDING 4  //< placeholder: image is being encoded (icache_reserve)
+#define CLF_COLD 8     //< not requested again since it was added
+#define CLF_RELEASE 16 //< flushed while in use, freed on its last release
 
 typedef struct {
   int id;         // file ID from VidMap
@@ -51,6 +56,7 @@ typedef struct {
   //int hitcount  //  -- unused; least-frequently used idea
   uint8_t *b;     //< data buffer pointer
   size_t   s;     //< data buffer size
+  lru_node ln;    //< linked to ICC.lru or ICC.cold while idle
   UT_hash_handle hh;
 } ImageCacheLine;
 
@@ -59,26 +65,49 @@ typedef struct {
 /* image cache control */
 typedef struct {
   ImageCacheLine *icache;
+  lru_list lru;        ///< idle images that were requested again, LRU first
+  lru_list cold;       ///< idle images that were not requested since they were added, replaced first
   int cfg_cachesize;
+  size_t cfg_budget;   ///< max. bytes of encoded images, 0: limited by cfg_cachesize only
+  size_t used;         ///< bytes of all cached images
   pthread_rwlock_t lock;
   int cache_hits;
   int cache_miss;
+  int cache_coalesced; ///< requests that waited for a concurrent encode
+  waitq wq;            ///< notified when a pending image is added or canceled
 } ICC;
 
+/* max. time to wait for the image that another request is encoding */
+#define PENDING_WAIT_MS 2000
 
+
+/* remove all images. Placeholders remain until they are added or
+ * canceled, images that are being sent are freed on their last release.
+ */
 static void ic_flush_cache (ICC *icc) {
   ImageCacheLine *cl, *tmp;
   pthread_rwlock_wrlock(&icc->lock);
 
   HASH_ITER(hh, icc->icache, cl, tmp) {
+    if (cl->flags & CLF_PENDING) {
+      continue;
+    }
     HASH_DEL(icc->icache, cl);
+    if (cl->flags & CLF_INUSE) {
+      cl->flags |= CLF_RELEASE;
+      continue;
+    }
+    lru_unlink(&cl->ln);
+    icc->used -= cl->s;
     free(cl->b);
     free(cl);
   }
 
   icc->cache_hits = 0;
   icc->cache_miss = 0;
+  icc->cache_coalesced = 0;
   pthread_rwlock_unlock(&icc->lock);
+  wq_notify(&icc->wq);
 }
 
 ////////////
@@ -90,12 +119,17 @@ void icache_create(void **p) {
   icc->cfg_cachesize = 32;
   icc->icache = NULL;
   icc->cache_hits = icc->cache_miss = 0;
+  icc->cache_coalesced = 0;
+  lru_init(&icc->lru);
+  lru_init(&icc->cold);
   pthread_rwlock_init(&icc->lock, NULL);
+  wq_init(&icc->wq);
 }
 
 void icache_destroy(void **p) {
   ICC *icc = (*((ICC**)p));
   pthread_rwlock_destroy(&icc->lock);
+  wq_destroy(&icc->wq);
   free(icc->icache);
   free(*((ICC**)p));
   *p = NULL;
@@ -117,24 +151,45 @@ uint8_t *icache_get_buffer(void *p, unsigned short id, int64_t frame, int fmt, i
   ICC *icc = (ICC*) p;
   ImageCacheLine *cl = NULL;
   const ImageCacheLine cmp = {id, w, h, fmt, fmt_opt, frame, 0, 0, 0, NULL, 0};
+  struct timespec deadline;
+  int waited = 0;
 
   pthread_rwlock_rdlock(&icc->lock);
   HASH_FIND(hh, icc->icache, &cmp, CLKEYLEN, cl);
   pthread_rwlock_unlock(&icc->lock);
 
-  if (cl) {
+  while (cl) {
+    unsigned int gen;
     pthread_rwlock_wrlock(&icc->lock);
-    if (cl->flags&CLF_VALID) {
+    /* the line may have been replaced meanwhile */
+    HASH_FIND(hh, icc->icache, &cmp, CLKEYLEN, cl);
+    if (cl && (cl->flags&CLF_VALID)) {
+      lru_unlink(&cl->ln);
       cl->refcnt++;
       cl->flags |= CLF_INUSE;
+      cl->flags &= ~CLF_COLD;
       pthread_rwlock_unlock(&icc->lock);
       if (size) *size = cl->s;
       if (cptr) *cptr = cl;
       cl->lru = time(NULL);
       icc->cache_hits++;
+      if (waited) icc->cache_coalesced++;
       return cl->b;
     }
+    if (!cl || !(cl->flags&CLF_PENDING)) {
+      pthread_rwlock_unlock(&icc->lock);
+      break;
+    }
+    /* another request is encoding this very image, wait for it */
+    gen = wq_generation(&icc->wq);
     pthread_rwlock_unlock(&icc->lock);
+    if (!waited) {
+      wq_deadline(&deadline, PENDING_WAIT_MS);
+      waited = 1;
+    }
+    if (wq_wait_change(&icc->wq, gen, &deadline)) {
+      break;
+    }
   }
 
   /* not found in cache */
@@ -144,34 +199,65 @@ uint8_t *icache_get_buffer(void *p, unsigned short id, int64_t frame, int fmt, i
   return NULL;
 }
 
-int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size) {
-  ICC *icc = (ICC*) p;
-  ImageCacheLine *cl = NULL, *tmp;
-
-  pthread_rwlock_rdlock(&icc->lock); // wrlock ?!
-  if (HASH_COUNT(icc->icache) >= icc->cfg_cachesize) {
-    ImageCacheLine *tmp, *ilru = NULL;
-    time_t lru = time(NULL) + 1;
-
-    HASH_ITER(hh, icc->icache, cl, tmp) {
-      if (cl->lru < lru && !(cl->flags & CLF_INUSE)) {
-        lru = cl->lru;
-        ilru = cl;
-      }
-    }
+/* evict the LRU line. Images that were not requested
+ * again since they were added go first.
+ * returns -1 if all lines are in use or being encoded.
+ * NB. the cache needs to be write-locked when calling this */
+static int ic_evict(ICC *icc) {
+  ImageCacheLine *ilru;
+  lru_node *n = lru_tail(&icc->cold);
+  if (!n) n = lru_tail(&icc->lru);
+  if (!n) return -1;
+  ilru = LRU_ENTRY(n, ImageCacheLine, ln);
+  lru_unlink(n);
+  assert(!(ilru->flags & (CLF_INUSE|CLF_PENDING)));
+  HASH_DEL(icc->icache, ilru);
+  icc->used -= ilru->s;
+  free(ilru->b);
+  free(ilru);
+  return 0;
+}
 
-    if (ilru) {
-      HASH_DEL(icc->icache, ilru);
-      free(ilru->b);
-      cl = ilru;
-      memset(cl, 0, sizeof(ImageCacheLine));
-    }
+/* evict lines until an image of the given size fits the
+ * memory budget. An image larger than the whole budget is
+ * still allowed if nothing else is cached.
+ * returns -1 if the remaining lines are all in use.
+ * NB. the cache needs to be write-locked when calling this */
+static int ic_fit(ICC *icc, size_t size) {
+  while (icc->cfg_budget > 0 && icc->used + size > icc->cfg_budget && icc->used > 0) {
+    if (ic_evict(icc)) return -1;
   }
+  return 0;
+}
+
+/* get a new line, evict the LRU line if the cache is full.
+ * NB. the cache needs to be write-locked when calling this */
+static ImageCacheLine *ic_getcl(ICC *icc) {
+  if (HASH_COUNT(icc->icache) >= icc->cfg_cachesize)
+    ic_evict(icc);
+  return calloc(1, sizeof(ImageCacheLine));
+}
+
+void icache_set_budget(void *p, size_t bytes) {
+  ICC *icc = (ICC*) p;
+  pthread_rwlock_wrlock(&icc->lock);
+  icc->cfg_budget = bytes;
+  ic_fit(icc, 0);
   pthread_rwlock_unlock(&icc->lock);
+}
 
-  if (!cl)
-    cl = calloc(1, sizeof(ImageCacheLine));
+int icache_reserve(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h) {
+  ICC *icc = (ICC*) p;
+  ImageCacheLine *cl = NULL;
+  const ImageCacheLine cmp = {id, w, h, fmt, fmt_opt, frame, 0, 0, 0, NULL, 0};
 
+  pthread_rwlock_wrlock(&icc->lock);
+  HASH_FIND(hh, icc->icache, &cmp, CLKEYLEN, cl);
+  if (cl) {
+    pthread_rwlock_unlock(&icc->lock);
+    return -1;
+  }
+  cl = ic_getcl(icc);
   cl->id = id;
   cl->w = w;
   cl->h = h;
@@ -179,21 +265,76 @@ int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fm
   cl->fmt_opt = fmt_opt;
   cl->frame = frame;
   cl->lru = 0;
-  cl->b = buf;
-  cl->s = size;
-  cl->flags = CLF_VALID;
+  cl->flags = CLF_PENDING;
+  HASH_ADD(hh, icc->icache, id, CLKEYLEN, cl);
+  pthread_rwlock_unlock(&icc->lock);
+  return 0;
+}
+
+void icache_cancel(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h) {
+  ICC *icc = (ICC*) p;
+  ImageCacheLine *cl = NULL;
+  const ImageCacheLine cmp = {id, w, h, fmt, fmt_opt, frame, 0, 0, 0, NULL, 0};
 
+  pthread_rwlock_wrlock(&icc->lock);
+  HASH_FIND(hh, icc->icache, &cmp, CLKEYLEN, cl);
+  if (!cl || !(cl->flags&CLF_PENDING)) {
+    pthread_rwlock_unlock(&icc->lock);
+    return;
+  }
+  HASH_DEL(icc->icache, cl);
+  free(cl);
+  pthread_rwlock_unlock(&icc->lock);
+  wq_notify(&icc->wq);
+}
+
+int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size, void **cptr) {
+  ICC *icc = (ICC*) p;
+  ImageCacheLine *cl = NULL;
+  const ImageCacheLine cmp = {id, w, h, fmt, fmt_opt, frame, 0, 0, 0, NULL, 0};
+
+  if (cptr) *cptr = NULL;
   pthread_rwlock_wrlock(&icc->lock);
 
   // check if found - added almost simultaneously by other thread
-  HASH_FIND(hh, icc->icache, cl, CLKEYLEN, tmp);
-  if (tmp) {
+  HASH_FIND(hh, icc->icache, &cmp, CLKEYLEN, cl);
+  if (cl && !(cl->flags&CLF_PENDING)) {
     pthread_rwlock_unlock(&icc->lock);
-    free(cl);
     return -1; // buffer is freed by parent
   }
-  HASH_ADD(hh, icc->icache, id, CLKEYLEN, cl);
+
+  if (ic_fit(icc, size)) {
+    /* not cached, a placeholder is removed by icache_cancel() */
+    pthread_rwlock_unlock(&icc->lock);
+    return -1;
+  }
+
+  if (!cl) {
+    cl = ic_getcl(icc);
+    cl->id = id;
+    cl->w = w;
+    cl->h = h;
+    cl->fmt = fmt;
+    cl->fmt_opt = fmt_opt;
+    cl->frame = frame;
+    HASH_ADD(hh, icc->icache, id, CLKEYLEN, cl);
+  }
+  /* else: fill in the placeholder of icache_reserve() */
+  cl->lru = time(NULL);
+  cl->b = buf;
+  cl->s = size;
+  icc->used += size;
+  if (cptr) {
+    /* the caller still sends it, the line is idle after release */
+    cl->refcnt = 1;
+    cl->flags = CLF_VALID | CLF_INUSE | CLF_COLD;
+    *cptr = cl;
+  } else {
+    cl->flags = CLF_VALID | CLF_COLD;
+    lru_push(&icc->cold, &cl->ln);
+  }
   pthread_rwlock_unlock(&icc->lock);
+  wq_notify(&icc->wq);
   return 0;
 }
 
@@ -205,6 +346,13 @@ void icache_release_buffer(void *p, void *cptr) {
   if (--cl->refcnt < 1) {
     assert(cl->refcnt >= 0);
     cl->flags &= ~CLF_INUSE;
+    if (cl->flags & CLF_RELEASE) {
+      icc->used -= cl->s;
+      free(cl->b);
+      free(cl);
+    } else {
+      lru_push((cl->flags & CLF_COLD) ? &icc->cold : &icc->lru, &cl->ln);
+    }
   }
   pthread_rwlock_unlock(&icc->lock);
 }
@@ -226,6 +374,10 @@ static char *flags2txt(int f) {
     rv = (char*) realloc(rv, (off+8) * sizeof(char));
     off += sprintf(rv+off, "in-use ");
   }
+  if (f&CLF_PENDING) {
+    rv = (char*) realloc(rv, (off+10) * sizeof(char));
+    off += sprintf(rv+off, "encoding ");
+  }
   return rv;
 }
 
@@ -250,13 +402,15 @@ void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
 
   if (tbl&1) {
     rprintf("<h3>Encoded Image Cache:</h3>\n");
-    rprintf("<p>max available: %i\n", ((ICC*)p)->cfg_cachesize);
-    rprintf("cache-hits: %d, cache-misses: %d</p>\n", ((ICC*)p)->cache_hits, ((ICC*)p)->cache_miss);
+    rprintf("<p>max available: %i, memory: %luMB/%luMB\n", ((ICC*)p)->cfg_cachesize,
+        (unsigned long) (((ICC*)p)->used >> 20), (unsigned long) (((ICC*)p)->cfg_budget >> 20));
+    rprintf("cache-hits: %d, cache-misses: %d, coalesced: %d</p>\n", ((ICC*)p)->cache_hits, ((ICC*)p)->cache_miss, ((ICC*)p)->cache_coalesced);
     rprintf("<table style=\"text-align:center;width:100%%\">\n");
   } else {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>Encoded Image Cache :</h3></td></tr>\n");
-    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d\n", ((ICC*)p)->cfg_cachesize);
-    rprintf(", cache-hits: %d, cache-misses: %d</td></tr>\n", ((ICC*)p)->cache_hits, ((ICC*)p)->cache_miss);
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d, memory: %luMB/%luMB\n", ((ICC*)p)->cfg_cachesize,
+        (unsigned long) (((ICC*)p)->used >> 20), (unsigned long) (((ICC*)p)->cfg_budget >> 20));
+    rprintf(", cache-hits: %d, cache-misses: %d, coalesced: %d</td></tr>\n", ((ICC*)p)->cache_hits, ((ICC*)p)->cache_miss, ((ICC*)p)->cache_coalesced);
   }
   rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Allocated Bytes</th><th>Geometry</th><th>Buffer</th><th>Frame#</th><th>Last Hit</th></tr>\n");
   /* walk comlete tree */
@@ -25,10 +25,24 @@
 void icache_create(void **p);
 void icache_destroy(void **p);
 void icache_resize(void *p, int size);
+/* limit the memory of cached images, 0: limited by the number of lines only */
+void icache_set_budget(void *p, size_t bytes);
 void icache_clear (void *p);
 
 uint8_t *icache_get_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, size_t *size, void **cptr);
-int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size);
+/* add an encoded image, the cache takes ownership of buf on success (returns 0).
+ * If cptr is not NULL it receives a reference that must be released
+ * with icache_release_buffer(), so that the image can be published
+ * before it is sent. */
+int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size, void **cptr);
+
+/* single-flight encoding: the first request for an image reserves it
+ * (returns 0) and must icache_add_buffer() or icache_cancel() it under
+ * the same key.
+ * Meanwhile icache_get_buffer() of identical requests waits for it.
+ * returns -1 if the image is cached or being encoded already. */
+int icache_reserve(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h);
+void icache_cancel(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h);
 void icache_release_buffer(void *p, void *cptr);
 
 void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl);
@@ -0,0 +1,82 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _harvid_lrulist_H
+#define _harvid_lrulist_H
+
+#include <stddef.h>
+
+struct lru_list;
+
+/**
+ * intrusive list node, embedded in a cacheline
+ */
+typedef struct lru_node {
+  struct lru_node *prev;
+  struct lru_node *next;
+  struct lru_list *list; ///< list the node is linked to, NULL: none
+} lru_node;
+
+/**
+ * recency list: most recently used at the head, the
+ * replacement candidate at the tail. Not thread-safe,
+ * callers hold the cache's lock.
+ */
+typedef struct lru_list {
+  lru_node *head;
+  lru_node *tail;
+  int count;
+} lru_list;
+
+/** get the cacheline that embeds the given node */
+#define LRU_ENTRY(node, type, member) \
+  ((type*) ((char*)(node) - offsetof(type, member)))
+
+static inline void lru_init(lru_list *l) {
+  l->head = l->tail = NULL;
+  l->count = 0;
+}
+
+/** remove node from its list, no-op if it is not linked */
+static inline void lru_unlink(lru_node *n) {
+  lru_list *l = n->list;
+  if (!l) return;
+  if (n->prev) n->prev->next = n->next; else l->head = n->next;
+  if (n->next) n->next->prev = n->prev; else l->tail = n->prev;
+  n->prev = n->next = NULL;
+  n->list = NULL;
+  l->count--;
+}
+
+/** link node as most recently used */
+static inline void lru_push(lru_list *l, lru_node *n) {
+  lru_unlink(n);
+  n->prev = NULL;
+  n->next = l->head;
+  if (l->head) l->head->prev = n; else l->tail = n;
+  l->head = n;
+  n->list = l;
+  l->count++;
+}
+
+/** @return least recently used node or NULL if the list is empty */
+static inline lru_node *lru_tail(lru_list *l) {
+  return l->tail;
+}
+
+#endif
@@ -0,0 +1,296 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "dlog.h"
+#include "slab.h"
+
+#define SLAB_PAGE  (4096)             ///< smallest slot size and granularity
+#define SLAB_HUGE  (2 * 1024 * 1024)  ///< huge-page size, arenas are a multiple of it
+#define SLAB_ARENA (32 * 1024 * 1024) ///< max. arena size, unless a single slot is larger
+#define SLAB_SLOTS (8)                ///< target slots per arena
+
+typedef struct slab_arena {
+  uint8_t *base;
+  size_t length;     ///< mapped bytes
+  int nslots;
+  int carved;        ///< slots that were handed out at least once
+  int used;          ///< slots currently allocated
+  int huge;          ///< backed by huge pages
+  int *free;         ///< recycled slot numbers (their pages stay mapped)
+  int nfree;
+  struct slab_arena *next;
+} slab_arena;
+
+typedef struct slab_class {
+  size_t size;       ///< slot size
+  slab_arena *arenas;
+  struct slab_class *next;
+} slab_class;
+
+typedef struct {
+  slab_class *classes;
+  int hugepages;
+  size_t mapped;
+  size_t used;
+  int arenas;
+  int huge;
+  pthread_mutex_t lock;
+} SLAB;
+
+size_t slab_size(size_t size) {
+  size_t step = SLAB_PAGE;
+  /* round up to a multiple of step with 8 * step <= size < 16 * step:
+   * 8 classes per power of two, at most 1/8th slack */
+  while (step * 16 <= size) step *= 2;
+  if (size < SLAB_PAGE) size = SLAB_PAGE;
+  return (size + step - 1) / step * step;
+}
+
+/* give the pages of an unused range back to the system, the content is lost.
+ * Only whole (huge) pages are released, partial ones stay mapped.
+ * MADV_FREE lets the kernel reclaim them lazily, under memory pressure. */
+static void arena_release(slab_arena *a, uint8_t *ptr, size_t len) {
+#if !defined WIN32 && defined MADV_DONTNEED
+  const uintptr_t g = a->huge ? SLAB_HUGE : SLAB_PAGE;
+  const uintptr_t b = ((uintptr_t) ptr + g - 1) / g * g;
+  const uintptr_t e = ((uintptr_t) ptr + len) / g * g;
+  if (e <= b) return;
+# ifdef MADV_FREE
+  if (!madvise((void*) b, e - b, MADV_FREE)) return;
+# endif
+  madvise((void*) b, e - b, MADV_DONTNEED);
+#else
+  (void) a; (void) ptr; (void) len;
+#endif
+}
+
+/* arenas hold a few slots: small classes map a single huge page,
+ * large ones up to SLAB_ARENA (or one slot if that is larger) */
+static slab_arena *arena_map(SLAB *s, size_t size) {
+  slab_arena *a = calloc(1, sizeof(slab_arena));
+  const size_t granularity = s->hugepages ? SLAB_HUGE : SLAB_PAGE;
+  size_t length = size * SLAB_SLOTS;
+  if (length < SLAB_HUGE) length = SLAB_HUGE;
+  if (length > SLAB_ARENA) length = SLAB_ARENA > size ? SLAB_ARENA : size;
+  length = (length + granularity - 1) / granularity * granularity;
+
+  if (!a) return NULL;
+#ifndef WIN32
+  a->base = MAP_FAILED;
+# ifdef MAP_HUGETLB
+  if (s->hugepages) {
+    a->base = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (a->base != MAP_FAILED) a->huge = 1;
+  }
+# endif
+  if (a->base == MAP_FAILED) {
+    a->base = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+  if (a->base == MAP_FAILED) {
+    free(a);
+    return NULL;
+  }
+# ifdef MADV_HUGEPAGE
+  if (s->hugepages && !a->huge && !madvise(a->base, length, MADV_HUGEPAGE)) {
+    a->huge = 1;
+  }
+# endif
+#else
+  if (!(a->base = malloc(length))) {
+    free(a);
+    return NULL;
+  }
+#endif
+  a->length = length;
+  a->nslots = length / size;
+  if (!(a->free = malloc(a->nslots * sizeof(int)))) {
+#ifndef WIN32
+    munmap(a->base, length);
+#else
+    free(a->base);
+#endif
+    free(a);
+    return NULL;
+  }
+  s->mapped += length;
+  s->arenas++;
+  if (a->huge) s->huge++;
+  debugmsg(DEBUG_DCTL, "SLAB: mapped arena of %d x %lu bytes%s\n",
+      a->nslots, (unsigned long) size, a->huge ? " (huge pages)" : "");
+  return a;
+}
+
+static void arena_unmap(SLAB *s, slab_arena *a) {
+  s->mapped -= a->length;
+  s->arenas--;
+  if (a->huge) s->huge--;
+#ifndef WIN32
+  munmap(a->base, a->length);
+#else
+  free(a->base);
+#endif
+  free(a->free);
+  free(a);
+}
+
+static slab_class *find_class(SLAB *s, size_t size, int create) {
+  slab_class *c;
+  for (c = s->classes; c; c = c->next) {
+    if (c->size == size) return c;
+  }
+  if (!create || !(c = calloc(1, sizeof(slab_class)))) return NULL;
+  c->size = size;
+  c->next = s->classes;
+  s->classes = c;
+  return c;
+}
+
+void slab_create(void **p) {
+  SLAB *s = calloc(1, sizeof(SLAB));
+  pthread_mutex_init(&s->lock, NULL);
+  *p = s;
+}
+
+void slab_destroy(void **p) {
+  SLAB *s = (SLAB*) *p;
+  slab_class *c, *cn;
+  if (!s) return;
+  for (c = s->classes; c; c = cn) {
+    slab_arena *a, *an;
+    for (a = c->arenas; a; a = an) {
+      an = a->next;
+      assert(a->used == 0);
+      arena_unmap(s, a);
+    }
+    cn = c->next;
+    free(c);
+  }
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+  *p = NULL;
+}
+
+void slab_set_hugepages(void *p, int enable) {
+  SLAB *s = (SLAB*) p;
+  pthread_mutex_lock(&s->lock);
+  s->hugepages = enable;
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* arenas are filled in order, new ones are appended:
+ * allocations concentrate in the oldest arenas and
+ * the newest ones are the first to become empty.
+ */
+void *slab_alloc(void *p, size_t size) {
+  SLAB *s = (SLAB*) p;
+  slab_class *c;
+  slab_arena *a, **ap;
+  void *rv = NULL;
+
+  size = slab_size(size);
+  pthread_mutex_lock(&s->lock);
+  if (!(c = find_class(s, size, 1))) {
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
+  for (ap = &c->arenas; (a = *ap); ap = &a->next) {
+    if (a->nfree > 0 || a->carved < a->nslots) break;
+  }
+  if (!a) {
+    if (!(a = arena_map(s, size))) {
+      pthread_mutex_unlock(&s->lock);
+      dlog(DLOG_ERR, "SLAB: out of memory (trying to map %lu bytes)\n", (unsigned long) size);
+      return NULL;
+    }
+    *ap = a;
+  }
+  if (a->nfree > 0) {
+    rv = a->base + (size_t) a->free[--a->nfree] * size;
+  } else {
+    /* slots are carved on demand: pages are not touched before they are used */
+    rv = a->base + (size_t) a->carved * size;
+    a->carved++;
+  }
+  a->used++;
+  s->used += size;
+  pthread_mutex_unlock(&s->lock);
+  return rv;
+}
+
+void slab_free(void *p, void *ptr, size_t size) {
+  SLAB *s = (SLAB*) p;
+  slab_class *c;
+  slab_arena *a, **ap;
+  int spare = 0;
+
+  if (!ptr) return;
+  size = slab_size(size);
+  pthread_mutex_lock(&s->lock);
+  c = find_class(s, size, 0);
+  assert(c);
+  for (ap = &c->arenas; (a = *ap); ap = &a->next) {
+    if ((uint8_t*) ptr >= a->base && (uint8_t*) ptr < a->base + a->length) break;
+  }
+  assert(a);
+  a->used--;
+  s->used -= size;
+
+  if (a->used == 0) {
+    /* keep one empty arena per class, unmap the others */
+    slab_arena *o;
+    for (o = c->arenas; o; o = o->next) {
+      if (o != a && o->used == 0) spare = 1;
+    }
+    if (spare) {
+      *ap = a->next;
+      arena_unmap(s, a);
+    } else {
+      /* the spare keeps its address range only */
+      arena_release(a, a->base, a->length);
+      a->carved = 0;
+      a->nfree = 0;
+    }
+  } else {
+    /* the slot keeps its pages: it is likely reused by a buffer of the
+     * same size soon, releasing it would fault and zero-fill it again */
+    a->free[a->nfree++] = ((uint8_t*) ptr - a->base) / size;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void slab_stats(void *p, size_t *mapped, size_t *used, int *arenas, int *huge) {
+  SLAB *s = (SLAB*) p;
+  pthread_mutex_lock(&s->lock);
+  if (mapped) *mapped = s->mapped;
+  if (used) *used = s->used;
+  if (arenas) *arenas = s->arenas;
+  if (huge) *huge = s->huge;
+  pthread_mutex_unlock(&s->lock);
+}
+
+// vim:sw=2 sts=2 ts=8 et:
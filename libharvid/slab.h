@@ -0,0 +1,73 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _harvid_slab_H
+#define _harvid_slab_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * size-class allocator for frame buffers.
+ *
+ * Buffer sizes are rounded up to a size-class (8 per power of two,
+ * at most 1/8th slack). Each class carves its slots out of anonymous
+ * mappings (arenas) of a few slots, optionally backed by huge pages.
+ * A freed slot keeps its pages and is recycled as is. An arena that
+ * becomes empty is unmapped unless it is the only spare one of its
+ * class, the spare's pages are given back to the system.
+ *
+ * All functions are thread-safe.
+ */
+
+void slab_create(void **p);
+void slab_destroy(void **p);
+
+/**
+ * back arenas that are mapped from now on by huge pages:
+ * explicit (MAP_HUGETLB) if available, transparent ones otherwise.
+ */
+void slab_set_hugepages(void *p, int enable);
+
+/**
+ * @return the size of the slot that is allocated for the given size.
+ * Buffers with the same slot size are interchangeable.
+ */
+size_t slab_size(size_t size);
+
+/**
+ * allocate a buffer, the content is undefined.
+ * @return NULL if out of memory
+ */
+void *slab_alloc(void *p, size_t size);
+
+/**
+ * release a buffer
+ * @param size the size that was passed to slab_alloc()
+ */
+void slab_free(void *p, void *ptr, size_t size);
+
+/**
+ * @param mapped bytes of all arenas
+ * @param used bytes of allocated slots
+ * @param arenas number of arenas
+ * @param huge number of arenas backed by huge pages
+ */
+void slab_stats(void *p, size_t *mapped, size_t *used, int *arenas, int *huge);
+
+#endif
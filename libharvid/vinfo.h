@@ -42,6 +42,41 @@ typedef struct {
   double file_frame_offset;
 } VInfo;
 
+/** callback to request a buffer for a frame that was decoded in passing
+ * (or for a frame of a range, see dctrl_decode_range()),
+ * returns NULL if the frame is not wanted */
+typedef uint8_t *(*harvest_get_fn)(void *arg, int64_t frame);
+/** callback to hand back a buffer obtained with \ref harvest_get_fn */
+typedef void (*harvest_done_fn)(void *arg, int64_t frame, int ok);
+
+/** seek accuracy */
+enum {
+  SEEKMODE_EXACT = 0, ///< decode the requested frame
+  SEEKMODE_KEY,       ///< decode the keyframe at or before the requested frame
+  SEEKMODE_NEAREST,   ///< use a nearby cached frame if available, else SEEKMODE_KEY
+};
+
+/** scheduling priority of a request in the decode worker pool */
+enum {
+  DPRIO_INTERACTIVE = 0, ///< a client is waiting for this frame
+  DPRIO_PREFETCH,        ///< speculative read-ahead
+  DPRIO_BULK,            ///< bulk export, e.g. frame ranges
+  DPRIO_LEVELS
+};
+
+/** per-request decoder hints, zero-initialized members use server defaults */
+typedef struct {
+  int threads;            ///< codec threads to use for this request
+  int seekmode;           ///< SEEKMODE_EXACT, SEEKMODE_KEY or SEEKMODE_NEAREST
+  int priority;           ///< DPRIO_INTERACTIVE, DPRIO_PREFETCH or DPRIO_BULK, -1: by request (interactive for frames, bulk for ranges)
+  int64_t frame;          ///< returned: frame-number that was delivered
+  int reverse;            ///< set by the decoder-control: the frame precedes the decoder's position (backward playback)
+  int retry_after;        ///< returned with error 503: seconds after which the request may succeed, 0: unknown
+  harvest_get_fn harvest_get;   ///< set by the frame-cache
+  harvest_done_fn harvest_done; ///< set by the frame-cache
+  void *harvest_arg;            ///< set by the frame-cache
+} DecoderHints;
+
 /** initialise a VInfo struct
  * @param i VInfo struct to initialize
  */
@@ -0,0 +1,160 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "waitq.h"
+
+void wq_init(waitq *q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+  q->head = q->tail = NULL;
+  q->generation = 0;
+  q->watchers = 0;
+}
+
+void wq_destroy(waitq *q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->changed);
+}
+
+void wq_deadline(struct timespec *ts, int ms) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  ts->tv_sec = tv.tv_sec + ms / 1000;
+  ts->tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/* wake the first waiter after 'w' (NULL: from the head)
+ * that is not awake yet. q->lock must be held. */
+static void wq_wake_next(waitq *q, wq_waiter *w) {
+  wq_waiter *n = w ? w->next : q->head;
+  for (; n; n = n->next) {
+    if (!n->signaled) {
+      n->signaled = 1;
+      pthread_cond_signal(&n->cond);
+      return;
+    }
+  }
+}
+
+void wq_join(waitq *q, wq_waiter *w) {
+  pthread_cond_init(&w->cond, NULL);
+  w->next = NULL;
+  pthread_mutex_lock(&q->lock);
+  w->signaled = q->head ? 0 : 1;
+  if (q->tail) {
+    q->tail->next = w;
+  } else {
+    q->head = w;
+  }
+  q->tail = w;
+  pthread_mutex_unlock(&q->lock);
+}
+
+int wq_busy(waitq *q) {
+  return q->head != NULL;
+}
+
+int wq_wait(waitq *q, wq_waiter *w, const struct timespec *deadline) {
+  int rv = 0;
+  pthread_mutex_lock(&q->lock);
+  while (!w->signaled && rv != ETIMEDOUT) {
+    if (deadline) {
+      rv = pthread_cond_timedwait(&w->cond, &q->lock, deadline);
+    } else {
+      pthread_cond_wait(&w->cond, &q->lock);
+    }
+  }
+  if (w->signaled) {
+    w->signaled = 0;
+    rv = 0;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return rv;
+}
+
+void wq_pass(waitq *q, wq_waiter *w) {
+  pthread_mutex_lock(&q->lock);
+  wq_wake_next(q, w);
+  pthread_mutex_unlock(&q->lock);
+}
+
+void wq_leave(waitq *q, wq_waiter *w) {
+  wq_waiter *p = NULL, *n;
+  pthread_mutex_lock(&q->lock);
+  for (n = q->head; n && n != w; n = n->next) {
+    p = n;
+  }
+  if (n) {
+    if (p) {
+      p->next = w->next;
+    } else {
+      q->head = w->next;
+    }
+    if (q->tail == w) {
+      q->tail = p;
+    }
+    if (w->signaled) {
+      wq_wake_next(q, p);
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  pthread_cond_destroy(&w->cond);
+}
+
+void wq_notify(waitq *q) {
+  pthread_mutex_lock(&q->lock);
+  q->generation++;
+  wq_wake_next(q, NULL);
+  if (q->watchers > 0) {
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
+
+unsigned int wq_generation(waitq *q) {
+  unsigned int gen;
+  pthread_mutex_lock(&q->lock);
+  gen = q->generation;
+  pthread_mutex_unlock(&q->lock);
+  return gen;
+}
+
+int wq_wait_change(waitq *q, unsigned int gen, const struct timespec *deadline) {
+  int rv = 0;
+  pthread_mutex_lock(&q->lock);
+  q->watchers++;
+  while (q->generation == gen && rv != ETIMEDOUT) {
+    if (deadline) {
+      rv = pthread_cond_timedwait(&q->changed, &q->lock, deadline);
+    } else {
+      pthread_cond_wait(&q->changed, &q->lock);
+    }
+  }
+  q->watchers--;
+  if (q->generation != gen) rv = 0;
+  pthread_mutex_unlock(&q->lock);
+  return rv;
+}
@@ -0,0 +1,114 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _harvid_waitq_H
+#define _harvid_waitq_H
+
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * a thread waiting for a resource, lives on the waiter's stack
+ */
+typedef struct wq_waiter {
+  pthread_cond_t cond;
+  int signaled;             ///< it is this waiter's turn to try
+  struct wq_waiter *next;
+} wq_waiter;
+
+/**
+ * FIFO wait queue.
+ *
+ * Threads that cannot get a resource (decoder, cacheline) queue up and
+ * are woken in order, one per released resource. A woken waiter that
+ * still fails hands the wakeup on to the next waiter in line.
+ *
+ * Threads that wait for a state change instead of a resource
+ * (e.g. a flush waiting for cachelines to become unused) use
+ * wq_generation() and wq_wait_change() and are all woken.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  wq_waiter *head;
+  wq_waiter *tail;
+  unsigned int generation;
+  int watchers;
+} waitq;
+
+void wq_init(waitq *q);
+void wq_destroy(waitq *q);
+
+/**
+ * compute an absolute deadline
+ * @param ts return value
+ * @param ms milliseconds from now
+ */
+void wq_deadline(struct timespec *ts, int ms);
+
+/**
+ * append the calling thread to the queue. A waiter that joins
+ * an empty queue may try right away (first wq_wait() returns 0).
+ */
+void wq_join(waitq *q, wq_waiter *w);
+
+/**
+ * @return non-zero if threads are queued. Used by newcomers to
+ * not overtake waiters (unlocked read, a hint only).
+ */
+int wq_busy(waitq *q);
+
+/**
+ * wait for this waiter's turn.
+ * @param deadline absolute time, NULL: wait forever
+ * @return 0 when the waiter should try to get the resource,
+ * non-zero if the deadline has passed.
+ */
+int wq_wait(waitq *q, wq_waiter *w, const struct timespec *deadline);
+
+/**
+ * the waiter failed to get the resource it was woken for:
+ * wake the next waiter in line.
+ */
+void wq_pass(waitq *q, wq_waiter *w);
+
+/**
+ * remove waiter from the queue (after success or timeout).
+ * A wakeup that has not been consumed is passed on.
+ */
+void wq_leave(waitq *q, wq_waiter *w);
+
+/**
+ * a resource was released: wake the first waiter that
+ * is not awake already and all state-change watchers.
+ */
+void wq_notify(waitq *q);
+
+/**
+ * @return current generation, to be passed to wq_wait_change()
+ */
+unsigned int wq_generation(waitq *q);
+
+/**
+ * block until wq_notify() was called after wq_generation() returned gen.
+ * @param deadline absolute time, NULL: wait forever
+ * @return 0 on change, non-zero if the deadline has passed.
+ */
+int wq_wait_change(waitq *q, unsigned int gen, const struct timespec *deadline);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "dlog.h"
+#include "zframe_cache.h"
+#include "lrulist.h"
+
+//#define HASH_EMIT_KEYS 3
+#define HASH_FUNCTION HASH_SFH
+#include "uthash.h"
+
+typedef struct {
+  int id;         // file ID from VidMap
+  short w;
+  short h;
+  int fmt;        // pixel format
+  int64_t frame;
+  size_t raw;     //< uncompressed size
+  size_t size;    //< compressed size
+  uint8_t *z;     //< compressed data
+  lru_node ln;
+  UT_hash_handle hh;
+} zframe;
+
+/* id +w +h + fmt + frame */
+#define ZKEYLEN (offsetof(zframe, raw) - offsetof(zframe, id))
+
+typedef struct {
+  zframe *zcache;
+  lru_list lru;   ///< stored frames, dropped least recently stored first
+  size_t cfg_budget;
+  size_t used;    ///< compressed bytes of all frames
+  size_t raw;     ///< uncompressed bytes of all frames
+  int hits;
+  pthread_mutex_t lock;
+} ZCC;
+
+/* NB. the cache needs to be locked when calling this */
+static void zf_free(ZCC *zc, zframe *zf) {
+  lru_unlink(&zf->ln);
+  HASH_DEL(zc->zcache, zf);
+  zc->used -= zf->size;
+  zc->raw -= zf->raw;
+  free(zf->z);
+  free(zf);
+}
+
+/* NB. the cache needs to be locked when calling this */
+static void zf_trim(ZCC *zc, size_t size) {
+  lru_node *n;
+  while (zc->used + size > zc->cfg_budget && (n = lru_tail(&zc->lru))) {
+    zf_free(zc, LRU_ENTRY(n, zframe, ln));
+  }
+}
+
+void zcache_create(void **p) {
+  ZCC *zc = (ZCC*) calloc(1, sizeof(ZCC));
+  zc->zcache = NULL;
+  lru_init(&zc->lru);
+  pthread_mutex_init(&zc->lock, NULL);
+  *p = zc;
+}
+
+void zcache_destroy(void **p) {
+  ZCC *zc = (ZCC*) *p;
+  zcache_clear(zc, -1);
+  pthread_mutex_destroy(&zc->lock);
+  free(zc);
+  *p = NULL;
+}
+
+int zcache_set_budget(void *p, size_t bytes) {
+  ZCC *zc = (ZCC*) p;
+#ifndef HAVE_LZ4
+  if (bytes > 0) {
+    dlog(DLOG_WARNING, "CACHE: compressed frame cache is not supported (built without LZ4).\n");
+    return -1;
+  }
+#endif
+  pthread_mutex_lock(&zc->lock);
+  zc->cfg_budget = bytes;
+  zf_trim(zc, 0);
+  pthread_mutex_unlock(&zc->lock);
+  return 0;
+}
+
+int zcache_enabled(void *p) {
+  return ((ZCC*)p)->cfg_budget > 0;
+}
+
+void zcache_put(void *p, unsigned short id, int64_t frame, short w, short h, int fmt, const uint8_t *buf, size_t size) {
+#ifdef HAVE_LZ4
+  ZCC *zc = (ZCC*) p;
+  const zframe cmp = {id, w, h, fmt, frame, 0, 0, NULL};
+  zframe *zf;
+  uint8_t *z;
+  int zs;
+
+  if (zc->cfg_budget == 0 || size > (size_t) LZ4_MAX_INPUT_SIZE) return;
+  if (!(z = malloc(LZ4_compressBound(size)))) return;
+  zs = LZ4_compress_default((const char*) buf, (char*) z, size, LZ4_compressBound(size));
+  if (zs <= 0 || (size_t) zs >= size || (size_t) zs > zc->cfg_budget) {
+    /* incompressible, keeping it would not gain anything */
+    free(z);
+    return;
+  }
+  z = realloc(z, zs);
+
+  pthread_mutex_lock(&zc->lock);
+  HASH_FIND(hh, zc->zcache, &cmp, ZKEYLEN, zf);
+  if (zf) {
+    zf_free(zc, zf);
+  }
+  zf_trim(zc, zs);
+  zf = calloc(1, sizeof(zframe));
+  zf->id = id;
+  zf->w = w;
+  zf->h = h;
+  zf->fmt = fmt;
+  zf->frame = frame;
+  zf->raw = size;
+  zf->size = zs;
+  zf->z = z;
+  HASH_ADD(hh, zc->zcache, id, ZKEYLEN, zf);
+  lru_push(&zc->lru, &zf->ln);
+  zc->used += zs;
+  zc->raw += size;
+  pthread_mutex_unlock(&zc->lock);
+#else
+  (void) p; (void) id; (void) frame; (void) w; (void) h; (void) fmt; (void) buf; (void) size;
+#endif
+}
+
+int zcache_has(void *p, unsigned short id, int64_t frame, short w, short h, int fmt) {
+  ZCC *zc = (ZCC*) p;
+  const zframe cmp = {id, w, h, fmt, frame, 0, 0, NULL};
+  zframe *zf;
+  if (zc->cfg_budget == 0) return 0;
+  pthread_mutex_lock(&zc->lock);
+  HASH_FIND(hh, zc->zcache, &cmp, ZKEYLEN, zf);
+  pthread_mutex_unlock(&zc->lock);
+  return zf ? 1 : 0;
+}
+
+int zcache_take(void *p, unsigned short id, int64_t frame, short w, short h, int fmt, uint8_t *buf, size_t size) {
+#ifdef HAVE_LZ4
+  ZCC *zc = (ZCC*) p;
+  const zframe cmp = {id, w, h, fmt, frame, 0, 0, NULL};
+  zframe *zf;
+  int rv;
+
+  if (zc->cfg_budget == 0) return -1;
+  pthread_mutex_lock(&zc->lock);
+  HASH_FIND(hh, zc->zcache, &cmp, ZKEYLEN, zf);
+  if (!zf || zf->raw != size) {
+    pthread_mutex_unlock(&zc->lock);
+    return -1;
+  }
+  /* unlink, decompress without holding the lock */
+  lru_unlink(&zf->ln);
+  HASH_DEL(zc->zcache, zf);
+  zc->used -= zf->size;
+  zc->raw -= zf->raw;
+  zc->hits++;
+  pthread_mutex_unlock(&zc->lock);
+
+  rv = LZ4_decompress_safe((const char*) zf->z, (char*) buf, zf->size, size);
+  free(zf->z);
+  free(zf);
+  return (rv >= 0 && (size_t) rv == size) ? 0 : -1;
+#else
+  (void) p; (void) id; (void) frame; (void) w; (void) h; (void) fmt; (void) buf; (void) size;
+  return -1;
+#endif
+}
+
+void zcache_clear(void *p, int id) {
+  ZCC *zc = (ZCC*) p;
+  zframe *zf, *tmp;
+  pthread_mutex_lock(&zc->lock);
+  HASH_ITER(hh, zc->zcache, zf, tmp) {
+    if (id >= 0 && zf->id != id) {
+      continue;
+    }
+    zf_free(zc, zf);
+  }
+  pthread_mutex_unlock(&zc->lock);
+}
+
+void zcache_stats(void *p, int *frames, size_t *bytes, size_t *raw, size_t *budget, int *hits) {
+  ZCC *zc = (ZCC*) p;
+  pthread_mutex_lock(&zc->lock);
+  if (frames) *frames = HASH_COUNT(zc->zcache);
+  if (bytes) *bytes = zc->used;
+  if (raw) *raw = zc->raw;
+  if (budget) *budget = zc->cfg_budget;
+  if (hits) *hits = zc->hits;
+  pthread_mutex_unlock(&zc->lock);
+}
+
+// vim:sw=2 sts=2 ts=8 et:
@@ -0,0 +1,80 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2013 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _harvid_zframe_cache_H
+#define _harvid_zframe_cache_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * second tier of the frame cache: frames that are evicted from
+ * the frame cache are kept LZ4-compressed in memory.
+ *
+ * The tiers are exclusive, a frame that is taken from this
+ * cache is removed from it and moves back to the frame cache.
+ * Without LZ4 support (HAVE_LZ4) the cache is always disabled.
+ *
+ * All functions are thread-safe, (de)compression is done
+ * without holding a lock.
+ */
+
+void zcache_create(void **p);
+void zcache_destroy(void **p);
+
+/**
+ * set the memory limit of the compressed frames
+ * @param bytes 0: disable
+ * @return 0 on success, -1 if the cache is not supported
+ */
+int zcache_set_budget(void *p, size_t bytes);
+
+/** @return non-zero if the cache is enabled */
+int zcache_enabled(void *p);
+
+/**
+ * compress and store a frame, the least recently stored
+ * frames are dropped to make room for it.
+ */
+void zcache_put(void *p, unsigned short id, int64_t frame, short w, short h, int fmt, const uint8_t *buf, size_t size);
+
+/** @return non-zero if the given frame is stored */
+int zcache_has(void *p, unsigned short id, int64_t frame, short w, short h, int fmt);
+
+/**
+ * decompress a frame into the given buffer and remove it from the cache
+ * @return 0 on success, -1 if the frame is not available
+ */
+int zcache_take(void *p, unsigned short id, int64_t frame, short w, short h, int fmt, uint8_t *buf, size_t size);
+
+/**
+ * drop frames
+ * @param id file-id of the frames to drop, -1: all
+ */
+void zcache_clear(void *p, int id);
+
+/**
+ * @param frames number of stored frames
+ * @param bytes compressed size of all frames
+ * @param raw uncompressed size of all frames
+ * @param budget memory limit
+ * @param hits frames that were taken from the cache
+ */
+void zcache_stats(void *p, int *frames, size_t *bytes, size_t *raw, size_t *budget, int *hits);
+
+#endif
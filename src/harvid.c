@@ -62,8 +62,20 @@ char *cfg_logfile = NULL;
 char *cfg_chroot = NULL;
 char *cfg_username = NULL;
 char *cfg_groupname = NULL;
+char *cfg_indexcache = NULL;
 int   initial_cache_size = 128;
 int   max_decoder_threads = 8;
+int   codec_threads = 1;
+int   scale_threads = 0;
+int   gop_cache_mb = 0;
+int   scale_min_pixels = 1920 * 1080;
+int   decode_workers = -1;
+int   admit_max_ms = 0;
+int   decoders_per_file = 0;
+int   decoder_mem_mb = 0;
+int   cache_mem_mb = 0;
+int   image_cache_mem_mb = 0;
+int   compressed_cache_mb = 0;
 unsigned short  cfg_port = DEFAULT_PORT;
 unsigned int    cfg_host = 0; /* = htonl(INADDR_ANY) */
 
@@ -83,26 +95,61 @@ static void usage (int status) {
 "                             An exclamation-mark before a command disables it.\n"
 "                             default: 'flush_cache';\n"
 "                             available: flush_cache, purge_cache, shutdown\n"
+"  -b <MB>, --cache-memory <MB>\n"
+"                             limit the memory of the frame-cache, least\n"
+"                             recently used frames are evicted to make room\n"
+"                             (default: 0, limited by -C only)\n"
+"  -B <MB>, --image-cache-memory <MB>\n"
+"                             limit the memory of the encoded image cache\n"
+"                             (default: 0, limited to 4 * -C images only)\n"
 "  -c <path>, --chroot <path>\n"
 "                             change system root - jails server to this path\n"
 "  -C <frames>                set initial frame-cache size (default: 128)\n"
 "  -D, --daemonize            fork into background and detach from TTY\n"
-"  -g <name>, --groupname <name>\n"
-"                             assume this user-group\n"
-"  -h, --help                 display this help and exit\n"
+"  -f <num>, --decoders-per-file <num>\n"
+"                             limit the decoders of a single file\n"
+"                             (default: 0, no limit besides -t)\n"
 "  -F <feat>, --features <feat>\n"
 "                             space separated list of optional features.\n"
 "                             An exclamation-mark before a features disables it.\n"
 "                             default: 'index';\n"
-"                             available: index, seek, flatindex, keepraw\n"
+"                             available: index, seek, flatindex, keepraw,\n"
+"                             harvest, mmap, hugepages\n"
+"                             (mmap: a file that is truncated while it is\n"
+"                             mapped reads as ending there)\n"
+"  -g <name>, --groupname <name>\n"
+"                             assume this user-group\n"
+"  -G <MB>, --gop-cache <MB>\n"
+"                             cache up to this many megabytes of compressed\n"
+"                             video packets per file, to replay seeks\n"
+"                             within recently read GOPs (default: 0, off)\n"
+"  -h, --help                 display this help and exit\n"
+"  -i <path>, --index-cache <path>\n"
+"                             store keyframe-indices of video files in this\n"
+"                             directory and re-use them on later runs\n"
+"  -j <threads>, --codec-threads <threads>\n"
+"                             set number of codec threads per decoder\n"
+"                             (default: 1). Additional threads are limited\n"
+"                             to the number of CPUs in total\n"
+"  -k <threads>, --scale-threads <threads>\n"
+"                             convert large frames in parallel using a pool\n"
+"                             of this many threads (default: 0, disabled)\n"
+"  -K <pixels>, --scale-min <pixels>\n"
+"                             minimum frame size (width * height) for\n"
+"                             parallel conversion (default: 2073600)\n"
 "  -l <path>, --logfile <path>\n"
 "                             specify file for log messages\n"
+"  -m <msec>, --max-wait <msec>\n"
+"                             reject decode requests right away (503 with\n"
+"                             Retry-After) if the decoders are expected to be\n"
+"                             busy for longer than this (default: 0, off)\n"
 "  -M, --memlock              attempt to lock memory (prevent cache paging)\n"
 "  -p <num>, --port <num>     TCP port to listen on (default %i)\n"
 "  -P <listenaddr>            IP address to listen on (default 0.0.0.0)\n"
 "  -q, --quiet, --silent      inhibit usual output (may be used thrice)\n"
 "  -s, --syslog               send messages to syslog\n"
-"  -t <thread-limit>          set maximum decoder-threads (default: 8)\n"
+"  -t <thread-limit>          set maximum decoder-threads (default: 8);\n"
+"                             idle decoders are closed as the load drops\n"
 "  -T <sec>, --timeout <secs>\n"
 "                             set a timeout after which the server will\n"
 "                             terminate if no new request arrives\n"
@@ -110,6 +157,18 @@ static void usage (int status) {
 "                             server will act as this user\n"
 "  -v, --verbose              print more information (may be used twice)\n"
 "  -V, --version              print version information and exit\n"
+"  -w <threads>, --decode-workers <threads>\n"
+"                             decode on a pool of this many worker threads,\n"
+"                             interactive requests before prefetch and bulk\n"
+"                             requests (default: -1, number of CPUs;\n"
+"                             0: decode in the connection's thread)\n"
+"  -x <MB>, --decoder-memory <MB>\n"
+"                             limit the estimated memory of open decoders\n"
+"                             (default: 0, no limit)\n"
+"  -z <MB>, --compressed-cache <MB>\n"
+"                             keep frames that are evicted from the frame-cache\n"
+"                             LZ4-compressed in up to this many megabytes\n"
+"                             (default: 0, disabled; requires LZ4 support)\n"
 "\n"
 "The default document-root (if unspecified) is the system root: / or C:\\.\n"
 "\n"
@@ -128,6 +187,11 @@ static void usage (int status) {
 "encodes it again. If 'keepraw' feature is enabled, both the raw RGB and\n"
 "encoded image are kept in cache. The default is to invaldate the RGB frame\n"
 "after encoding the image.\n"
+"The 'harvest' feature adds frames that are decoded while seeking forward\n"
+"to a requested frame to the frame-cache. Those only replace other harvested\n"
+"frames and are the first to be evicted unless they are requested.\n"
+"The 'hugepages' feature backs the frame-cache memory by huge pages\n"
+"(if reserved by the system, transparent huge pages otherwise).\n"
 "\n"
 "Examples:\n"
 "harvid -A '!flush_cache purge_cache shutdown' -C 256 /tmp/\n"
@@ -144,14 +208,23 @@ static void usage (int status) {
 static struct option const long_options[] =
 {
   {"admin", required_argument, 0, 'A'},
+  {"cache-memory", required_argument, 0, 'b'},
+  {"image-cache-memory", required_argument, 0, 'B'},
   {"chroot", required_argument, 0, 'c'},
   {"cache-size", required_argument, 0, 'C'},
   {"debug", required_argument, 0, 'd'},
   {"daemonize", no_argument, 0, 'D'},
   {"groupname", required_argument, 0, 'g'},
   {"help", no_argument, 0, 'h'},
+  {"decoders-per-file", required_argument, 0, 'f'},
   {"features", required_argument, 0, 'F'},
+  {"index-cache", required_argument, 0, 'i'},
+  {"codec-threads", required_argument, 0, 'j'},
+  {"gop-cache", required_argument, 0, 'G'},
+  {"scale-threads", required_argument, 0, 'k'},
+  {"scale-min", required_argument, 0, 'K'},
   {"logfile", required_argument, 0, 'l'},
+  {"max-wait", required_argument, 0, 'm'},
   {"memlock", no_argument, 0, 'M'},
   {"port", required_argument, 0, 'p'},
   {"listenip", required_argument, 0, 'P'},
@@ -162,6 +235,9 @@ static struct option const long_options[] =
   {"username", required_argument, 0, 'u'},
   {"verbose", no_argument, 0, 'v'},
   {"version", no_argument, 0, 'V'},
+  {"decode-workers", required_argument, 0, 'w'},
+  {"decoder-memory", required_argument, 0, 'x'},
+  {"compressed-cache", required_argument, 0, 'z'},
   {NULL, 0, NULL, 0}
 };
 
@@ -172,14 +248,23 @@ static int decode_switches (int argc, char **argv) {
   int c;
   while ((c = getopt_long (argc, argv,
          "A:"	/* admin */
+         "b:"	/* cache-memory */
+         "B:"	/* image-cache-memory */
          "c:"	/* chroot-dir */
          "C:" 	/* initial cache size */
          "d:"	/* debug */
          "D"	/* daemonize */
          "g:"	/* setGroup */
+         "G:"	/* gop-cache */
          "h"	/* help */
+         "f:"	/* decoders-per-file */
          "F:"	/* interaction */
+         "i:"	/* index-cache */
+         "j:"	/* codec-threads */
+         "k:"	/* scale-threads */
+         "K:"	/* scale-min */
          "l:"	/* logfile */
+         "m:"	/* max-wait */
          "M"	/* memlock */
          "p:"	/* port */
          "P:"	/* IP */
@@ -189,7 +274,10 @@ static int decode_switches (int argc, char **argv) {
          "T:"	/* timeout */
          "u:"	/* setUser */
          "v"	/* verbose */
-         "V",	/* version */
+         "V"	/* version */
+         "w:"	/* decode-workers */
+         "x:"	/* decoder-memory */
+         "z:",	/* compressed-cache */
          long_options, (int *) 0)) != EOF)
   {
     switch (c) {
@@ -219,6 +307,14 @@ static int decode_switches (int argc, char **argv) {
       case 'c':		/* --chroot */
         cfg_chroot = optarg;
         break;
+      case 'b':		/* --cache-memory */
+        cache_mem_mb = atoi(optarg);
+        if (cache_mem_mb < 0) cache_mem_mb = 0;
+        break;
+      case 'B':		/* --image-cache-memory */
+        image_cache_mem_mb = atoi(optarg);
+        if (image_cache_mem_mb < 0) image_cache_mem_mb = 0;
+        break;
       case 'C':
         initial_cache_size = atoi(optarg);
         if (initial_cache_size < 2 || initial_cache_size > 65535)
@@ -242,14 +338,48 @@ static int decode_switches (int argc, char **argv) {
         if (strstr(optarg, "seek"))       cfg_usermask |=  USR_WEBSEEK;
         if (strstr(optarg, "flatindex"))  cfg_usermask |=  USR_FLATINDEX;
         if (strstr(optarg, "keepraw"))    cfg_usermask |=  USR_KEEPRAW;
+        if (strstr(optarg, "harvest"))    cfg_usermask |=  USR_HARVEST;
+        if (strstr(optarg, "mmap"))       cfg_usermask |=  USR_MMAP;
+        if (strstr(optarg, "hugepages"))  cfg_usermask |=  USR_HUGEPAGES;
         if (strstr(optarg, "!index"))     cfg_usermask &= ~USR_INDEX;
         if (strstr(optarg, "!seek"))      cfg_usermask |=  USR_WEBSEEK;
         if (strstr(optarg, "!flatindex")) cfg_usermask &= ~USR_FLATINDEX;
         if (strstr(optarg, "!keepraw"))   cfg_usermask &= ~USR_KEEPRAW;
+        if (strstr(optarg, "!harvest"))   cfg_usermask &= ~USR_HARVEST;
+        if (strstr(optarg, "!mmap"))      cfg_usermask &= ~USR_MMAP;
+        if (strstr(optarg, "!hugepages")) cfg_usermask &= ~USR_HUGEPAGES;
         break;
       case 'g':		/* --group */
         cfg_groupname = optarg;
         break;
+      case 'G':		/* --gop-cache */
+        gop_cache_mb = atoi(optarg);
+        if (gop_cache_mb < 0 || gop_cache_mb > 4096)
+          gop_cache_mb = 0;
+        break;
+      case 'i':		/* --index-cache */
+        free(cfg_indexcache);
+#ifndef WIN32
+        /* absolute path: daemonize() changes the working directory */
+        if (!(cfg_indexcache = realpath(optarg, NULL)))
+#endif
+          cfg_indexcache = strdup(optarg);
+        break;
+      case 'j':		/* --codec-threads */
+        codec_threads = atoi(optarg);
+        if (codec_threads < 1 || codec_threads > 64)
+          codec_threads = 1;
+        break;
+      case 'k':		/* --scale-threads */
+        scale_threads = atoi(optarg);
+        if (scale_threads < 0 || scale_threads > 15)
+          scale_threads = 0;
+        break;
+      case 'K':		/* --scale-min */
+        scale_min_pixels = atoi(optarg);
+        if (scale_min_pixels < 1)
+          scale_min_pixels = 1920 * 1080;
+        break;
       case 'l':		/* --logfile */
         cfg_syslog = 0;
         if (cfg_logfile) free(cfg_logfile);
@@ -280,6 +410,28 @@ static int decode_switches (int argc, char **argv) {
       case 'T':		/* --timeout */
         cfg_timeout = atoi(optarg);
         break;
+      case 'm':		/* --max-wait */
+        admit_max_ms = atoi(optarg);
+        if (admit_max_ms < 0 || admit_max_ms > 3600000)
+          admit_max_ms = 0;
+        break;
+      case 'f':		/* --decoders-per-file */
+        decoders_per_file = atoi(optarg);
+        if (decoders_per_file < 0) decoders_per_file = 0;
+        break;
+      case 'x':		/* --decoder-memory */
+        decoder_mem_mb = atoi(optarg);
+        if (decoder_mem_mb < 0) decoder_mem_mb = 0;
+        break;
+      case 'z':		/* --compressed-cache */
+        compressed_cache_mb = atoi(optarg);
+        if (compressed_cache_mb < 0) compressed_cache_mb = 0;
+        break;
+      case 'w':		/* --decode-workers */
+        decode_workers = atoi(optarg);
+        if (decode_workers < -1 || decode_workers > 256)
+          decode_workers = -1;
+        break;
       case 'u':		/* --username */
         cfg_username = optarg;
         break;
@@ -350,6 +502,12 @@ int main (int argc, char **argv) {
     goto errexit;
   }
 
+  if (cfg_indexcache && (stat(cfg_indexcache, &sb) || !S_ISDIR(sb.st_mode))) {
+    dlog(DLOG_WARNING, "index-cache is not a directory. keyframe-indices will not be cached.\n");
+    free(cfg_indexcache);
+    cfg_indexcache = NULL;
+  }
+
   if (cfg_daemonize) {
     if (daemonize()) {exitstatus = -1; goto errexit;}
   }
@@ -358,9 +516,24 @@ int main (int argc, char **argv) {
 
   vcache_create(&vc);
   vcache_resize(&vc, initial_cache_size);
+  vcache_set_budget(vc, (size_t) cache_mem_mb * 1024 * 1024);
+  vcache_set_hugepages(vc, cfg_usermask & USR_HUGEPAGES ? 1 : 0);
+  if (vcache_set_compressed(vc, (size_t) compressed_cache_mb * 1024 * 1024))
+    compressed_cache_mb = 0;
+  if (cfg_usermask & USR_HARVEST)
+    vcache_set_harvest(vc, initial_cache_size / 4);
   icache_create(&ic);
   icache_resize(ic, initial_cache_size*4);
+  icache_set_budget(ic, (size_t) image_cache_mem_mb * 1024 * 1024);
   dctrl_create(&dc, max_decoder_threads, initial_cache_size);
+  dctrl_set_index_cachedir(dc, cfg_indexcache);
+  dctrl_set_threads(dc, codec_threads, 0);
+  dctrl_set_scale_threads(dc, scale_threads, scale_min_pixels);
+  dctrl_set_gop_cache(dc, (size_t) gop_cache_mb * 1024 * 1024);
+  dctrl_set_mmap(dc, cfg_usermask & USR_MMAP ? 1 : 0);
+  dctrl_set_workers(dc, decode_workers);
+  dctrl_set_admission(dc, admit_max_ms);
+  dctrl_set_limits(dc, decoders_per_file, (size_t) decoder_mem_mb * 1024 * 1024);
 
   if (cfg_memlock) {
 #ifndef HAVE_WINDOWS
@@ -384,6 +557,7 @@ int main (int argc, char **argv) {
   vcache_destroy(&vc);
   icache_destroy(&ic);
 errexit:
+  free(cfg_indexcache);
   dlog_close();
   return(exitstatus);
 }
@@ -396,7 +570,7 @@ errexit:
 #include "ics_handler.h"
 #include "htmlconst.h"
 
-#define HPSIZE 4096 // max size of homepage in bytes.
+#define HPSIZE 8192 // max size of homepage in bytes.
 char *hdl_homepage_html (CONN *c) {
   char *msg = malloc(HPSIZE * sizeof(char));
   int off = 0;
@@ -427,8 +601,10 @@ char *hdl_homepage_html (CONN *c) {
   off+=snprintf(msg+off, HPSIZE-off, "<div style=\"clear:both;\"></div><hr/>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The default request handler decodes images and requires a <code>?frame=NUM&amp;file=PATH</code> URL query or post parameters. Video frames are counted starting at zero. Default options are <code>w=0&amp;h=0&amp;format=png</code> which serves the image pre-scaled to its effective size as png.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p>The <code>/info</code> request handler requires a <code>?file=PATH</code> query parameter and optionally takes a <code>format</code> (default is html). All other handlers (/status, /rc, /version, /admin/) take no arguments.</p>\n");
-  off+=snprintf(msg+off, HPSIZE-off, "<p>Available query parameters: <code>frame</code>, <code>w</code>, <code>h</code>, <code>file</code>, <code>format</code>.</p>\n");
-  off+=snprintf(msg+off, HPSIZE-off, "<p>Frame (frame-number), w (width) and h (height) are unsigned integers.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p>Available query parameters: <code>frame</code>, <code>w</code>, <code>h</code>, <code>file</code>, <code>format</code>, <code>threads</code>, <code>seek</code>, <code>prio</code>.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p>Frame (frame-number), w (width) and h (height) are unsigned integers. Threads optionally requests more codec threads for the decoder (limited by the server).</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">Seek is one of <code>exact</code> (default), <code>key</code> (fast, the keyframe at or before the given frame) or <code>nearest</code> (a cached frame close by if available, else the keyframe). The frame-number that was delivered is returned in the <code>X-Harvid-Frame</code> HTTP header.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The <code>/range</code> request handler decodes <code>count</code> frames starting at <code>frame</code>, every <code>stride</code> frames, in a single pass. Raw formats return the frames back to back, encoded formats a single image with the frames tiled in rows of <code>cols</code> frames.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p>Supported image output pixel formats:</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<ul>\n<li><em>Encoded</em>: jpg, jpeg, png, ppm</li>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<li><em>Raw RGB</em>: rgb, bgr, rgba, argb, bgra</li>\n");
@@ -586,7 +762,7 @@ char *hdl_file_info (CONN *c, ics_request_args *a) {
 
 /////////////
 
-#define SINFOSIZ 2048
+#define SINFOSIZ 4096
 char *hdl_server_info (CONN *c, ics_request_args *a) {
   char *info = malloc(SINFOSIZ * sizeof(char));
   int off = 0;
@@ -644,7 +820,20 @@ char *hdl_server_info (CONN *c, ics_request_args *a) {
       off+=snprintf(info+off, SINFOSIZ-off, "<li>ListenAddr: %s</li>\n", c->d->local_addr);
       off+=snprintf(info+off, SINFOSIZ-off, "<li>ListenPort: %d</li>\n", c->d->local_port);
       off+=snprintf(info+off, SINFOSIZ-off, "<li>CacheSize: %d</li>\n", initial_cache_size);
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Frame Cache Memory: %d MB%s</li>\n", cache_mem_mb, cache_mem_mb > 0 ? "" : " (no limit)");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Image Cache Memory: %d MB%s</li>\n", image_cache_mem_mb, image_cache_mem_mb > 0 ? "" : " (no limit)");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Compressed Frame Cache: %d MB%s</li>\n", compressed_cache_mb, compressed_cache_mb > 0 ? "" : " (disabled)");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Codec Threads: %d</li>\n", codec_threads);
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Scaler Threads: %d (min. %d px)</li>\n", scale_threads, scale_min_pixels);
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>GOP Cache: %d MB per file</li>\n", gop_cache_mb);
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Decode Workers: %d%s</li>\n", decode_workers, decode_workers < 0 ? " (number of CPUs)" : "");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Decoders per File: %d%s</li>\n", decoders_per_file, decoders_per_file > 0 ? "" : " (no limit)");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Decoder Memory: %d MB%s</li>\n", decoder_mem_mb, decoder_mem_mb > 0 ? "" : " (no limit)");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Admission Max. Wait: %d ms%s</li>\n", admit_max_ms, admit_max_ms > 0 ? "" : " (off)");
       off+=snprintf(info+off, SINFOSIZ-off, "<li>File Index: %s</li>\n", cfg_usermask & USR_INDEX ? "Yes" : "No");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Frame Harvest: %s</li>\n", cfg_usermask & USR_HARVEST ? "Yes" : "No");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Memory-mapped I/O: %s</li>\n", cfg_usermask & USR_MMAP ? "Yes" : "No");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Huge Pages: %s</li>\n", cfg_usermask & USR_HUGEPAGES ? "Yes" : "No");
       off+=snprintf(info+off, SINFOSIZ-off, "<li>Admin-task(s): /check%s%s%s</li>\n",
           (cfg_adminmask & ADM_FLUSHCACHE) ? " /flush_cache" : "",
           (cfg_adminmask & ADM_PURGECACHE) ? " /purge_cache" : "",
@@ -654,6 +843,7 @@ char *hdl_server_info (CONN *c, ics_request_args *a) {
       off+=snprintf(info+off, SINFOSIZ-off, "<li>Memlock: %s</li>\n", cfg_memlock ? "Yes" : "No");
       off+=snprintf(info+off, SINFOSIZ-off, "<li>Daemonized: %s</li>\n", cfg_daemonize ? "Yes" : "No");
       off+=snprintf(info+off, SINFOSIZ-off, "<li>Chroot: %s</li>\n", cfg_chroot ? cfg_chroot : "-");
+      off+=snprintf(info+off, SINFOSIZ-off, "<li>Index Cache: %s</li>\n", cfg_indexcache ? cfg_indexcache : "-");
       off+=snprintf(info+off, SINFOSIZ-off, "<li>SetUid/Gid: %s/%s</li>\n",
           cfg_username ? cfg_username : "-", cfg_groupname ? cfg_groupname : "-");
       off+=snprintf(info+off, SINFOSIZ-off, "<li>Log: %s</li>\n",
@@ -724,10 +914,15 @@ int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
   VInfo ji;
   unsigned short vid;
   void *cptr = NULL;
+  void *icptr = NULL;
   uint8_t *optr = NULL;
   size_t olen = 0;
   uint8_t *bptr = NULL;
   int err = 0;
+  int reserved = 0;
+  int retry_after = 0;
+  int64_t frame;
+  char xhdr[64];
 
   vid = dctrl_get_id(vc, dc, a->file_name);
   jvi_init(&ji);
@@ -735,6 +930,12 @@ int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
   if (a->frame < 0) a->frame = 0; // return error instead?
   if (a->out_width < 0 || a->out_width > 16384) a->out_width = 0;
   if (a->out_height < 0 || a->out_height > 16384) a->out_height = 0;
+  if (a->seekmode == SEEKMODE_KEY) {
+    /* the image of the keyframe is cached under its own number */
+    const int64_t kf = dctrl_get_keyframe(dc, vid, a->frame);
+    if (kf >= 0) a->frame = kf;
+  }
+  frame = a->frame;
 
   /* get canonical output width/height and corresponding buffersize */
   if ((err=dctrl_get_info_scale(dc, vid, &ji, a->out_width, a->out_height, a->decode_fmt)) || ji.buffersize < 1) {
@@ -751,16 +952,31 @@ int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
   /* try encoded cache if a->render_fmt != FMT_RAW */
   if (a->render_fmt != FMT_RAW) {
      optr = icache_get_buffer(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height, &olen, &cptr);
+     /* the first request encodes the image, identical
+      * concurrent ones wait for it in icache_get_buffer() */
+     if (olen == 0 && icache_reserve(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height) == 0) {
+       reserved = 1;
+     } else if (olen == 0) {
+       optr = icache_get_buffer(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height, &olen, &cptr);
+     }
   }
 
   if (olen == 0) {
     /* get frame from cache - or decode it into the cache */
-    bptr = vcache_get_buffer(vc, dc, vid, a->frame, ji.out_width, ji.out_height, a->decode_fmt, &cptr, &err);
+    DecoderHints dh;
+    memset(&dh, 0, sizeof(DecoderHints));
+    dh.threads = a->threads;
+    dh.seekmode = a->seekmode;
+    dh.priority = a->priority;
+    bptr = vcache_get_buffer(vc, dc, vid, a->frame, ji.out_width, ji.out_height, a->decode_fmt, &dh, &cptr, &err);
+    if (bptr) frame = dh.frame;
+    retry_after = dh.retry_after;
 
     if (!bptr) {
+      if (reserved) icache_cancel(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height);
       dlog(DLOG_ERR, "VID: error decoding video file for fd:%d err:%d\n", fd, err);
       if (err == 503) {
-        httperror(fd, 503, "Service Temporarily Unavailable", "<p>Video cache is unavailable. The server is currently busy or overloaded.</p>");
+        httperror_retry(fd, 503, retry_after, "Service Temporarily Unavailable", "<p>Video cache is unavailable. The server is currently busy or overloaded.</p>");
       } else {
         httperror(fd, 500, "Service Unavailable", "<p>No decoder or cache is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
       }
@@ -779,6 +995,25 @@ int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
   }
 
   if(olen > 0 && optr) {
+    if (bptr && a->render_fmt != FMT_RAW) {
+      /* image was read from raw frame cache end encoded just now.
+       * Publish it before sending, so that waiting requests continue. */
+      if (reserved && frame != a->frame) {
+        /* a different frame was delivered, it is not the reserved image */
+        icache_cancel(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height);
+        reserved = 0;
+      }
+      if (icache_add_buffer(ic, vid, frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height, optr, olen, &icptr)) {
+        /* not cached, wake up waiting requests now */
+        if (reserved)
+          icache_cancel(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height);
+      } else if (! (cfg_usermask & USR_KEEPRAW)) {
+        /* delete raw frame when encoded frame was cached */
+        vcache_invalidate_buffer(vc, cptr);
+      }
+      reserved = 0;
+    }
+
     debugmsg(DEBUG_ICS, "VID: sending %li bytes to fd:%d.\n", (long int) olen, fd);
     switch (a->render_fmt) {
       case FMT_RAW:
@@ -796,28 +1031,209 @@ int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
       default:
         h->ctype = "image/unknown";
     }
+    /* with seek=key or seek=nearest this can differ from the requested frame */
+    snprintf(xhdr, sizeof(xhdr), "X-Harvid-Frame: %"PRId64, frame);
+    h->extra = xhdr;
     http_tx(fd, 200, h, olen, optr);
 
-    if (bptr && a->render_fmt != FMT_RAW) {
-      /* image was read from raw frame cache end encoded just now */
-      if (icache_add_buffer(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height, optr, olen)) {
-        /* image was not added to image cache -> unreference the buffer */
-        free(optr);
-      } else if (! (cfg_usermask & USR_KEEPRAW)) {
-        /* delete raw frame when encoded frame was cached */
-        vcache_invalidate_buffer(vc, cptr);
-      }
+    if (bptr && a->render_fmt != FMT_RAW && !icptr) {
+      /* image was not added to image cache -> unreference the buffer */
+      free(optr);
     }
   } else {
     dlog(DLOG_ERR, "VID: error formatting image for fd:%d\n", fd);
     httperror(fd, 500, NULL, NULL);
   }
 
+  /* encoding failed, drop the reservation so that waiting requests continue */
+  if (reserved)
+    icache_cancel(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height);
+
   if (bptr)
     vcache_release_buffer(vc, cptr);
   else
     icache_release_buffer(ic, cptr);
+  icache_release_buffer(ic, icptr);
+
+  jvi_free(&ji);
+  return (0);
+}
+
+/* bulk request: frames start, start + stride, .. are decoded in one pass.
+ * Raw formats return the frames back to back, encoded formats
+ * a single image with the frames tiled left to right, top to bottom.
+ */
+#define RANGE_MAX_FRAMES 1024
+#define RANGE_MAX_BYTES (256 * 1024 * 1024)
+
+struct range_state {
+  uint8_t *out;     ///< raw frames or tiled RGB image
+  uint8_t *scratch; ///< decode buffer for a tile
+  VInfo *ji;
+  int64_t start;
+  size_t linesize;  ///< bytes per tile line in the decode format
+  int stride;
+  int cols;
+  int raw;
+};
+
+static uint8_t *range_get(void *arg, int64_t frame) {
+  struct range_state *rs = (struct range_state*) arg;
+  const int i = (frame - rs->start) / rs->stride;
+  if (rs->raw) return rs->out + i * rs->ji->buffersize;
+  return rs->scratch;
+}
+
+static void range_done(void *arg, int64_t frame, int ok) {
+  struct range_state *rs = (struct range_state*) arg;
+  const int i = (frame - rs->start) / rs->stride;
+  const size_t ls = rs->linesize;
+  uint8_t *dst;
+  int y;
+  if (rs->raw || !ok) return;
+  dst = rs->out + ((size_t)(i / rs->cols) * rs->ji->out_height * rs->cols + (i % rs->cols)) * ls;
+  for (y = 0; y < rs->ji->out_height; ++y) {
+    memcpy(dst + y * ls * rs->cols, rs->scratch + y * ls, ls);
+  }
+}
+
+int hdl_decode_range(int fd, httpheader *h, ics_request_args *a) {
+  VInfo ji, gi;
+  unsigned short vid;
+  struct range_state rs;
+  DecoderHints dh;
+  uint8_t *optr = NULL;
+  size_t olen = 0;
+  size_t bytes;
+  int64_t ticket;
+  int rows, err, retry_after;
+  int decode_fmt;
+  char xhdr[64];
+
+  vid = dctrl_get_id(vc, dc, a->file_name);
+  jvi_init(&ji);
+
+  if (a->frame < 0) a->frame = 0;
+  if (a->out_width < 0 || a->out_width > 16384) a->out_width = 0;
+  if (a->out_height < 0 || a->out_height > 16384) a->out_height = 0;
+  if (a->stride < 1) a->stride = 1;
+  if (a->count < 1 || a->count > RANGE_MAX_FRAMES) {
+    httperror(fd, 400, "Bad Request", "<p>Invalid frame count.</p>");
+    return 0;
+  }
+
+  /* image writers take packed RGB, raw output is delivered as requested */
+  decode_fmt = a->render_fmt == FMT_RAW ? a->decode_fmt : PIX_FMT_RGB24;
+
+  if ((err=dctrl_get_info_scale(dc, vid, &ji, a->out_width, a->out_height, decode_fmt)) || ji.buffersize < 1) {
+    if (err == 503) {
+      httperror(fd, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(fd, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+    return 0;
+  }
+
+  /* clamp the range to the file's duration */
+  if (ji.frames > 0 && a->frame + (int64_t)(a->count - 1) * a->stride >= ji.frames) {
+    if (a->frame >= ji.frames) {
+      httperror(fd, 400, "Bad Request", "<p>Start frame is beyond the end of the file.</p>");
+      return 0;
+    }
+    a->count = 1 + (ji.frames - 1 - a->frame) / a->stride;
+  }
+
+  memset(&rs, 0, sizeof(struct range_state));
+  rs.ji = &ji;
+  rs.start = a->frame;
+  rs.stride = a->stride;
+  rs.raw = a->render_fmt == FMT_RAW;
+  if (rs.raw) {
+    rs.cols = 1;
+    rows = a->count;
+    bytes = a->count * ji.buffersize;
+  } else {
+    rs.cols = a->cols > 0 ? a->cols : 16384 / ji.out_width;
+    if (rs.cols > a->count) rs.cols = a->count;
+    if (rs.cols < 1) rs.cols = 1;
+    rows = (a->count + rs.cols - 1) / rs.cols;
+    rs.linesize = ff_picture_bytesize(decode_fmt, ji.out_width, 1);
+    bytes = (size_t) rs.cols * rs.linesize * rows * ji.out_height;
+  }
+  if (bytes > RANGE_MAX_BYTES
+      || (!rs.raw && (rs.cols * ji.out_width > 16384 || rows * ji.out_height > 16384))) {
+    httperror(fd, 400, "Bad Request", "<p>Requested range is too large.</p>");
+    return 0;
+  }
+
+  /* reject before allocating anything if the decoders are overloaded */
+  if (dctrl_admit(dc, vid, a->count, &ticket, &retry_after)) {
+    httperror_retry(fd, 503, retry_after, "Service Temporarily Unavailable", "<p>The server is currently busy or overloaded.</p>");
+    return 0;
+  }
+
+  rs.out = calloc(1, bytes);
+  rs.scratch = rs.raw ? NULL : malloc(ji.buffersize);
+  if (!rs.out || (!rs.raw && !rs.scratch)) {
+    dctrl_admit_done(dc, vid, ticket);
+    free(rs.out);
+    free(rs.scratch);
+    httperror(fd, 503, "Service Temporarily Unavailable", "<p>Out of memory.</p>");
+    return 0;
+  }
+
+  memset(&dh, 0, sizeof(DecoderHints));
+  dh.threads = a->threads;
+  dh.seekmode = SEEKMODE_EXACT; // tiles and X-Harvid-Range refer to the requested frames
+  dh.priority = a->priority;
+  err = dctrl_decode_range(dc, vid, a->frame, a->count, a->stride,
+      ji.out_width, ji.out_height, decode_fmt, &dh, range_get, range_done, &rs);
+  dctrl_admit_done(dc, vid, ticket);
+
+  if (err) {
+    dlog(DLOG_ERR, "VID: error decoding frame range for fd:%d err:%d\n", fd, err);
+    if (err == 503) {
+      httperror(fd, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(fd, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+  } else {
+    if (rs.raw) {
+      olen = bytes;
+      optr = rs.out;
+      h->ctype = "image/raw";
+    } else {
+      gi = ji;
+      gi.out_width = rs.cols * ji.out_width;
+      gi.out_height = rows * ji.out_height;
+      olen = format_image(&optr, a->render_fmt, a->misc_int, &gi, rs.out);
+      switch (a->render_fmt) {
+        case FMT_JPG:
+          h->ctype = "image/jpeg";
+          break;
+        case FMT_PNG:
+          h->ctype = "image/png";
+          break;
+        case FMT_PPM:
+          h->ctype = "image/ppm";
+          break;
+        default:
+          h->ctype = "image/unknown";
+      }
+    }
+    if (olen > 0 && optr) {
+      snprintf(xhdr, sizeof(xhdr), "X-Harvid-Range: %"PRId64",%d,%d,%d", a->frame, a->count, a->stride, rs.cols);
+      h->extra = xhdr;
+      http_tx(fd, 200, h, olen, optr);
+    } else {
+      dlog(DLOG_ERR, "VID: error formatting image for fd:%d\n", fd);
+      httperror(fd, 500, NULL, NULL);
+    }
+    if (!rs.raw) free(optr);
+  }
 
+  free(rs.out);
+  free(rs.scratch);
   jvi_free(&ji);
   return (0);
 }
@@ -104,11 +104,23 @@ void send_http_header_fd(int fd , int s, httpheader *h) {
 }
 
 void httperror(int fd , int s, const char *title, const char *str) {
+  httperror_retry(fd, s, 0, title, str);
+}
+
+void httperror_retry(int fd , int s, int retry_after, const char *title, const char *str) {
   char hd[HTHSIZE];
+  char ra[16];
   int off = 0;
+  httpheader h;
+
+  memset(&h, 0, sizeof(httpheader));
+  if (retry_after > 0) {
+    snprintf(ra, sizeof(ra), "%d", retry_after);
+    h.retryafter = ra;
+  }
 
   const char *t = send_http_status_fd(fd, s);
-  send_http_header_fd(fd, s, NULL);
+  send_http_header_fd(fd, s, &h);
 
   if (!title) title = t;
   off += snprintf(hd+off, HTHSIZE-off, DOCTYPE HTMLOPEN);
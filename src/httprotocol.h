@@ -79,6 +79,16 @@ typedef struct {
  */
 void httperror(int fd , int s, const char *title, const char *str);
 
+/**
+ * send a HTTP error reply with a Retry-After header.
+ * @param fd socket file descriptor
+ * @param s HTTP status code (usually 503)
+ * @param retry_after seconds after which the client may retry (<1: default)
+ * @param title optional HTTP status-code message (may be NULL)
+ * @param str optional text body explaining the error (may be NULL)
+ */
+void httperror_retry(int fd , int s, int retry_after, const char *title, const char *str);
+
 /**
  * send HTTP reply status, header and transmit data.
  * @param fd socket file descriptor
@@ -25,6 +25,7 @@
 
 #include <dlog.h>
 #include <ffcompat.h> // harvid.h
+#include <vinfo.h> // seek modes
 #include "httprotocol.h"
 #include "ics_handler.h"
 #include "htmlconst.h"
@@ -99,6 +100,24 @@ void parse_param(struct queryparserstate *qps, char *kvp) {
     qps->a->out_width  = atoi(val);
   } else if (!strcmp (kvp, "h")) {
     qps->a->out_height = atoi(val);
+  } else if (!strcmp (kvp, "threads")) {
+    qps->a->threads = atoi(val);
+    if (qps->a->threads < 0) qps->a->threads = 0;
+  } else if (!strcmp (kvp, "count")) {
+    qps->a->count = atoi(val);
+  } else if (!strcmp (kvp, "stride")) {
+    qps->a->stride = atoi(val);
+  } else if (!strcmp (kvp, "cols")) {
+    qps->a->cols = atoi(val);
+  } else if (!strcmp (kvp, "seek")) {
+         if (!strcmp(val, "exact"))    qps->a->seekmode = SEEKMODE_EXACT;
+    else if (!strcmp(val, "key"))      qps->a->seekmode = SEEKMODE_KEY;
+    else if (!strcmp(val, "keyframe")) qps->a->seekmode = SEEKMODE_KEY;
+    else if (!strcmp(val, "nearest"))  qps->a->seekmode = SEEKMODE_NEAREST;
+  } else if (!strcmp (kvp, "prio")) {
+         if (!strcmp(val, "interactive")) qps->a->priority = DPRIO_INTERACTIVE;
+    else if (!strcmp(val, "prefetch"))    qps->a->priority = DPRIO_PREFETCH;
+    else if (!strcmp(val, "bulk"))        qps->a->priority = DPRIO_BULK;
   } else if (!strcmp (kvp, "file")) {
     qps->fn = url_unescape(val, 0, NULL);
     qps->doit |= 2;
@@ -145,6 +164,12 @@ static int parse_http_query(CONN *c, char *query, httpheader *h, ics_request_arg
   a->render_fmt = FMT_PNG;
   a->frame = 0;
   a->misc_int = 0;
+  a->threads = 0;
+  a->seekmode = SEEKMODE_EXACT;
+  a->count = 1;
+  a->stride = 1;
+  a->cols = 0;
+  a->priority = -1;
   a->out_width = a->out_height = -1; // auto-set
 
   parse_http_query_params(&qps, query);
@@ -190,6 +215,7 @@ static int parse_http_query(CONN *c, char *query, httpheader *h, ics_request_arg
 
 // harvid.c
 int   hdl_decode_frame (int fd, httpheader *h, ics_request_args *a);
+int   hdl_decode_range (int fd, httpheader *h, ics_request_args *a);
 char *hdl_homepage_html (CONN *c);
 char *hdl_server_status_html (CONN *c);
 char *hdl_file_info (CONN *c, ics_request_args *a);
@@ -294,6 +320,22 @@ void ics_http_handler(
     if (a.file_name) free(a.file_name);
     if (a.file_qurl) free(a.file_qurl);
     c->run = 0;
+  } else if (CTP("/range")) {
+    ics_request_args a;
+    httpheader h;
+    memset(&a, 0, sizeof(ics_request_args));
+    memset(&h, 0, sizeof(httpheader));
+    int rv = parse_http_query(c, query, &h, &a);
+    if (rv < 0) {
+      ;
+    } else if (rv == 3) {
+      hdl_decode_range(c->fd, &h, &a);
+    } else {
+      httperror(c->fd, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+    }
+    if (a.file_name) free(a.file_name);
+    if (a.file_qurl) free(a.file_qurl);
+    c->run = 0;
   } else if (CTP("/info")) { /* /info -> /file/info !! */
     ics_request_args a;
     memset(&a, 0, sizeof(ics_request_args));
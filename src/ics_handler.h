@@ -37,6 +37,12 @@ typedef struct {
   int out_height;
   int idx_option;
   int misc_int; // currently used for jpeg quality only
+  int threads;  // codec-threads hint, 0: server default
+  int seekmode; // SEEKMODE_EXACT, SEEKMODE_KEY or SEEKMODE_NEAREST
+  int count;    // range: number of frames
+  int stride;   // range: frame increment
+  int cols;     // range: frames per row of the image, 0: auto
+  int priority; // DPRIO_INTERACTIVE, DPRIO_PREFETCH, DPRIO_BULK, -1: by request type
 } ics_request_args;
 
 void ics_http_handler(
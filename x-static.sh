@@ -67,8 +67,11 @@ LIBHARVID_SRC=" \
  libharvid/ffdecoder.c \
  libharvid/frame_cache.c \
  libharvid/image_cache.c \
+ libharvid/slab.c \
  libharvid/timecode.c \
  libharvid/vinfo.c \
+ libharvid/waitq.c \
+ libharvid/zframe_cache.c \
  "
 
 # compile harvid